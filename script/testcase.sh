@@ -142,4 +142,271 @@ echo '\nError cases\n'
 bin/heartyfs_read /dir1/dir2/dir4/fil.txt /tmp/heartyfs_example.txt 
 
 echo '\nValid cases\n'
-bin/heartyfs_read /dir1/dir2/dir4/file1.txt
\ No newline at end of file
+bin/heartyfs_read /dir1/dir2/dir4/file1.txt
+
+# Snapshot cases
+# create s1, write more into file1.txt   # the snapshot keeps the old content
+# /@s1/dir1/dir2/dir4/file1.txt          # read through the snapshot
+# /@s1/dir7                              # snapshots are read-only
+echo '\n--Snapshot cases--\n'
+bin/heartyfs_snapshot create s1
+bin/heartyfs_write /dir1/dir2/dir4/file1.txt /tmp/heartyfs_example.txt
+
+echo '\nValid cases\n'
+bin/heartyfs_read /@s1/dir1/dir2/dir4/file1.txt
+bin/heartyfs_read /dir1/dir2/dir4/file1.txt
+bin/heartyfs_snapshot list
+
+echo '\nError cases\n'
+bin/heartyfs_mkdir /@s1/dir7
+bin/heartyfs_snapshot create s1
+
+echo '\nDelete the snapshot\n'
+bin/heartyfs_snapshot delete s1
+bin/heartyfs_snapshot list
+
+# Dedup cases
+# /dir1/dir3/file4.txt and /dir1/dir3/file5.txt hold the same content   # the second write shares the block
+echo '\n--Dedup cases--\n'
+bin/heartyfs_creat /dir1/dir3/file4.txt
+bin/heartyfs_creat /dir1/dir3/file5.txt
+HEARTYFS_DEDUP=1 HEARTYFS_STATS=1 bin/heartyfs_write /dir1/dir3/file4.txt /tmp/heartyfs_example.txt
+HEARTYFS_DEDUP=1 HEARTYFS_STATS=1 bin/heartyfs_write /dir1/dir3/file5.txt /tmp/heartyfs_example.txt
+bin/heartyfs_read /dir1/dir3/file5.txt
+bin/heartyfs_rm /dir1/dir3/file4.txt
+bin/heartyfs_read /dir1/dir3/file5.txt
+
+# Compression cases
+# /dir1/dir3/file6.txt written with HEARTYFS_COMPRESS=1   # stored as frames, read back transparently
+echo '\n--Compression cases--\n'
+seq 1 300 | sed 's/$/ I Love hearty filesystem!/' > /tmp/heartyfs_example_long.txt
+bin/heartyfs_creat /dir1/dir3/file6.txt
+HEARTYFS_COMPRESS=1 HEARTYFS_STATS=1 bin/heartyfs_write /dir1/dir3/file6.txt /tmp/heartyfs_example_long.txt
+bin/heartyfs_read /dir1/dir3/file6.txt | tail -3
+
+# Listing cases
+# /dir1/dir3            # the files with their sizes
+# -R /                  # the whole tree, directory by directory
+echo '\n--Listing cases--\n'
+bin/heartyfs_ls /dir1/dir3
+bin/heartyfs_ls -R /
+
+# Moving cases
+# /dir1/dir3/file5.txt -> /dir1/dir3/file7.txt   # rename in place
+# /dir1/dir3/file7.txt -> /dir1/dir2             # move into an existing directory
+# /dir1/dir3 -> /dir1/dir3/dir8                  # a directory can not move below itself
+echo '\n--Moving cases--\n'
+bin/heartyfs_mv /dir1/dir3/file5.txt /dir1/dir3/file7.txt
+bin/heartyfs_mv /dir1/dir3/file7.txt /dir1/dir2
+bin/heartyfs_mv /dir1/dir3 /dir1/dir3/dir8
+bin/heartyfs_read /dir1/dir2/file7.txt
+
+# Hard link cases
+# /dir1/dir2/file7.txt also named /dir6/file7.txt   # both names show 2 links
+# rm the first name                                 # the file stays under the second name
+echo '\n--Hard link cases--\n'
+bin/heartyfs_mkdir /dir6
+bin/heartyfs_link /dir1/dir2/file7.txt /dir6/file7.txt
+bin/heartyfs_ls /dir6
+bin/heartyfs_rm /dir1/dir2/file7.txt
+bin/heartyfs_read /dir6/file7.txt
+
+# Defragmentation cases
+# -n                    # only the score
+# 0                     # move fragmented files into contiguous runs, unthrottled
+echo '\n--Defragmentation cases--\n'
+bin/heartyfs_defrag -n
+bin/heartyfs_defrag 0
+bin/heartyfs_read /dir1/dir3/file6.txt | tail -3
+
+# Checksum cases
+# HEARTYFS_CHECKSUM=1   # adds the checksum table, then the scrub finds nothing
+# a flipped byte in the last block is found by the scrub, and gone once restored
+echo '\n--Checksum cases--\n'
+HEARTYFS_CHECKSUM=1 bin/heartyfs_scrub 4
+printf 'x' | dd of=/tmp/heartyfs bs=1 seek=$((2047 * 512)) conv=notrunc 2>/dev/null
+bin/heartyfs_scrub 4
+printf '\0' | dd of=/tmp/heartyfs bs=1 seek=$((2047 * 512)) conv=notrunc 2>/dev/null
+bin/heartyfs_scrub 4
+
+# Import and export cases
+# a host tree of two files and a subdirectory goes into /dir9 in one run,
+# and comes back out unchanged
+echo '\n--Import and export cases--\n'
+rm -rf /tmp/heartyfs_import /tmp/heartyfs_export
+mkdir -p /tmp/heartyfs_import/sub
+cp /tmp/heartyfs_example.txt /tmp/heartyfs_import/a.txt
+cp /tmp/heartyfs_example_long.txt /tmp/heartyfs_import/sub/b.txt
+bin/heartyfs_mkdir /dir9
+bin/heartyfs_import /tmp/heartyfs_import /dir9 2
+bin/heartyfs_ls -R /dir9
+bin/heartyfs_export /dir9 /tmp/heartyfs_export
+diff -r /tmp/heartyfs_import /tmp/heartyfs_export && echo "Success: The exported tree matches"
+
+# Parallel read cases
+# /dir9/sub/b.txt -o host file   # copied out by the parallel read path
+echo '\n--Parallel read cases--\n'
+bin/heartyfs_read /dir9/sub/b.txt -o /tmp/heartyfs_read_out.txt 2
+cmp /tmp/heartyfs_read_out.txt /tmp/heartyfs_example_long.txt && echo "Success: The copy matches"
+
+# Durability cases
+# HEARTYFS_DURABILITY=group   # entries of an import are flushed in groups of two
+# HEARTYFS_DURABILITY=async   # nothing is flushed, the kernel writes the image
+echo '\n--Durability cases--\n'
+HEARTYFS_DURABILITY=group HEARTYFS_GROUP_OPS=2 HEARTYFS_STATS=1 bin/heartyfs_import /tmp/heartyfs_import /dir1/dir3 | grep -v "fsync " | sed "s/ fsync_avg=.*//"
+HEARTYFS_DURABILITY=async HEARTYFS_STATS=1 bin/heartyfs_rm /dir1/dir3/a.txt | grep "durability" | sed "s/ fsync_avg=.*//"
+bin/heartyfs_ls /dir1/dir3
+
+# Directory entry cases
+# a 60-character name works end to end, and a directory holds more than 14 short names
+echo '\n--Directory entry cases--\n'
+LONG_NAME=a_file_name_far_longer_than_the_old_limit_of_27_characters_x
+bin/heartyfs_mkdir /dir10 > /dev/null
+bin/heartyfs_creat /dir10/$LONG_NAME | tail -1
+bin/heartyfs_write /dir10/$LONG_NAME /tmp/heartyfs_example.txt > /dev/null
+bin/heartyfs_read /dir10/$LONG_NAME | grep "block 0"
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do bin/heartyfs_creat /dir10/f$i > /dev/null; done
+bin/heartyfs_ls / | grep dir10
+
+# Metadata cases
+# /dir9/a.txt kept the mode and mtime of the host file it was imported from,
+# and keeps its xattrs in one extra block; a file still holds 119 data blocks (60452 bytes)
+echo '\n--Metadata cases--\n'
+bin/heartyfs_stat /dir9/a.txt | grep "a.txt" | sed "s/, uid .*//"
+[ "$(bin/heartyfs_stat /dir9/a.txt | grep mtime | cut -d' ' -f4 | cut -d. -f1)" = "$(stat -c %Y /tmp/heartyfs_import/a.txt)" ] && echo "Success: The mtime matches the host file"
+bin/heartyfs_xattr /dir9/a.txt user.etag 5f2a9c | tail -1
+bin/heartyfs_xattr /dir9/a.txt user.gen 7 | tail -1
+bin/heartyfs_xattr -d /dir9/a.txt user.gen | tail -1
+bin/heartyfs_stat /dir9/a.txt | grep xattr
+bin/heartyfs_stat /dir9/a.txt | grep "a.txt" | sed "s/, uid .*//"
+head -c 60452 /dev/zero | tr '\0' y > /tmp/heartyfs_full.txt
+bin/heartyfs_creat /dir9/full.txt > /dev/null
+bin/heartyfs_write /dir9/full.txt /tmp/heartyfs_full.txt | tail -1
+bin/heartyfs_read /dir9/full.txt -o /tmp/heartyfs_out.txt | tail -1
+bin/heartyfs_rm /dir9/full.txt > /dev/null
+
+# Quota cases
+# /dir11 is limited to 4 blocks: its own block, the inode of a.txt and two data blocks,
+# so writing the long example stops with the quota error and rm gives the blocks back
+echo '\n--Quota cases--\n'
+bin/heartyfs_quota /dir10 | tail -1
+bin/heartyfs_mkdir /dir11 > /dev/null
+bin/heartyfs_quota /dir11 4 | tail -1
+bin/heartyfs_creat /dir11/a.txt > /dev/null
+bin/heartyfs_write /dir11/a.txt /tmp/heartyfs_example_long.txt | grep quota
+bin/heartyfs_quota /dir11 | tail -1
+bin/heartyfs_rm /dir11/a.txt > /dev/null
+bin/heartyfs_quota /dir11 0 | tail -1
+
+# Stress cases
+# Seeded random mkdir/creat/write/read/rm/rmdir on a scratch image, checked after every step
+# against the bitmaps and a shadow model, on one worker and on four sharing the image
+echo '\n--Stress cases--\n'
+bin/heartyfs_stress 7 500 | grep -v "ops/s"
+bin/heartyfs_stress 7 200 4 | grep -v "ops/s"
+
+# Share count overflow cases
+# Three files of 100 identical blocks fill the share count of one deduped block, so
+# copying f1 away from snapshot s2 must copy that block instead of wrapping its count
+echo '\n--Share count overflow cases--\n'
+head -c $((100 * 508)) /dev/zero | tr '\0' x > /tmp/heartyfs_same.txt
+echo tail > /tmp/heartyfs_tail.txt
+bin/heartyfs_mkdir /dir12 > /dev/null
+for f in f1 f2 f3
+do
+    bin/heartyfs_creat /dir12/$f > /dev/null
+    HEARTYFS_DEDUP=1 bin/heartyfs_write /dir12/$f /tmp/heartyfs_same.txt > /dev/null
+done
+bin/heartyfs_snapshot create s2 | tail -1
+HEARTYFS_DEDUP=1 bin/heartyfs_write /dir12/f1 /tmp/heartyfs_tail.txt > /dev/null
+for f in f1 f2 f3; do bin/heartyfs_rm /dir12/$f > /dev/null; done
+bin/heartyfs_creat /dir12/g > /dev/null
+HEARTYFS_DEDUP=1 bin/heartyfs_write /dir12/g /tmp/heartyfs_same.txt > /dev/null
+bin/heartyfs_read /@s2/dir12/f1 -o /tmp/heartyfs_out.txt | tail -1
+cmp /tmp/heartyfs_out.txt /tmp/heartyfs_same.txt && echo "Success: The snapshot kept f1"
+bin/heartyfs_snapshot delete s2 | tail -1
+bin/heartyfs_rm /dir12/g > /dev/null
+bin/heartyfs_rmdir /dir12 > /dev/null
+
+# Unlink under a snapshot cases
+# /dir13/a has a second name b when s3 is taken, so removing a leaves s3 with 2 links
+echo '\n--Unlink under a snapshot cases--\n'
+bin/heartyfs_mkdir /dir13 > /dev/null
+bin/heartyfs_creat /dir13/a > /dev/null
+bin/heartyfs_link /dir13/a /dir13/b > /dev/null
+bin/heartyfs_snapshot create s3 | tail -1
+bin/heartyfs_rm /dir13/a | grep Removed
+bin/heartyfs_ls /@s3/dir13 | tail -1
+bin/heartyfs_ls /dir13 | tail -1
+bin/heartyfs_snapshot delete s3 | tail -1
+bin/heartyfs_rm /dir13/b > /dev/null
+bin/heartyfs_rmdir /dir13 > /dev/null
+
+# Small cache cases
+# With a 32-block cache only 16 blocks can be pinned: a file 18 directories deep is written and
+# read back whole, and importing 20 files into one directory keeps room for every inode
+echo '\n--Small cache cases--\n'
+DEEP_PATH=""
+for i in $(seq 1 18); do DEEP_PATH=$DEEP_PATH/d$i; HEARTYFS_BACKEND=pread HEARTYFS_CACHE_BLOCKS=32 bin/heartyfs_mkdir $DEEP_PATH > /dev/null; done
+yes "I Love hearty filesystem!" | head -c 43893 > /tmp/heartyfs_deep.txt
+HEARTYFS_BACKEND=pread HEARTYFS_CACHE_BLOCKS=32 bin/heartyfs_creat $DEEP_PATH/f > /dev/null
+HEARTYFS_BACKEND=pread HEARTYFS_CACHE_BLOCKS=32 bin/heartyfs_write $DEEP_PATH/f /tmp/heartyfs_deep.txt > /dev/null
+HEARTYFS_BACKEND=pread HEARTYFS_CACHE_BLOCKS=32 bin/heartyfs_read $DEEP_PATH/f -o /tmp/heartyfs_out.txt | tail -1
+cmp -s /tmp/heartyfs_out.txt /tmp/heartyfs_deep.txt && echo "Success: The deep file matches"
+rm -rf /tmp/heartyfs_import_many && mkdir -p /tmp/heartyfs_import_many
+for i in $(seq 1 20); do cp /tmp/heartyfs_example.txt /tmp/heartyfs_import_many/f$i.txt; done
+HEARTYFS_BACKEND=pread HEARTYFS_CACHE_BLOCKS=32 bin/heartyfs_import /tmp/heartyfs_import_many /d1 | tail -1
+bin/heartyfs_rm $DEEP_PATH/f > /dev/null
+for i in $(seq 1 20); do bin/heartyfs_rm /d1/f$i.txt > /dev/null; done
+for i in $(seq 18 -1 1); do bin/heartyfs_rmdir $DEEP_PATH > /dev/null; DEEP_PATH=${DEEP_PATH%/d$i}; done
+
+# Upgrade cases
+# /dir14 is made to look like an image from before the inode metadata: the 27-byte name
+# goes back where the name copy was, the link count is cleared and the format is set back.
+# The upgrade counts the two names again, so a write after s4 leaves s4 as it was.
+echo '\n--Upgrade cases--\n'
+UP_NAME=abcdefghijklmnopqrstuvwxyz0
+bin/heartyfs_mkdir /dir14 > /dev/null
+bin/heartyfs_creat /dir14/$UP_NAME > /dev/null
+bin/heartyfs_write /dir14/$UP_NAME /tmp/heartyfs_example_long.txt > /dev/null
+bin/heartyfs_link /dir14/$UP_NAME /dir14/b > /dev/null
+UP_BLOCK=$(bin/heartyfs_stat /dir14/b | grep "/dir14/b:" | sed "s/.*block \([0-9]*\),.*/\1/")
+printf "%s\000" $UP_NAME | dd of=/tmp/heartyfs bs=1 seek=$((UP_BLOCK * 512 + 4)) conv=notrunc 2> /dev/null
+printf "\000\000" | dd of=/tmp/heartyfs bs=1 seek=$((UP_BLOCK * 512 + 34)) conv=notrunc 2> /dev/null
+printf "\001\000\000\000" | dd of=/tmp/heartyfs bs=1 seek=12 conv=notrunc 2> /dev/null
+bin/heartyfs_stat /dir14/b | grep "/dir14/b:" | sed "s/, mode .*//"
+bin/heartyfs_snapshot create s4 | tail -1
+bin/heartyfs_write /dir14/$UP_NAME /tmp/heartyfs_example.txt > /dev/null
+bin/heartyfs_read /@s4/dir14/$UP_NAME -o /tmp/heartyfs_out.txt | tail -1
+cmp -s /tmp/heartyfs_out.txt /tmp/heartyfs_example_long.txt && echo "Success: s4 still has the old content"
+bin/heartyfs_rm /dir14/b | grep Removed
+bin/heartyfs_stat /@s4/dir14/b | grep "/dir14/b:" | sed "s/, mode .*//"
+bin/heartyfs_snapshot delete s4 | tail -1
+bin/heartyfs_rm /dir14/$UP_NAME > /dev/null
+bin/heartyfs_rmdir /dir14 > /dev/null
+
+# Resize cases
+# The image grows from 1M to 2M, which fills the first block group (4096 blocks) and moves
+# the checksum table, then to 3M, which adds a second group. Files are written until one
+# lands past block 4096 and it reads back whole; the scrub finds nothing. It cannot shrink,
+# and cannot grow past HEARTYFS_MAX_BLOCKS.
+echo '\n--Resize cases--\n'
+bin/heartyfs_resize 512K | tail -1
+bin/heartyfs_resize +1M | tail -1
+bin/heartyfs_read /dir10/$LONG_NAME | grep "block 0"
+bin/heartyfs_resize +1M | tail -1
+bin/heartyfs_resize 9M | tail -1
+bin/heartyfs_mkdir /dir16 > /dev/null
+for i in $(seq 1 60); do
+    bin/heartyfs_creat /dir16/g$i > /dev/null
+    bin/heartyfs_write /dir16/g$i /tmp/heartyfs_full.txt > /dev/null
+    GROUP_BLOCK=$(bin/heartyfs_stat /dir16/g$i | grep "/dir16/g$i:" | sed "s/.*block \([0-9]*\),.*/\1/")
+    [ "$GROUP_BLOCK" -gt 4096 ] && break
+done
+[ "$GROUP_BLOCK" -gt 4096 ] && echo "Success: /dir16/g$i is in the second block group"
+bin/heartyfs_read /dir16/g$i -o /tmp/heartyfs_out.txt | tail -1
+cmp -s /tmp/heartyfs_out.txt /tmp/heartyfs_full.txt && echo "Success: The copy matches"
+bin/heartyfs_scrub 4 | tail -1
+
+# Put the image back to its original size for the next run
+truncate -s 0 /tmp/heartyfs && truncate -s 1M /tmp/heartyfs
@@ -0,0 +1,190 @@
+/*
+ * heartyfs_bench_dedup.c
+ *
+ * Brief
+ * - This program measures inline deduplication. It writes the same set of near-identical
+ *   config blobs into a scratch image twice, once with dedup off and once with it on, and
+ *   reports the blocks used, the dedup ratio, and the write throughput of both runs.
+ *
+ * Data Structures:
+ * - A scratch image at BENCH_DISK_PATH, formatted with `heartyfs_format` for every run.
+ * - Config blobs: BENCH_FILES files of BENCH_BLOCKS_PER_FILE blocks that differ only in
+ *   their first block, like per-host copies of the same configuration.
+ *
+ * Design Decisions:
+ * - Runs in-process on the library calls used by heartyfs_write, so the timings measure
+ *   hashing, lookup and allocation, not process start-up.
+ * - Uses its own image so the benchmark never touches /tmp/heartyfs.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "../heartyfs.h"
+#include <time.h>
+
+#define BENCH_DISK_PATH "/tmp/heartyfs_bench"
+#define BENCH_FILES 60
+#define BENCH_BLOCKS_PER_FILE 6
+#define BENCH_FILES_PER_DIR 12
+#define BENCH_ROUNDS 5
+
+/*
+ * @brief Fills one block of a config blob. Only block 0 depends on the file number.
+ */
+void fill_blob_block(char *data, int file_index, int block_index)
+{
+    memset(data, 0, DATA_BLOCK_SIZE);
+    int length = 0;
+    int line = 0;
+    while (length < DATA_BLOCK_SIZE - 40)
+    {
+        if (block_index == 0 && line == 0)
+        {
+            length += snprintf(data + length, DATA_BLOCK_SIZE - length, "hostname = node-%03d\n", file_index);
+        }
+        else
+        {
+            length += snprintf(data + length, DATA_BLOCK_SIZE - length, "option_%d_%d = enabled\n",
+                                block_index, line);
+        }
+        line++;
+    }
+}
+
+/*
+ * @brief Adds an entry to a directory like create_entry, without its progress message.
+ */
+int add_entry(struct heartyfs_dev *dev, struct heartyfs_directory *dir, char *name, int block_id)
+{
+    if (dir_add(dir, name, block_id) != 1) return -1;
+    heartyfs_dirty(dev, dir);
+    return 1;
+}
+
+/*
+ * @brief Creates a directory under the root and returns it, or NULL on failure.
+ */
+struct heartyfs_directory *make_dir(struct heartyfs_dev *dev, uint8_t *bitmap, char *name)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    int block_id = take_block(dev, bitmap);
+    if (block_id < 0) return NULL;
+    struct heartyfs_directory *dir = heartyfs_block(dev, block_id);
+    memset(dir, 0, BLOCK_SIZE);
+    dir->type = 1;
+    snprintf(dir->name, sizeof(dir->name), "%s", name);
+    add_entry(dev, dir, ".", block_id);
+    add_entry(dev, dir, "..", 0);
+    if (!heartyfs_pin(dev, dir)) return NULL;
+    if (add_entry(dev, superblock->root_dir, name, block_id) != 1) return NULL;
+    return dir;
+}
+
+/*
+ * @brief Creates an empty file in dir and returns its inode, or NULL on failure.
+ */
+struct heartyfs_inode *make_file(struct heartyfs_dev *dev, uint8_t *bitmap,
+                                    struct heartyfs_directory *dir, char *name)
+{
+    int block_id = take_block(dev, bitmap);
+    if (block_id < 0) return NULL;
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    heartyfs_inode_init(dev, inode);
+    if (add_entry(dev, dir, name, block_id) != 1) return NULL;
+    return inode;
+}
+
+/*
+ * @brief Formats the scratch image, writes every blob, and reports the result.
+ *
+ * @param dedup         1 to share identical blocks, 0 to always allocate.
+ * @return int          0 on success, -1 on failure.
+ */
+int run(int dedup)
+{
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, BENCH_DISK_PATH) < 0) return -1;
+    dev.dedup = dedup;
+
+    double total_seconds = 0;
+    int used_blocks = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        heartyfs_format(&dev);
+        struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+        uint8_t *bitmap = heartyfs_block(&dev, 1);
+        int free_before = superblock->free_blocks;
+
+        // Namespace first, so only data writes are timed
+        struct heartyfs_inode *inodes[BENCH_FILES];
+        struct heartyfs_directory *dir = NULL;
+        for (int i = 0; i < BENCH_FILES; i++)
+        {
+            char name[CHAR_SIZE];
+            if (i % BENCH_FILES_PER_DIR == 0)
+            {
+                snprintf(name, sizeof(name), "dir%d", i / BENCH_FILES_PER_DIR);
+                dir = make_dir(&dev, bitmap, name);
+            }
+            snprintf(name, sizeof(name), "host%03d.conf", i);
+            inodes[i] = dir == NULL ? NULL : make_file(&dev, bitmap, dir, name);
+            if (inodes[i] == NULL || !heartyfs_pin(&dev, inodes[i]))
+            {
+                printf("Error: Cannot create the benchmark files\n");
+                heartyfs_dev_close(&dev);
+                return -1;
+            }
+        }
+        int metadata_blocks = free_before - superblock->free_blocks;
+
+        struct timespec start, end;
+        char data[DATA_BLOCK_SIZE];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_FILES; i++)
+        {
+            for (int j = 0; j < BENCH_BLOCKS_PER_FILE; j++)
+            {
+                fill_blob_block(data, i, j);
+                if (write_datablock(&dev, bitmap, inodes[i], data, DATA_BLOCK_SIZE) != 1)
+                {
+                    heartyfs_dev_close(&dev);
+                    return -1;
+                }
+                inodes[i]->length += DATA_BLOCK_SIZE;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        used_blocks = free_before - superblock->free_blocks - metadata_blocks;
+    }
+
+    long logical_blocks = (long) BENCH_FILES * BENCH_BLOCKS_PER_FILE;
+    double megabytes = (double) logical_blocks * DATA_BLOCK_SIZE * BENCH_ROUNDS / (1 << 20);
+    printf("Result: dedup=%s logical_blocks=%ld used_blocks=%d ratio=%.2fx throughput=%.1f MB/s\n",
+            dedup ? "on " : "off", logical_blocks, used_blocks,
+            (double) logical_blocks / used_blocks, megabytes / total_seconds);
+    heartyfs_dev_close(&dev);
+    return 0;
+}
+
+int main()
+{
+    printf("heartyfs_bench_dedup\n");
+
+    // Create the scratch image
+    int fd = open(BENCH_DISK_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, DISK_SIZE) < 0)
+    {
+        perror("Cannot create the benchmark disk file\n");
+        exit(1);
+    }
+    close(fd);
+
+    if (run(0) < 0 || run(1) < 0)
+    {
+        printf("Error: The benchmark failed\n");
+        exit(1);
+    }
+    unlink(BENCH_DISK_PATH);
+    return 0;
+}
@@ -0,0 +1,845 @@
+/*
+ * heartyfs_stress.c
+ *
+ * Brief
+ * - This program stress tests the library. Workers run seeded random sequences of mkdir,
+ *   creat, write, read, rm and rmdir on a scratch image, check the image after every step,
+ *   and report the throughput. The same seed gives the same sequence, so a failure can be
+ *   replayed:
+ *
+ *       bin/heartyfs_stress                    # seed 1, 2000 steps, one worker
+ *       bin/heartyfs_stress 42 10000 4         # seed 42, 10000 steps on each of 4 workers
+ *       bin/heartyfs_stress 42 10000 4 0       # the same, checking only at the end
+ *
+ * Data Structures:
+ * - `stress_node`: The shadow model, one node per file or directory a worker created: its
+ *   path and, for a file, the bytes it should hold.
+ * - `stress_worker`: One worker: its random state, shadow model and counters. Worker i owns
+ *   the directory /w<i>, so its shadow model stays exact however the workers interleave.
+ *
+ * Design Decisions:
+ * - Steps make the calls the tools and the FUSE frontend make, quota charges included, so
+ *   the checks cover the paths users take.
+ * - The image check finds blocks reached from the tree but marked free, used blocks that
+ *   nothing reaches (leaks, found in the step that leaked them), a free_blocks count that
+ *   differs from the bitmaps, share counts that differ from the owners found, and directory
+ *   usage that differs from the subtree. The file a step wrote or read must read back as the
+ *   shadow model says.
+ * - One worker keeps the image locked and commits every step, like the FUSE frontend. Several
+ *   workers each open the image and lock it for every step, like tools run side by side,
+ *   which also covers the reload of the bitmaps and the cache between processes.
+ * - At the end the whole tree is compared with the shadow model and removed, and the image
+ *   must have the free blocks of an empty image again.
+ * - Library messages go to /dev/null, the report to the original stdout. The settings of the
+ *   device apply (HEARTYFS_BACKEND, HEARTYFS_CACHE_BLOCKS, HEARTYFS_DEDUP, HEARTYFS_COMPRESS,
+ *   HEARTYFS_CHECKSUM, HEARTYFS_DURABILITY). Checks run under the image lock and are not
+ *   counted as operation time; with several workers, check_every 0 measures throughput alone.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "../heartyfs.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define STRESS_DISK_PATH "/tmp/heartyfs_stress"
+#define STRESS_DISK_BLOCKS (2 * BLOCK_GROUP_SIZE)
+#define STRESS_MAX_THREADS 8
+#define STRESS_MAX_NODES 128
+#define STRESS_MAX_DEPTH 5
+#define STRESS_PATH_SIZE 64
+#define STRESS_MAX_WRITE (3 * COMPRESS_UNIT_SIZE)
+#define STRESS_MKDIR 0
+#define STRESS_CREAT 1
+#define STRESS_WRITE 2
+#define STRESS_READ 3
+#define STRESS_RM 4
+#define STRESS_RMDIR 5
+#define STRESS_OPS 6
+#define STRESS_TEARDOWN STRESS_OPS
+
+static const char *op_names[STRESS_OPS + 1] = {"mkdir", "creat", "write", "read", "rm", "rmdir", "teardown"};
+static FILE *report;    // The original stdout
+
+struct stress_node
+{
+    char path[STRESS_PATH_SIZE];    // Path on the image
+    int live;                       // 1 while the entry exists
+    int is_dir;                     // 1 for a directory
+    int parent;                     // Node of the parent directory, -1 for the root directory
+    int depth;                      // Directories above it, the root directory excluded
+    int children;                   // Live entries of a directory
+    char *data;                     // Bytes a file should hold
+    long length;                    // Length of data
+};
+
+struct stress_worker
+{
+    int index;                      // Owns /w<index>
+    pthread_t thread;
+    uint64_t random;                // xorshift64* state
+    int steps;                      // Steps to run
+    int check_every;                // Check the image every that many steps, 0 at the end only
+    int shared;                     // 1 when other workers use the image too
+    struct stress_node nodes[STRESS_MAX_NODES];     // Node 0 is /w<index>
+    long ops[STRESS_OPS];           // Steps run, by operation
+    long refused;                   // Steps the library refused, such as a full disk
+    long bytes_written;
+    long bytes_read;
+    double op_seconds;              // Time in steps, checks excluded
+    double check_seconds;           // Time in checks
+    int step;                       // The step running, for the report
+    int op;                         // The operation running
+    int metadata_blocks;            // Blocks of file system metadata at the last check
+    int failed;                     // 1 once a check failed
+    char problem[256];              // What the first failed check found
+};
+
+/*
+ * @brief Returns the next number of a worker's random sequence (xorshift64*).
+ */
+static uint64_t next_random(struct stress_worker *worker)
+{
+    worker->random ^= worker->random >> 12;
+    worker->random ^= worker->random << 25;
+    worker->random ^= worker->random >> 27;
+    return worker->random * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * @brief Returns the seconds elapsed since start.
+ */
+static double seconds_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * @brief Records the first problem a worker found.
+ *
+ * @return int          Always -1, so checks can return it.
+ */
+static int fail(struct stress_worker *worker, const char *format, ...)
+{
+    if (!worker->failed)
+    {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(worker->problem, sizeof(worker->problem), format, args);
+        va_end(args);
+        worker->failed = 1;
+    }
+    return -1;
+}
+
+/*
+ * @brief Resolves a path like the tools do, from a copy since dir_string_check splits it.
+ *
+ * @return int          The depth dir_string_check could not match: 0 when the path exists,
+ *                      1 when only its last component is missing or is a file.
+ */
+static int resolve(struct heartyfs_dev *dev, const char *path, struct heartyfs_directory **parent_dir,
+                    char *name, uint8_t *bitmap)
+{
+    char copy[STRESS_PATH_SIZE];
+    snprintf(copy, sizeof(copy), "%s", path);
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    *parent_dir = superblock->root_dir;
+    return dir_string_check(copy, name, dev, parent_dir, bitmap);
+}
+
+/*
+ * @brief Checks a directory subtree: its "." and "..", the blocks it reaches, and its usage.
+ *
+ * @param worker        The worker checking.
+ * @param dev           The open disk image.
+ * @param dir_id        The directory, 0 for the root directory.
+ * @param parent_id     The directory it should name as "..".
+ * @param refs          Times each block was reached so far.
+ * @return long         The blocks the subtree is charged, or -1 on a problem.
+ */
+static long check_dir(struct stress_worker *worker, struct heartyfs_dev *dev, int dir_id, int parent_id,
+                        int *refs)
+{
+    // Work on a copy, checking the children may evict the directory block
+    struct heartyfs_directory dir;
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    memcpy(&dir, dir_id == 0 ? superblock->root_dir : heartyfs_block(dev, dir_id), sizeof(dir));
+    if (dir.type != 1 || dir_self_id(&dir) != dir_id || dir_parent_id(&dir) != parent_id)
+    {
+        return fail(worker, "Directory %d has type %d, \".\" %d and \"..\" %d, expected \"..\" %d",
+                    dir_id, dir.type, dir_self_id(&dir), dir_parent_id(&dir), parent_id);
+    }
+
+    long used = dir_id == 0 ? 0 : 1;
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(&dir, &cursor, 0);
+    while (dir_next(&dir, &cursor, &entry))
+    {
+        int block_id = entry.block_id;
+        if (block_id <= 1 || block_id >= dev->num_blocks)
+        {
+            return fail(worker, "Entry %s of directory %d points to block %d", entry.file_name, dir_id, block_id);
+        }
+        if (refs[block_id]++ > 0)
+        {
+            return fail(worker, "Entry %s of directory %d reaches block %d a second time",
+                        entry.file_name, dir_id, block_id);
+        }
+        if (*(int *) heartyfs_block(dev, block_id) == 1)
+        {
+            long dir_used = check_dir(worker, dev, block_id, dir_id, refs);
+            if (dir_used < 0) return -1;
+            used += dir_used;
+            continue;
+        }
+
+        struct heartyfs_inode inode;
+        memcpy(&inode, heartyfs_block(dev, block_id), sizeof(inode));
+        if (inode.size > MAX_DATA_BLOCKS)
+        {
+            return fail(worker, "File %s has %d data blocks", entry.file_name, inode.size);
+        }
+        for (int i = 0; i < inode.size; i++)
+        {
+            if (inode.data_blocks[i] <= 1 || inode.data_blocks[i] >= dev->num_blocks)
+            {
+                return fail(worker, "Data block %d of %s is block %d", i, entry.file_name, inode.data_blocks[i]);
+            }
+            refs[inode.data_blocks[i]]++;
+        }
+        if (inode.xattr_block > 0) refs[inode.xattr_block]++;
+        used += 1 + inode.size + (inode.xattr_block > 0);
+    }
+    if (dir.used_blocks != used)
+    {
+        return fail(worker, "Directory %d is charged %d blocks, its subtree uses %ld", dir_id, dir.used_blocks, used);
+    }
+    return used;
+}
+
+/*
+ * @brief Checks the whole image: every block is used exactly when the tree or the metadata
+ *        reaches it, free_blocks matches the bitmaps, shared blocks have the right share
+ *        count, and every directory is charged what its subtree uses.
+ *
+ * @param worker        The worker checking.
+ * @param dev           The open disk image, locked.
+ * @return int          1 if the image is consistent, -1 on the first problem.
+ */
+static int check_image(struct stress_worker *worker, struct heartyfs_dev *dev)
+{
+    int num_blocks = dev->num_blocks;
+    int *refs = calloc(num_blocks, sizeof(int));
+    uint8_t *metadata = calloc(num_blocks, 1);
+    if (refs == NULL || metadata == NULL)
+    {
+        free(refs);
+        free(metadata);
+        return fail(worker, "Out of memory");
+    }
+
+    // Blocks of the file system itself
+    struct heartyfs_superblock superblock;
+    memcpy(&superblock, heartyfs_block(dev, 0), sizeof(superblock));
+    metadata[0] = 1;
+    for (int group = 0; group < dev->block_groups; group++) metadata[heartyfs_bitmap_block(group)] = 1;
+    struct heartyfs_ext ext;
+    memset(&ext, 0, sizeof(ext));
+    if (superblock.ext_block > 0)
+    {
+        metadata[superblock.ext_block] = 1;
+        memcpy(&ext, heartyfs_block(dev, superblock.ext_block), sizeof(ext));
+    }
+    for (int i = 0; i < REFCOUNT_TABLE_BLOCKS; i++) if (ext.refcount_blocks[i] > 0) metadata[ext.refcount_blocks[i]] = 1;
+    for (int i = 0; i < DEDUP_INDEX_BLOCKS; i++) if (ext.dedup_blocks[i] > 0) metadata[ext.dedup_blocks[i]] = 1;
+    for (int i = 0; i < ext.checksum_blocks; i++) metadata[ext.checksum_start + i] = 1;
+    worker->metadata_blocks = 0;
+    for (int block_id = 0; block_id < num_blocks; block_id++) worker->metadata_blocks += metadata[block_id];
+
+    int status = 1;
+    if (superblock.total_blocks != num_blocks)
+    {
+        status = fail(worker, "total_blocks is %d, the image has %d", superblock.total_blocks, num_blocks);
+    }
+    if (status == 1 && check_dir(worker, dev, 0, 0, refs) < 0) status = -1;
+
+    // Every block is used exactly when something reaches it
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    int free_count = 0;
+    for (int block_id = 0; status == 1 && block_id < num_blocks; block_id++)
+    {
+        int is_free = status_block(block_id, bitmap);
+        free_count += is_free;
+        if (metadata[block_id] && refs[block_id] > 0)
+        {
+            status = fail(worker, "Metadata block %d is reached from the tree", block_id);
+        }
+        else if (is_free && (metadata[block_id] || refs[block_id] > 0))
+        {
+            status = fail(worker, "Block %d is reached but marked free", block_id);
+        }
+        else if (!is_free && !metadata[block_id] && refs[block_id] == 0)
+        {
+            status = fail(worker, "Block %d is used but nothing reaches it", block_id);
+        }
+        else if (refs[block_id] > 0 && share_count(dev, block_id) != refs[block_id] - 1)
+        {
+            status = fail(worker, "Block %d has %d owners but a share count of %d",
+                            block_id, refs[block_id], share_count(dev, block_id));
+        }
+    }
+    if (status == 1 && free_count != superblock.free_blocks)
+    {
+        status = fail(worker, "free_blocks is %d, the bitmaps have %d free", superblock.free_blocks, free_count);
+    }
+    free(refs);
+    free(metadata);
+    return status;
+}
+
+/*
+ * @brief Reads a file back and compares it with the shadow model.
+ *
+ * @return int          1 if they match, -1 otherwise.
+ */
+static int verify_file(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node,
+                        int block_id)
+{
+    // Work on a copy, reading the data blocks may evict the inode block
+    struct heartyfs_inode inode;
+    memcpy(&inode, heartyfs_block(dev, block_id), sizeof(inode));
+    if (inode.type == 1) return fail(worker, "%s is a directory", node->path);
+    if (inode.length != node->length)
+    {
+        return fail(worker, "%s has length %d, expected %ld", node->path, inode.length, node->length);
+    }
+
+    char unit[COMPRESS_UNIT_SIZE];
+    char scratch[COMPRESS_SCRATCH_SIZE];
+    long offset = 0;
+    int block_index = 0;
+    while (block_index < inode.size)
+    {
+        int unit_size = read_unit(dev, &inode, &block_index, unit, scratch);
+        if (unit_size < 0) return fail(worker, "%s is corrupted at byte %ld", node->path, offset);
+        if (offset + unit_size > node->length || memcmp(unit, node->data + offset, unit_size) != 0)
+        {
+            return fail(worker, "%s differs from the shadow model at byte %ld", node->path, offset);
+        }
+        offset += unit_size;
+    }
+    if (offset != node->length) return fail(worker, "%s reads %ld bytes, expected %ld", node->path, offset, node->length);
+    worker->bytes_read += offset;
+    return 1;
+}
+
+/*
+ * @brief Creates a directory or an empty file like the FUSE frontend does.
+ *
+ * @return int          1 on success, 0 if the library refused, -1 on a problem.
+ */
+static int do_make(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node, int is_dir)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    if (resolve(dev, node->path, &parent_dir, name, bitmap) != 1)
+    {
+        return fail(worker, "%s is not a new name in an existing directory", node->path);
+    }
+    if (search_entry_in_dir(parent_dir, name) >= 0) return fail(worker, "%s exists already", node->path);
+    int parent_id = dir_self_id(parent_dir);
+    if (!dir_has_room(parent_dir, name) || heartyfs_quota_check(dev, parent_id, 1) != 1) return 0;
+
+    int block_id = take_block(dev, bitmap);
+    if (block_id < 0) return 0;
+    void *block = heartyfs_block(dev, block_id);
+    memset(block, 0, BLOCK_SIZE);
+    if (is_dir)
+    {
+        struct heartyfs_directory *created_dir = block;
+        created_dir->type = 1;
+        created_dir->used_blocks = 1;
+        snprintf(created_dir->name, sizeof(created_dir->name), "%s", name);
+        create_entry(dev, created_dir, ".", block_id);
+        create_entry(dev, created_dir, "..", parent_id);
+    }
+    else heartyfs_inode_init(dev, block);
+    heartyfs_dirty(dev, block);
+    create_entry(dev, parent_dir, name, block_id);
+    heartyfs_charge(dev, parent_id, 1);
+    return 1;
+}
+
+/*
+ * @brief Fills a write with random bytes or with compressible text.
+ */
+static void fill_data(struct stress_worker *worker, char *data, int size)
+{
+    if (next_random(worker) % 2 == 0)
+    {
+        for (int i = 0; i < size; i++) data[i] = (char) next_random(worker);
+        return;
+    }
+    int line = next_random(worker) % 1000;
+    for (int i = 0; i < size; )
+    {
+        char text[64];
+        int length = snprintf(text, sizeof(text), "line %d of worker %d\n", line++, worker->index);
+        for (int j = 0; j < length && i < size; j++) data[i++] = text[j];
+    }
+}
+
+/*
+ * @brief Appends to a file like heartyfs_write does, unit by unit, then reads it back. The
+ *        shadow model takes the bytes the file grew by, so a disk that fills up half way
+ *        through is a refusal, not a problem, as long as what was stored reads back.
+ *
+ * @return int          1 on success, 0 if the library refused part of it, -1 on a problem.
+ */
+static int do_write(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    if (resolve(dev, node->path, &parent_dir, name, bitmap) != 1) return fail(worker, "%s is not found", node->path);
+    int block_id = heartyfs_unshare(dev, parent_dir, name, bitmap);
+    if (block_id <= 1) return fail(worker, "%s has no inode", node->path);
+
+    int size = 1 + next_random(worker) % (next_random(worker) % 4 == 0 ? STRESS_MAX_WRITE : 2 * DATA_BLOCK_SIZE);
+    char *data = malloc(size);
+    char *grown = realloc(node->data, node->length + size);
+    if (data == NULL || grown == NULL)
+    {
+        free(data);
+        if (grown != NULL) node->data = grown;
+        return fail(worker, "Out of memory");
+    }
+    node->data = grown;
+    fill_data(worker, data, size);
+
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    if (!heartyfs_pin(dev, inode))
+    {
+        free(data);
+        return fail(worker, "%s cannot be pinned", node->path);
+    }
+    long old_length = inode->length;
+    int status = 1;
+    heartyfs_charge_file(dev, block_id, dir_self_id(parent_dir));
+    for (int offset = 0; offset < size && status == 1; offset += COMPRESS_UNIT_SIZE)
+    {
+        int length = size - offset < COMPRESS_UNIT_SIZE ? size - offset : COMPRESS_UNIT_SIZE;
+        if (write_unit(dev, bitmap, inode, data + offset, length) != 1) status = 0;
+    }
+    heartyfs_charge_clear(dev);
+
+    long added = inode->length - old_length;
+    if (added < 0 || added > size)
+    {
+        free(data);
+        return fail(worker, "%s grew by %ld bytes writing %d", node->path, added, size);
+    }
+    memcpy(node->data + node->length, data, added);
+    node->length += added;
+    worker->bytes_written += added;
+    free(data);
+    return verify_file(worker, dev, node, block_id) == 1 ? status : -1;
+}
+
+/*
+ * @brief Reads a file like heartyfs_read does and compares it with the shadow model.
+ *
+ * @return int          1 on success, -1 on a problem.
+ */
+static int do_read(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node)
+{
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    if (resolve(dev, node->path, &parent_dir, name, NULL) != 1) return fail(worker, "%s is not found", node->path);
+    int block_id = search_entry_in_dir(parent_dir, name);
+    if (block_id <= 1) return fail(worker, "%s is not found", node->path);
+    return verify_file(worker, dev, node, block_id);
+}
+
+/*
+ * @brief Removes a file like the FUSE frontend does.
+ *
+ * @return int          1 on success, -1 on a problem.
+ */
+static int do_rm(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    if (resolve(dev, node->path, &parent_dir, name, bitmap) != 1) return fail(worker, "%s is not found", node->path);
+    int block_id = search_entry_in_dir(parent_dir, name);
+    int parent_id = dir_self_id(parent_dir);
+    if (block_id <= 1 || remove_entry(heartyfs_block(dev, 0), dev, parent_id, name) != 1)
+    {
+        return fail(worker, "%s cannot be removed", node->path);
+    }
+    heartyfs_charge(dev, parent_id, -heartyfs_entry_charge(dev, block_id));
+    heartyfs_unlink(dev, block_id, bitmap);
+    return 1;
+}
+
+/*
+ * @brief Removes an empty directory like the FUSE frontend does.
+ *
+ * @return int          1 on success, -1 on a problem.
+ */
+static int do_rmdir(struct stress_worker *worker, struct heartyfs_dev *dev, struct stress_node *node)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *target_dir;
+    char name[FILENAME_MAX];
+    if (resolve(dev, node->path, &target_dir, name, bitmap) != 0) return fail(worker, "%s is not found", node->path);
+    if (target_dir->size != 2) return fail(worker, "%s has %d entries, expected none", node->path, target_dir->size - 2);
+    int block_id = dir_self_id(target_dir);
+    int parent_id = dir_parent_id(target_dir);
+    int used_blocks = target_dir->used_blocks;
+    if (remove_entry(heartyfs_block(dev, 0), dev, parent_id, name) != 1)
+    {
+        return fail(worker, "%s cannot be removed", node->path);
+    }
+    heartyfs_charge(dev, parent_id, -used_blocks);
+    heartyfs_release(dev, block_id, bitmap);
+    return 1;
+}
+
+/*
+ * @brief Picks a random node: a live file, a directory that can take children, an empty
+ *        directory below /w<index>, or a free slot.
+ *
+ * @return int          The node, or -1 if there is none.
+ */
+static int pick_node(struct stress_worker *worker, int op)
+{
+    int picked = -1;
+    int seen = 0;
+    for (int i = 0; i < STRESS_MAX_NODES; i++)
+    {
+        struct stress_node *node = &worker->nodes[i];
+        int fits;
+        if (op == STRESS_CREAT) fits = !node->live;
+        else if (op == STRESS_MKDIR) fits = node->live && node->is_dir && node->depth < STRESS_MAX_DEPTH;
+        else if (op == STRESS_RMDIR) fits = node->live && node->is_dir && node->children == 0 && i > 0;
+        else fits = node->live && !node->is_dir;
+        if (fits && next_random(worker) % ++seen == 0) picked = i;
+    }
+    return picked;
+}
+
+/*
+ * @brief Runs one random step and updates the shadow model.
+ *
+ * @return int          1 on success, 0 if the library refused, -1 on a problem.
+ */
+static int run_step(struct stress_worker *worker, struct heartyfs_dev *dev)
+{
+    int roll = next_random(worker) % 100;
+    int op = roll < 8 ? STRESS_MKDIR : roll < 25 ? STRESS_CREAT : roll < 55 ? STRESS_WRITE
+            : roll < 75 ? STRESS_READ : roll < 90 ? STRESS_RM : STRESS_RMDIR;
+
+    // Fall back to an operation that has something to work on
+    int slot = pick_node(worker, STRESS_CREAT);
+    int target = op == STRESS_MKDIR || op == STRESS_CREAT ? slot : pick_node(worker, op);
+    if (target < 0)
+    {
+        op = slot >= 0 ? STRESS_CREAT : STRESS_RM;
+        target = pick_node(worker, op);
+    }
+    if (target < 0)
+    {
+        op = STRESS_RMDIR;
+        target = pick_node(worker, op);
+    }
+    if (target < 0) return fail(worker, "No operation fits the shadow model");
+    worker->op = op;
+    worker->ops[op]++;
+
+    struct stress_node *node = &worker->nodes[target];
+    if (op == STRESS_WRITE) return do_write(worker, dev, node);
+    if (op == STRESS_READ) return do_read(worker, dev, node);
+    if (op == STRESS_RM || op == STRESS_RMDIR)
+    {
+        int status = op == STRESS_RM ? do_rm(worker, dev, node) : do_rmdir(worker, dev, node);
+        if (status != 1) return status;
+        node->live = 0;
+        free(node->data);
+        node->data = NULL;
+        node->length = 0;
+        worker->nodes[node->parent].children--;
+        return 1;
+    }
+
+    // A new entry goes into a random directory that can take it
+    int parent = pick_node(worker, STRESS_MKDIR);
+    node = &worker->nodes[slot];
+    int length = snprintf(node->path, sizeof(node->path), "%s/%c%d", worker->nodes[parent].path,
+                            op == STRESS_MKDIR ? 'd' : 'f', slot);
+    if (length >= (int) sizeof(node->path))
+    {
+        return fail(worker, "The path of node %d under %s is longer than %d bytes",
+                    slot, worker->nodes[parent].path, STRESS_PATH_SIZE - 1);
+    }
+    int status = do_make(worker, dev, node, op == STRESS_MKDIR);
+    if (status != 1) return status;
+    node->live = 1;
+    node->is_dir = op == STRESS_MKDIR;
+    node->parent = parent;
+    node->depth = worker->nodes[parent].depth + 1;
+    node->children = 0;
+    worker->nodes[parent].children++;
+    return 1;
+}
+
+/*
+ * @brief Compares the whole tree of a worker with its shadow model.
+ *
+ * @return int          1 if they match, -1 on the first difference.
+ */
+static int verify_tree(struct stress_worker *worker, struct heartyfs_dev *dev)
+{
+    for (int i = 0; i < STRESS_MAX_NODES; i++)
+    {
+        struct stress_node *node = &worker->nodes[i];
+        if (!node->live) continue;
+        heartyfs_unpin_all(dev);    // Pins last one lookup
+        if (!node->is_dir)
+        {
+            if (do_read(worker, dev, node) != 1) return -1;
+            continue;
+        }
+        struct heartyfs_directory *dir;
+        char name[FILENAME_MAX];
+        if (resolve(dev, node->path, &dir, name, NULL) != 0) return fail(worker, "%s is not found", node->path);
+        if (dir->size - 2 != node->children)
+        {
+            return fail(worker, "%s has %d entries, expected %d", node->path, dir->size - 2, node->children);
+        }
+    }
+    return 1;
+}
+
+/*
+ * @brief Removes the whole tree of a worker, deepest entries first.
+ *
+ * @return int          1 on success, -1 on a problem.
+ */
+static int remove_tree(struct stress_worker *worker, struct heartyfs_dev *dev)
+{
+    for (int depth = STRESS_MAX_DEPTH; depth >= 0; depth--)
+    {
+        for (int i = 0; i < STRESS_MAX_NODES; i++)
+        {
+            struct stress_node *node = &worker->nodes[i];
+            if (!node->live || node->depth != depth) continue;
+            int status = node->is_dir ? do_rmdir(worker, dev, node) : do_rm(worker, dev, node);
+            if (status != 1) return -1;
+            node->live = 0;
+            free(node->data);
+            node->data = NULL;
+            heartyfs_unpin_all(dev);
+        }
+    }
+    return 1;
+}
+
+/*
+ * @brief Runs a worker: creates /w<index>, runs its steps, compares its tree with the shadow
+ *        model and removes it. Runs on its own thread when there are several workers.
+ *
+ * @param arg           The `stress_worker`.
+ * @return void*        Always NULL; the results are in the worker.
+ */
+static void *run_worker(void *arg)
+{
+    struct stress_worker *worker = arg;
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, STRESS_DISK_PATH) < 0)
+    {
+        fail(worker, "Cannot open the image");
+        return NULL;
+    }
+    if (worker->shared) heartyfs_dev_unlock(&dev);
+
+    struct stress_node *root = &worker->nodes[0];
+    snprintf(root->path, sizeof(root->path), "/w%d", worker->index);
+    root->parent = -1;
+    root->is_dir = 1;
+    for (int step = -1; step <= worker->steps && !worker->failed; step++)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (worker->shared && heartyfs_dev_lock(&dev) < 0)
+        {
+            fail(worker, "Cannot lock the image");
+            break;
+        }
+
+        // Step -1 creates /w<index>, the step after the last compares and removes the tree
+        worker->step = step;
+        int status;
+        if (step < 0)
+        {
+            worker->op = STRESS_MKDIR;
+            status = do_make(worker, &dev, root, 1);
+            root->live = status == 1;
+            if (status == 0) status = fail(worker, "Cannot create %s", root->path);
+        }
+        else if (step < worker->steps) status = run_step(worker, &dev);
+        else
+        {
+            worker->op = STRESS_TEARDOWN;
+            status = verify_tree(worker, &dev) == 1 ? remove_tree(worker, &dev) : -1;
+        }
+        if (status == 0) worker->refused++;
+        if (status >= 0 && !worker->shared) heartyfs_dev_commit(&dev);
+        worker->op_seconds += seconds_since(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int due = worker->check_every > 0 && (step + 1) % worker->check_every == 0;
+        if (status >= 0 && (due || step == worker->steps)) check_image(worker, &dev);
+        worker->check_seconds += seconds_since(&start);
+
+        heartyfs_unpin_all(&dev);
+        if (worker->shared) heartyfs_dev_unlock(&dev);
+    }
+    for (int i = 0; i < STRESS_MAX_NODES; i++) free(worker->nodes[i].data);
+
+    // Closing writes the resident superblock and bitmaps, so it needs the lock again
+    if (worker->shared) heartyfs_dev_lock(&dev);
+    heartyfs_dev_close(&dev);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_stress\n");
+
+    // Validate the command
+    long seed = argc > 1 ? atol(argv[1]) : 1;
+    int steps = argc > 2 ? atoi(argv[2]) : 2000;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    int check_every = argc > 4 ? atoi(argv[4]) : 1;
+    if (argc > 5 || steps < 0 || threads < 1 || threads > STRESS_MAX_THREADS || check_every < 0)
+    {
+        printf("Usage: filename [seed [steps [threads [check_every]]]]\n");
+        exit(2);
+    }
+
+    // The library reports every call on stdout, keep the report apart
+    fflush(stdout);
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("Cannot redirect the library messages\n");
+        exit(1);
+    }
+
+    // Create and format the scratch image
+    int fd = open(STRESS_DISK_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t) STRESS_DISK_BLOCKS * BLOCK_SIZE) < 0)
+    {
+        perror("Cannot create the stress disk file\n");
+        exit(1);
+    }
+    close(fd);
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, STRESS_DISK_PATH) < 0)
+    {
+        exit(1);
+    }
+    heartyfs_format(&dev);
+    heartyfs_dev_close(&dev);
+
+    // Run the workers
+    struct stress_worker *workers = calloc(threads, sizeof(struct stress_worker));
+    if (workers == NULL)
+    {
+        fprintf(report, "Error: Out of memory\n");
+        exit(1);
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].index = i;
+        workers[i].random = (uint64_t) seed * 0x9E3779B97F4A7C15ULL + i + 1;
+        workers[i].steps = steps;
+        workers[i].check_every = check_every;
+        workers[i].shared = threads > 1;
+        if (threads > 1) pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    if (threads == 1) run_worker(&workers[0]);
+    for (int i = 0; i < threads && threads > 1; i++) pthread_join(workers[i].thread, NULL);
+    double wall_seconds = seconds_since(&start);
+
+    // Report what went wrong, then what ran
+    struct stress_worker total;
+    memset(&total, 0, sizeof(total));
+    int problems = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        struct stress_worker *worker = &workers[i];
+        if (worker->failed)
+        {
+            problems++;
+            fprintf(report, "Error: Worker %d, step %d (%s): %s\n", i, worker->step, op_names[worker->op],
+                    worker->problem);
+        }
+        for (int op = 0; op < STRESS_OPS; op++) total.ops[op] += worker->ops[op];
+        total.refused += worker->refused;
+        total.bytes_written += worker->bytes_written;
+        total.bytes_read += worker->bytes_read;
+        total.check_seconds += worker->check_seconds;
+        if (worker->op_seconds > total.op_seconds) total.op_seconds = worker->op_seconds;
+    }
+
+    // With the tree removed, every block but the metadata must be free again
+    struct stress_worker final;
+    memset(&final, 0, sizeof(final));
+    if (problems == 0 && heartyfs_dev_open(&dev, STRESS_DISK_PATH) == 0)
+    {
+        struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+        if (check_image(&final, &dev) == 1 && superblock->root_dir->size != 2)
+        {
+            fail(&final, "The root directory still has %d entries", superblock->root_dir->size - 2);
+        }
+        if (final.failed) fprintf(report, "Error: After the run: %s\n", final.problem);
+        else
+        {
+            fprintf(report, "Success: Every block came back, %d free and %d of metadata\n",
+                    superblock->free_blocks, final.metadata_blocks);
+        }
+        problems += final.failed;
+        heartyfs_dev_close(&dev);
+    }
+
+    long ops = 0;
+    fprintf(report, "Result:");
+    for (int op = 0; op < STRESS_OPS; op++)
+    {
+        fprintf(report, " %s=%ld", op_names[op], total.ops[op]);
+        ops += total.ops[op];
+    }
+    fprintf(report, " refused=%ld\n", total.refused);
+    fprintf(report, "Result: %.0f ops/s, write %.2f MB/s, read %.2f MB/s, %.2f s of %.2f s in checks\n",
+            ops / total.op_seconds, total.bytes_written / total.op_seconds / (1 << 20),
+            total.bytes_read / total.op_seconds / (1 << 20), total.check_seconds, wall_seconds);
+    if (problems > 0)
+    {
+        fprintf(report, "Error: Seed %ld, %d steps on %d workers, %d problems\n", seed, steps, threads, problems);
+        return 1;
+    }
+    fprintf(report, "Success: Seed %ld, %d steps on %d workers, no problems\n", seed, steps, threads);
+    unlink(STRESS_DISK_PATH);
+    return 0;
+}
@@ -0,0 +1,867 @@
+/*
+ * heartyfs_fuse.c
+ *
+ * Brief
+ * - This program mounts a heartyfs image with FUSE (libfuse3), so standard tools, file-tree
+ *   benchmarks such as fio, and ordinary applications can use it through POSIX calls:
+ *
+ *       bin/heartyfs_fuse /mnt/heartyfs
+ *       bin/heartyfs_fuse -o durability=group,group_ms=5 /mnt/heartyfs
+ *       fio --directory=/mnt/heartyfs ...
+ *       fusermount3 -u /mnt/heartyfs
+ *
+ * Data Structures:
+ * - One `heartyfs_dev` opened on DISK_FILE_PATH for the lifetime of the mount, with the
+ *   backend chosen by HEARTYFS_BACKEND as for the command line tools.
+ * - `fi->fh` holds the inode block of an open file, so reads and writes skip path lookup.
+ * - readdir returns the attributes of every entry from heartyfs_readdir_plus, so listing a
+ *   directory needs no getattr per entry.
+ *
+ * Design Decisions:
+ * - Every callback is built on the library operations the tools use: dir_string_check for
+ *   path lookup (so writers still unshare snapshot blocks), create_entry and remove_entry for
+ *   the namespace, heartyfs_rename for rename, write_unit and read_unit for file content,
+ *   heartyfs_link and heartyfs_unlink for hard links and removal.
+ * - libfuse dispatches requests on multiple threads. The block device and its cache are not
+ *   thread-safe, so callbacks run under one mutex; the kernel still overlaps request copying
+ *   and page cache work with the filesystem code.
+ * - The kernel writeback cache is enabled and the read, write and readahead sizes are raised
+ *   to HEARTYFS_FUSE_MAX_IO, so small application writes reach heartyfs as large sequential ones.
+ * - Data blocks hold a variable number of bytes and are never modified in place, so a write
+ *   or truncate rewrites the file from the first unit it touches: the tail is decoded, patched,
+ *   and written as new units. The old blocks are only released once the new ones are written,
+ *   so a failed write leaves the file unchanged. Appends touch only the last partial unit.
+ * - Pins last for one callback and are dropped when it returns.
+ * - Callbacks that modify the image end with heartyfs_dev_commit, so the durability mode
+ *   (mount option `durability=sync|group|async`, else HEARTYFS_DURABILITY) decides when they
+ *   reach the disk. In group mode a timer thread flushes a group that waited `group_ms`;
+ *   `group_ops` bounds its size. fsync is always a durable flush.
+ * - getattr and readdir report the mode, owner and times kept in each inode; chmod, chown,
+ *   utimens and the xattr calls change them. Directories keep no metadata of their own: chmod,
+ *   chown and utimens succeed on them without effect, and they hold no xattrs.
+ * - Directory quotas (see heartyfs_quota.c) refuse growth with EDQUOT: new entries, links,
+ *   moves into a directory, and writes. A write finds the directories it is charged to through
+ *   its path.
+ * - The image grows while mounted: heartyfs_resize extends the file, and the next callback
+ *   adds the blocks and remaps the image before it looks at any block. This costs one fstat
+ *   per callback.
+ * - Snapshot paths (`/@name/...`) are read-only.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#define _GNU_SOURCE     // RENAME_NOREPLACE and RENAME_EXCHANGE
+#define FUSE_USE_VERSION 31
+
+#include "../heartyfs.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/xattr.h>
+#include <fuse.h>
+
+#define HEARTYFS_FUSE_MAX_IO (1 << 20)
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static volatile int flusher_running;
+
+struct hfs_options
+{
+    char *durability;       // durability=sync|group|async
+    int group_ms;           // group_ms=N
+    int group_ops;          // group_ops=N
+};
+
+static const struct fuse_opt hfs_option_spec[] = {
+    {"durability=%s", offsetof(struct hfs_options, durability), 0},
+    {"group_ms=%d", offsetof(struct hfs_options, group_ms), 0},
+    {"group_ops=%d", offsetof(struct hfs_options, group_ops), 0},
+    FUSE_OPT_END
+};
+
+/*
+ * @brief Starts a callback: takes the filesystem lock and returns the open image, first
+ *        adding the new blocks of an image file grown by heartyfs_resize.
+ */
+static struct heartyfs_dev *begin_op(void)
+{
+    pthread_mutex_lock(&fs_lock);
+    struct heartyfs_dev *dev = fuse_get_context()->private_data;
+    if (heartyfs_grow(dev) > 0) heartyfs_dev_commit(dev);
+    return dev;
+}
+
+/*
+ * @brief Ends a callback: drops its pins and releases the filesystem lock.
+ *
+ * @param dev           The open image.
+ * @param status        The result of the callback.
+ * @return int          status, unchanged.
+ */
+static int end_op(struct heartyfs_dev *dev, int status)
+{
+    heartyfs_unpin_all(dev);
+    pthread_mutex_unlock(&fs_lock);
+    return status;
+}
+
+/*
+ * @brief Ends a callback that modified the image: a successful one is committed under the
+ *        durability mode of the mount first.
+ *
+ * @param dev           The open image.
+ * @param status        The result of the callback.
+ * @return int          status, or -EIO if the commit could not flush.
+ */
+static int end_update(struct heartyfs_dev *dev, int status)
+{
+    if (status >= 0 && heartyfs_dev_commit(dev) < 0) status = -EIO;
+    return end_op(dev, status);
+}
+
+/*
+ * @brief Resolves a path to its block. Writers pass the bitmap so that every directory on
+ *        the path, and the target itself, is private to the live tree.
+ *
+ * @param dev           The open image.
+ * @param path          The path given by FUSE.
+ * @param parent_dir    Output: the directory holding the last component.
+ * @param name          Output: the last component, at least FILENAME_MAX bytes.
+ * @param bitmap        The bitmap when the caller modifies the tree, NULL for readers.
+ * @return int          The block of the target (0 for the root), -ENOENT if it does not
+ *                      exist (parent_dir is then the directory to create it in, or NULL), or
+ *                      another negative errno.
+ */
+static int lookup(struct heartyfs_dev *dev, const char *path, struct heartyfs_directory **parent_dir,
+                    char *name, uint8_t *bitmap)
+{
+    char path_copy[PATH_MAX];
+    if (strlen(path) >= sizeof(path_copy)) return -ENAMETOOLONG;
+    if (bitmap != NULL && path[0] == '/' && path[1] == SNAPSHOT_PREFIX) return -EROFS;
+    snprintf(path_copy, sizeof(path_copy), "%s", path);
+
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    *parent_dir = superblock->root_dir;
+    name[0] = '\0';
+    int diff = dir_string_check(path_copy, name, dev, parent_dir, bitmap);
+    if (diff == 0) return dir_self_id(*parent_dir);   // The path is a directory
+    if (diff < 0)
+    {
+        *parent_dir = NULL;     // The block cache cannot hold the directory
+        return -ENOMEM;
+    }
+    if (diff > 1)
+    {
+        *parent_dir = NULL;     // A directory before the last component is missing
+        return -ENOENT;
+    }
+
+    int block_id = bitmap != NULL ? heartyfs_unshare(dev, *parent_dir, name, bitmap)
+                                  : search_entry_in_dir(*parent_dir, name);
+    if (block_id > 1 && !heartyfs_pin(dev, heartyfs_block(dev, block_id))) return -ENOMEM;
+    return block_id > 1 ? block_id : -ENOENT;
+}
+
+/*
+ * @brief Converts the attributes of an entry into a stat structure.
+ */
+static void info_to_stat(struct heartyfs_entry_info *info, int read_only, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = info->block_id + 1;    // The root directory lives in block 0
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = info->blocks;
+    if (info->type == 1)
+    {
+        st->st_mode = S_IFDIR | (read_only ? 0555 : 0755);
+        st->st_nlink = 2;
+        st->st_size = BLOCK_SIZE;
+    }
+    else
+    {
+        st->st_mode = S_IFREG | (read_only ? info->mode & ~0222 : info->mode);
+        st->st_uid = info->uid;
+        st->st_gid = info->gid;
+        st->st_nlink = info->links;
+        st->st_size = info->size;
+        st->st_mtim.tv_sec = info->mtime / 1000000000;
+        st->st_mtim.tv_nsec = info->mtime % 1000000000;
+        st->st_ctim.tv_sec = info->ctime / 1000000000;
+        st->st_ctim.tv_nsec = info->ctime % 1000000000;
+        st->st_atim = st->st_mtim;  // Reads are not recorded
+    }
+}
+
+/*
+ * @brief Fills a stat structure for a directory or inode block.
+ */
+static int fill_stat(struct heartyfs_dev *dev, int block_id, int read_only, struct stat *st)
+{
+    struct heartyfs_entry_info info;
+    if (heartyfs_entry_info(dev, block_id, "", &info) != 1) return -EIO;
+    info_to_stat(&info, read_only, st);
+    return 0;
+}
+
+/*
+ * @brief Chooses the directories charged for the blocks a write adds to or drops from a file,
+ *        found through the path of the file. Ends with heartyfs_charge_clear.
+ */
+static int charge_file(struct heartyfs_dev *dev, const char *path, int block_id)
+{
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    if (path == NULL || lookup(dev, path, &parent_dir, name, heartyfs_block(dev, 1)) != block_id) return 0;
+    return heartyfs_charge_file(dev, block_id, dir_self_id(parent_dir)) == 1 ? 0 : -ENOMEM;
+}
+
+/*
+ * @brief Replaces the content of a file from byte offset on, so that the file holds length
+ *        bytes of data at offset and is new_size bytes long. Bytes between the old end of the
+ *        file and offset read as zeros.
+ *
+ * @param dev           The open image.
+ * @param inode         The inode of the file, pinned.
+ * @param offset        Where the new data starts.
+ * @param data          The new data, or NULL when only the size changes.
+ * @param length        Number of bytes of data.
+ * @param new_size      Length of the file afterwards.
+ * @return int          0 on success, or a negative errno with the file unchanged: -EDQUOT
+ *                      when a directory quota refused the new blocks.
+ */
+static int splice_file(struct heartyfs_dev *dev, struct heartyfs_inode *inode, off_t offset,
+                        const char *data, size_t length, off_t new_size)
+{
+    long old_size = inode->length;
+    int unit_capacity = (inode->type & INODE_FLAG_COMPRESSED) ? COMPRESS_UNIT_SIZE : DATA_BLOCK_SIZE;
+    off_t start = offset < old_size ? offset : old_size;
+
+    char *unit = malloc(COMPRESS_UNIT_SIZE);
+    char *scratch = malloc(COMPRESS_SCRATCH_SIZE);
+    char *tail = malloc((old_size > new_size ? old_size : new_size) + COMPRESS_UNIT_SIZE);
+    if (unit == NULL || scratch == NULL || tail == NULL)
+    {
+        free(unit);
+        free(scratch);
+        free(tail);
+        return -ENOMEM;
+    }
+
+    // Find the first unit the change touches and decode everything from there on
+    int block_index = 0;
+    int cut_block = -1;
+    off_t cut = old_size;
+    off_t position = 0;
+    long tail_length = 0;
+    while (block_index < inode->size)
+    {
+        int first_block = block_index;
+        char *out = cut_block >= 0 ? tail + tail_length : unit;
+        int unit_size = read_unit(dev, inode, &block_index, out, scratch);
+        if (unit_size < 0)
+        {
+            free(unit);
+            free(scratch);
+            free(tail);
+            return -EIO;
+        }
+        if (cut_block < 0 && (position + unit_size > start
+                || (position + unit_size == start && unit_size < unit_capacity)))
+        {
+            cut_block = first_block;    // Partial last units are refilled, not left as holes
+            cut = position;
+            memcpy(tail, unit, unit_size);
+        }
+        if (cut_block >= 0) tail_length += unit_size;
+        position += unit_size;
+    }
+    if (cut_block < 0) cut_block = inode->size;
+
+    // Patch the tail: extend with zeros, then copy the new data over it
+    long new_tail_length = new_size - cut;
+    if (new_tail_length > tail_length) memset(tail + tail_length, 0, new_tail_length - tail_length);
+    if (data != NULL) memcpy(tail + (offset - cut), data, length);
+
+    // Write the new tail after the kept blocks, then release the old tail
+    int old_count = inode->size;
+    int old_blocks[MAX_DATA_BLOCKS];
+    memcpy(old_blocks, inode->data_blocks, sizeof(old_blocks));
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    long quota_denied = dev->stats.quota_denied;
+    inode->size = cut_block;
+    inode->length = cut;
+    int status = 0;
+    for (long written = 0; written < new_tail_length && status == 0; written += COMPRESS_UNIT_SIZE)
+    {
+        long chunk = new_tail_length - written < COMPRESS_UNIT_SIZE ? new_tail_length - written : COMPRESS_UNIT_SIZE;
+        if (write_unit(dev, bitmap, inode, tail + written, chunk) != 1)
+        {
+            status = dev->stats.quota_denied != quota_denied ? -EDQUOT : -EFBIG;
+        }
+    }
+    int first_released = status == 0 ? cut_block : old_count;
+    if (status != 0)
+    {
+        // Roll back: drop the new blocks and restore the old list
+        heartyfs_charge_blocks(dev, -(inode->size - cut_block));
+        for (int i = cut_block; i < inode->size; i++) heartyfs_release_data(dev, inode->data_blocks[i], bitmap);
+        memcpy(inode->data_blocks, old_blocks, sizeof(old_blocks));
+        inode->size = old_count;
+        inode->length = old_size;
+    }
+    heartyfs_charge_blocks(dev, -(old_count - first_released));
+    for (int i = first_released; i < old_count; i++) heartyfs_release_data(dev, old_blocks[i], bitmap);
+    for (int i = inode->size; i < MAX_DATA_BLOCKS; i++) inode->data_blocks[i] = 0;
+    if (status == 0) heartyfs_touch(dev, inode, 1);
+    heartyfs_dirty(dev, inode);
+
+    free(unit);
+    free(scratch);
+    free(tail);
+    return status;
+}
+
+/*
+ * @brief Group commit timer: flushes the waiting group once its oldest operation waited
+ *        group_ms, so a quiet mount does not keep commits waiting. Runs on its own thread.
+ */
+static void *flush_groups(void *arg)
+{
+    struct heartyfs_dev *dev = arg;
+    struct timespec period = {dev->group_ms / 1000, (dev->group_ms % 1000) * 1000000L};
+    while (flusher_running)
+    {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&fs_lock);
+        heartyfs_dev_commit_due(dev);
+        pthread_mutex_unlock(&fs_lock);
+    }
+    return NULL;
+}
+
+static void *hfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    conn->max_write = HEARTYFS_FUSE_MAX_IO;
+    conn->max_read = HEARTYFS_FUSE_MAX_IO;
+    conn->max_readahead = HEARTYFS_FUSE_MAX_IO;
+    cfg->kernel_cache = 1;      // Only this process modifies the image while it is mounted
+
+    // Started here rather than in main, as fuse_main may fork into the background first
+    struct heartyfs_dev *dev = fuse_get_context()->private_data;
+    if (dev->durability == HEARTYFS_DURABILITY_GROUP)
+    {
+        flusher_running = 1;
+        if (pthread_create(&flusher, NULL, flush_groups, dev) != 0) flusher_running = 0;
+    }
+    return dev;
+}
+
+static void hfs_destroy(void *private_data)
+{
+    if (flusher_running)
+    {
+        flusher_running = 0;
+        pthread_join(flusher, NULL);
+    }
+    heartyfs_dev_close(private_data);
+}
+
+static int hfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int read_only = path[0] == '/' && path[1] == SNAPSHOT_PREFIX;
+    if (fi != NULL) return end_op(dev, fill_stat(dev, (int) fi->fh, read_only, st));
+
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &parent_dir, name, NULL);
+    if (block_id < 0) return end_op(dev, block_id);
+    return end_op(dev, fill_stat(dev, block_id, read_only, st));
+}
+
+static int hfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    struct heartyfs_dev *dev = begin_op();
+    struct heartyfs_directory *dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &dir, name, NULL);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (block_id != 0 && dir_self_id(dir) != block_id) return end_op(dev, -ENOTDIR);
+
+    // Attributes come with the names, so the kernel needs no lookup per entry
+    int read_only = path[0] == '/' && path[1] == SNAPSHOT_PREFIX;
+    struct heartyfs_entry_info infos[DIR_MAX_ENTRIES];
+    int count = heartyfs_readdir_plus(dev, dir, infos);
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (int i = 0; i < count; i++)
+    {
+        struct stat st;
+        info_to_stat(&infos[i], read_only, &st);
+        if (filler(buf, infos[i].name, &st, 0, FUSE_FILL_DIR_PLUS) != 0) break;
+    }
+    return end_op(dev, 0);
+}
+
+/*
+ * @brief Shared part of mkdir and create: takes a block, lets init fill it in, and links
+ *        it into the parent directory.
+ */
+static int make_entry(struct heartyfs_dev *dev, const char *path, int is_dir)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &parent_dir, name, bitmap);
+    if (block_id >= 0) return -EEXIST;
+    if (block_id != -ENOENT || parent_dir == NULL) return block_id;
+    if (strlen(name) > HEARTYFS_NAME_MAX) return -ENAMETOOLONG;
+    if (!dir_has_room(parent_dir, name)) return -ENOSPC;
+    int parent_id = dir_self_id(parent_dir);
+    if (heartyfs_quota_check(dev, parent_id, 1) != 1) return -EDQUOT;
+
+    block_id = take_block(dev, bitmap);
+    if (block_id < 0) return -ENOSPC;
+    void *block = heartyfs_block(dev, block_id);
+    memset(block, 0, BLOCK_SIZE);
+    if (is_dir)
+    {
+        struct heartyfs_directory *created_dir = block;
+        created_dir->type = 1;
+        created_dir->used_blocks = 1;
+        snprintf(created_dir->name, sizeof(created_dir->name), "%s", name);
+        create_entry(dev, created_dir, ".", block_id);
+        create_entry(dev, created_dir, "..", parent_id);
+    }
+    else heartyfs_inode_init(dev, block);
+    heartyfs_dirty(dev, block);
+    create_entry(dev, parent_dir, name, block_id);
+    heartyfs_charge(dev, parent_id, 1);
+    return block_id;
+}
+
+static int hfs_mkdir(const char *path, mode_t mode)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = make_entry(dev, path, 1);
+    return end_update(dev, block_id < 0 ? block_id : 0);
+}
+
+static int hfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = make_entry(dev, path, 0);
+    if (block_id < 0) return end_op(dev, block_id);
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    inode->mode = mode & 07777;
+    heartyfs_dirty(dev, inode);
+    fi->fh = block_id;
+    return end_update(dev, 0);
+}
+
+static int hfs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &parent_dir, name, writing ? heartyfs_block(dev, 1) : NULL);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (block_id == 0 || *(int *) heartyfs_block(dev, block_id) == 1) return end_op(dev, -EISDIR);
+    fi->fh = block_id;
+    return end_op(dev, 0);
+}
+
+static int hfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    struct heartyfs_inode *inode = heartyfs_block(dev, (int) fi->fh);
+    if (!heartyfs_pin(dev, inode)) return end_op(dev, -ENOMEM);
+    heartyfs_prefetch(dev, inode->data_blocks, inode->size);
+
+    char *unit = malloc(COMPRESS_UNIT_SIZE);
+    char *scratch = malloc(COMPRESS_SCRATCH_SIZE);
+    int status = unit != NULL && scratch != NULL ? 0 : -ENOMEM;
+    off_t position = 0;
+    size_t copied = 0;
+    int block_index = 0;
+    while (status == 0 && block_index < inode->size && copied < size)
+    {
+        int unit_size = read_unit(dev, inode, &block_index, unit, scratch);
+        if (unit_size < 0)
+        {
+            status = -EIO;
+            break;
+        }
+        if (position + unit_size > offset)
+        {
+            // Copy the overlap of this unit with [offset, offset + size)
+            size_t from = offset + copied - position;
+            size_t length = unit_size - from < size - copied ? unit_size - from : size - copied;
+            memcpy(buf + copied, unit + from, length);
+            copied += length;
+        }
+        position += unit_size;
+    }
+    free(unit);
+    free(scratch);
+    return end_op(dev, status < 0 ? status : (int) copied);
+}
+
+static int hfs_write(const char *path, const char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    struct heartyfs_inode *inode = heartyfs_block(dev, (int) fi->fh);
+    if (!heartyfs_pin(dev, inode)) return end_op(dev, -ENOMEM);
+    long old_size = inode->length;
+    off_t new_size = offset + (off_t) size > old_size ? offset + (off_t) size : old_size;
+    int status = charge_file(dev, path, (int) fi->fh);
+    if (status == 0) status = splice_file(dev, inode, offset, buf, size, new_size);
+    heartyfs_charge_clear(dev);
+    return end_update(dev, status < 0 ? status : (int) size);
+}
+
+static int hfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id;
+    if (fi != NULL) block_id = (int) fi->fh;
+    else
+    {
+        struct heartyfs_directory *parent_dir;
+        char name[FILENAME_MAX];
+        block_id = lookup(dev, path, &parent_dir, name, heartyfs_block(dev, 1));
+        if (block_id < 0) return end_op(dev, block_id);
+    }
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    if (block_id == 0 || inode->type == 1) return end_op(dev, -EISDIR);
+    if (!heartyfs_pin(dev, inode)) return end_op(dev, -ENOMEM);
+    int status = charge_file(dev, path, block_id);
+    if (status == 0) status = splice_file(dev, inode, size, NULL, 0, size);
+    heartyfs_charge_clear(dev);
+    return end_update(dev, status);
+}
+
+static int hfs_unlink(const char *path)
+{
+    struct heartyfs_dev *dev = begin_op();
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &parent_dir, name, bitmap);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (block_id == 0 || *(int *) heartyfs_block(dev, block_id) == 1) return end_op(dev, -EISDIR);
+    int parent_id = dir_self_id(parent_dir);
+    if (remove_entry(heartyfs_block(dev, 0), dev, parent_id, name) != 1)
+    {
+        return end_op(dev, -ENOENT);
+    }
+    heartyfs_charge(dev, parent_id, -heartyfs_entry_charge(dev, block_id));
+    heartyfs_unlink(dev, block_id, bitmap);
+    return end_update(dev, 0);
+}
+
+static int hfs_link(const char *from, const char *to)
+{
+    struct heartyfs_dev *dev = begin_op();
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, from, &parent_dir, name, bitmap);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (block_id == 0 || *(int *) heartyfs_block(dev, block_id) == 1) return end_op(dev, -EPERM);
+
+    int existing_id = lookup(dev, to, &parent_dir, name, bitmap);
+    if (existing_id >= 0) return end_op(dev, -EEXIST);
+    if (existing_id != -ENOENT || parent_dir == NULL) return end_op(dev, existing_id);
+    if (strlen(name) > HEARTYFS_NAME_MAX) return end_op(dev, -ENAMETOOLONG);
+    if (!dir_has_room(parent_dir, name)) return end_op(dev, -ENOSPC);
+    long quota_denied = dev->stats.quota_denied;
+    if (heartyfs_link(dev, block_id, parent_dir, name, bitmap) == 1) return end_update(dev, 0);
+    return end_op(dev, dev->stats.quota_denied != quota_denied ? -EDQUOT : -EMLINK);
+}
+
+static int hfs_rmdir(const char *path)
+{
+    struct heartyfs_dev *dev = begin_op();
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *target_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &target_dir, name, bitmap);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (block_id == 0) return end_op(dev, -EBUSY);
+    if (dir_self_id(target_dir) != block_id) return end_op(dev, -ENOTDIR);
+    if (target_dir->size > 2) return end_op(dev, -ENOTEMPTY);
+    int parent_id = dir_parent_id(target_dir);
+    int used_blocks = target_dir->used_blocks;
+    if (remove_entry(heartyfs_block(dev, 0), dev, parent_id, name) != 1)
+    {
+        return end_op(dev, -ENOENT);
+    }
+    heartyfs_charge(dev, parent_id, -used_blocks);
+    heartyfs_release(dev, block_id, bitmap);
+    return end_update(dev, 0);
+}
+
+/*
+ * @brief Resolves a path for rename: the directory holding the last component, its name and
+ *        its block. A directory is resolved to its parent through "..".
+ */
+static int lookup_entry(struct heartyfs_dev *dev, const char *path, struct heartyfs_directory **parent_dir,
+                            char *name, uint8_t *bitmap)
+{
+    int block_id = lookup(dev, path, parent_dir, name, bitmap);
+    if (block_id == 0) return -EBUSY;   // The root directory
+    if (block_id > 0 && dir_self_id(*parent_dir) == block_id)
+    {
+        int parent_block_id = dir_parent_id(*parent_dir);
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        *parent_dir = parent_block_id == 0 ? superblock->root_dir : heartyfs_block(dev, parent_block_id);
+        if (!heartyfs_pin(dev, *parent_dir)) return -ENOMEM;
+    }
+    return block_id;
+}
+
+static int hfs_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct heartyfs_dev *dev = begin_op();
+    if (flags & RENAME_EXCHANGE) return end_op(dev, -EINVAL);
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    struct heartyfs_directory *src_parent;
+    char src_name[FILENAME_MAX];
+    int block_id = lookup_entry(dev, from, &src_parent, src_name, bitmap);
+    if (block_id < 0) return end_op(dev, block_id);
+    int is_dir = *(int *) heartyfs_block(dev, block_id) == 1;
+
+    struct heartyfs_directory *dst_parent;
+    char dst_name[FILENAME_MAX];
+    int replaced_id = lookup_entry(dev, to, &dst_parent, dst_name, bitmap);
+    if (replaced_id == -ENOENT && dst_parent == NULL) return end_op(dev, -ENOENT);
+    if (replaced_id < 0 && replaced_id != -ENOENT) return end_op(dev, replaced_id);
+    if (strlen(dst_name) > HEARTYFS_NAME_MAX) return end_op(dev, -ENAMETOOLONG);
+    if (replaced_id > 0)
+    {
+        if (flags & RENAME_NOREPLACE) return end_op(dev, -EEXIST);
+        struct heartyfs_directory *replaced = heartyfs_block(dev, replaced_id);
+        if (replaced->type == 1 && !is_dir) return end_op(dev, -EISDIR);
+        if (replaced->type != 1 && is_dir) return end_op(dev, -ENOTDIR);
+        if (replaced->type == 1 && replaced->size > 2) return end_op(dev, -ENOTEMPTY);
+    }
+    else if (dir_self_id(src_parent) != dir_self_id(dst_parent)
+                && !dir_has_room(dst_parent, dst_name))
+    {
+        return end_op(dev, -ENOSPC);
+    }
+    long quota_denied = dev->stats.quota_denied;
+    if (heartyfs_rename(dev, src_parent, src_name, dst_parent, dst_name, bitmap) == 1) return end_update(dev, 0);
+    return end_op(dev, dev->stats.quota_denied != quota_denied ? -EDQUOT : -EINVAL);
+}
+
+static int hfs_statfs(const char *path, struct statvfs *st)
+{
+    struct heartyfs_dev *dev = begin_op();
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = superblock->total_blocks;
+    st->f_bfree = superblock->free_blocks;
+    st->f_bavail = superblock->free_blocks;
+    st->f_files = superblock->total_blocks;
+    st->f_ffree = superblock->free_blocks;
+    st->f_namemax = HEARTYFS_NAME_MAX;
+    return end_op(dev, 0);
+}
+
+static int hfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    return end_op(dev, heartyfs_dev_flush(dev) == 0 ? 0 : -EIO);
+}
+
+/*
+ * @brief Resolves a path for the metadata callbacks: the inode of a file, private to the
+ *        live tree when bitmap is given.
+ *
+ * @return int          The block of the inode, -EISDIR for a directory, or a negative errno.
+ */
+static int lookup_file(struct heartyfs_dev *dev, const char *path, struct fuse_file_info *fi,
+                        uint8_t *bitmap)
+{
+    if (fi != NULL) return (int) fi->fh;
+    struct heartyfs_directory *parent_dir;
+    char name[FILENAME_MAX];
+    int block_id = lookup(dev, path, &parent_dir, name, bitmap);
+    if (block_id < 0) return block_id;
+    if (block_id == 0 || *(int *) heartyfs_block(dev, block_id) == 1) return -EISDIR;
+    return block_id;
+}
+
+static int hfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = lookup_file(dev, path, fi, heartyfs_block(dev, 1));
+    if (block_id == -EISDIR) return end_op(dev, 0);  // Directories have no mode of their own
+    if (block_id < 0) return end_op(dev, block_id);
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    inode->mode = mode & 07777;
+    heartyfs_touch(dev, inode, 0);
+    return end_update(dev, 0);
+}
+
+static int hfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = lookup_file(dev, path, fi, heartyfs_block(dev, 1));
+    if (block_id == -EISDIR) return end_op(dev, 0);
+    if (block_id < 0) return end_op(dev, block_id);
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    if (uid != (uid_t) -1) inode->uid = (uint16_t) uid;
+    if (gid != (gid_t) -1) inode->gid = (uint16_t) gid;
+    heartyfs_touch(dev, inode, 0);
+    return end_update(dev, 0);
+}
+
+static int hfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = lookup_file(dev, path, fi, heartyfs_block(dev, 1));
+    if (block_id == -EISDIR) return end_op(dev, 0);  // Directories keep no times; accept touch
+    if (block_id < 0) return end_op(dev, block_id);
+
+    // Only the modification time is kept; the access time follows it
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    heartyfs_touch(dev, inode, 0);
+    if (tv == NULL || tv[1].tv_nsec == UTIME_NOW) inode->mtime = inode->ctime;
+    else if (tv[1].tv_nsec != UTIME_OMIT) inode->mtime = (int64_t) tv[1].tv_sec * 1000000000 + tv[1].tv_nsec;
+    return end_update(dev, 0);
+}
+
+static int hfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    struct heartyfs_dev *dev = begin_op();
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    int block_id = lookup_file(dev, path, NULL, bitmap);
+    if (block_id == -EISDIR) return end_op(dev, -ENOTSUP);
+    if (block_id < 0) return end_op(dev, block_id);
+    int exists = heartyfs_xattr_get(dev, heartyfs_block(dev, block_id), name, NULL, 0) >= 0;
+    if ((flags & XATTR_CREATE) && exists) return end_op(dev, -EEXIST);
+    if ((flags & XATTR_REPLACE) && !exists) return end_op(dev, -ENODATA);
+    if (strlen(name) > 255 || size > 255) return end_op(dev, -ERANGE);
+    int status = charge_file(dev, path, block_id);
+    if (status == 0 && heartyfs_xattr_set(dev, block_id, name, value, size, bitmap) != 1) status = -ENOSPC;
+    heartyfs_charge_clear(dev);
+    return end_update(dev, status);
+}
+
+static int hfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = lookup_file(dev, path, NULL, NULL);
+    if (block_id == -EISDIR) return end_op(dev, -ENODATA);
+    if (block_id < 0) return end_op(dev, block_id);
+    int length = heartyfs_xattr_get(dev, heartyfs_block(dev, block_id), name, value, size);
+    if (length == -1) return end_op(dev, -ENODATA);
+    return end_op(dev, length == -2 ? -ERANGE : length);
+}
+
+static int hfs_listxattr(const char *path, char *list, size_t size)
+{
+    struct heartyfs_dev *dev = begin_op();
+    int block_id = lookup_file(dev, path, NULL, NULL);
+    if (block_id == -EISDIR) return end_op(dev, 0);
+    if (block_id < 0) return end_op(dev, block_id);
+    int length = heartyfs_xattr_list(dev, heartyfs_block(dev, block_id), list, size);
+    return end_op(dev, length == -2 ? -ERANGE : length);
+}
+
+static int hfs_removexattr(const char *path, const char *name)
+{
+    struct heartyfs_dev *dev = begin_op();
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    int block_id = lookup_file(dev, path, NULL, bitmap);
+    if (block_id == -EISDIR) return end_op(dev, -ENODATA);
+    if (block_id < 0) return end_op(dev, block_id);
+    if (heartyfs_xattr_get(dev, heartyfs_block(dev, block_id), name, NULL, 0) < 0) return end_op(dev, -ENODATA);
+    int status = charge_file(dev, path, block_id);
+    if (status == 0 && heartyfs_xattr_remove(dev, block_id, name, bitmap) != 1) status = -ENOSPC;
+    heartyfs_charge_clear(dev);
+    return end_update(dev, status);
+}
+
+static const struct fuse_operations hfs_operations = {
+    .init = hfs_init,
+    .destroy = hfs_destroy,
+    .getattr = hfs_getattr,
+    .readdir = hfs_readdir,
+    .mkdir = hfs_mkdir,
+    .create = hfs_create,
+    .open = hfs_open,
+    .read = hfs_read,
+    .write = hfs_write,
+    .truncate = hfs_truncate,
+    .unlink = hfs_unlink,
+    .rename = hfs_rename,
+    .link = hfs_link,
+    .rmdir = hfs_rmdir,
+    .statfs = hfs_statfs,
+    .fsync = hfs_fsync,
+    .chmod = hfs_chmod,
+    .chown = hfs_chown,
+    .utimens = hfs_utimens,
+    .setxattr = hfs_setxattr,
+    .getxattr = hfs_getxattr,
+    .listxattr = hfs_listxattr,
+    .removexattr = hfs_removexattr,
+};
+
+int main(int argc, char *argv[])
+{
+    // Take the heartyfs options out of the mount options
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct hfs_options options = {NULL, 0, 0};
+    if (fuse_opt_parse(&args, &options, hfs_option_spec, NULL) < 0)
+    {
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    static struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Mount options take precedence over HEARTYFS_DURABILITY and friends
+    if (options.durability != NULL && heartyfs_dev_set_durability(&dev, options.durability) < 0)
+    {
+        heartyfs_dev_close(&dev);
+        printf("Error: Unknown durability mode %s, use sync, group or async\n", options.durability);
+        exit(2);
+    }
+    if (options.group_ms > 0) dev.group_ms = options.group_ms;
+    if (options.group_ops > 0) dev.group_ops = options.group_ops;
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Runs multithreaded unless -s is given; the image is closed by hfs_destroy
+    int status = fuse_main(args.argc, args.argv, &hfs_operations, &dev);
+    fuse_opt_free_args(&args);
+    free(options.durability);
+    return status;
+}
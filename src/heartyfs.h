@@ -5,28 +5,82 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <time.h>
+#include <limits.h>
 
 #define DISK_FILE_PATH "/tmp/heartyfs"
 #define BLOCK_SIZE (1 << 9)
 #define DISK_SIZE (1 << 20)
 #define NUM_BLOCK (DISK_SIZE / BLOCK_SIZE)
-#define FILES_PER_DIR 14
+#define BLOCK_GROUP_SIZE (BLOCK_SIZE * 8)
 #define CHAR_SIZE 28
+#define DIR_NAME_SIZE 20
+#define HEARTYFS_NAME_MAX 255
+#define DIR_RECORD_AREA 448
+#define DIR_RECORD_HEADER 7
+#define DIR_MAX_ENTRIES (DIR_RECORD_AREA / (DIR_RECORD_HEADER + 1))
+#define HEARTYFS_FORMAT_PACKED_DIRS 1
+#define HEARTYFS_FORMAT_INODE_META 2
+#define HEARTYFS_FORMAT_DIR_USAGE 3
 #define MAX_DATA_BLOCKS 119
+#define XATTR_AREA 508
+#define XATTR_RECORD_HEADER 2
+#define HEARTYFS_FILE_MODE 0644
 #define DATA_BLOCK_SIZE 508
+#define HEARTYFS_BACKEND_MMAP 0
+#define HEARTYFS_BACKEND_PREAD 1
+#define HEARTYFS_CACHE_BLOCKS 256
+#define HEARTYFS_IO_BATCH 16
+#define REFCOUNT_TABLE_BLOCKS 32
+#define SNAPSHOT_PREFIX '@'
+#define MAX_SHARE_COUNT 255
+#define DEDUP_INDEX_BLOCKS 8
+#define DEDUP_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct heartyfs_dedup_entry))
+#define INODE_FLAG_COMPRESSED (1 << 8)
+#define COMPRESS_UNIT_BLOCKS 8
+#define COMPRESS_UNIT_SIZE (COMPRESS_UNIT_BLOCKS * DATA_BLOCK_SIZE)
+#define COMPRESS_SCRATCH_SIZE (COMPRESS_UNIT_SIZE + BLOCK_SIZE)
+#define CHECKSUM_VERIFIED 1
+#define CHECKSUM_STALE 2
+#define HEARTYFS_DURABILITY_SYNC 0
+#define HEARTYFS_DURABILITY_GROUP 1
+#define HEARTYFS_DURABILITY_ASYNC 2
+#define HEARTYFS_GROUP_MS 10
+#define HEARTYFS_GROUP_OPS 64
+#define FSYNC_HISTOGRAM_BUCKETS 20
+#define HEARTYFS_MAX_BLOCKS (REFCOUNT_TABLE_BLOCKS * BLOCK_SIZE)
 
-struct heartyfs_dir_entry 
+struct heartyfs_dir_record
 {
-    int block_id;               // 4 bytes
-    char file_name[CHAR_SIZE];  // 28 bytes
-};  // Overall: 32 bytes 
+    int block_id;           // 4 bytes
+    uint16_t hash;          // 2 bytes, of the name, compared before the name
+    uint8_t name_length;    // 1 byte
+    char name[];            // name_length bytes, not terminated
+} __attribute__((packed));  // Overall: 7 bytes + name
+
+struct heartyfs_dir_entry
+{
+    int block_id;
+    char file_name[HEARTYFS_NAME_MAX + 1];
+};  // Unpacked entry, only in memory
+
+struct heartyfs_dir_cursor
+{
+    int offset;             // Byte offset of the next record
+    int index;              // Position of the next record among the entries
+};
 
 struct heartyfs_directory 
 {
     int type;               // 4 bytes
-    char name[CHAR_SIZE];   // 28 bytes
-    int size;               // 4 bytes
-    struct heartyfs_dir_entry entries[FILES_PER_DIR]; // 448 bytes
+    char name[DIR_NAME_SIZE];   // 20 bytes, truncated copy of the name
+    int used_blocks;        // 4 bytes, blocks charged to the subtree, this block included
+    int quota_blocks;       // 4 bytes, most blocks the subtree may use, 0 for no limit
+    int size;               // 4 bytes, entries including "." and ".."
+    uint8_t records[DIR_RECORD_AREA]; // 448 bytes, heartyfs_dir_record one after the other
 }; // Overall: 484 bytes
 
 struct heartyfs_superblock 
@@ -34,43 +88,281 @@ struct heartyfs_superblock
     int total_blocks;       // 4 bytes
     int free_blocks;        // 4 bytes
     int block_size;         // 4 bytes
-    int type;               // 4 bytes
+    int type;               // 4 bytes, HEARTYFS_FORMAT_* of the image, 0 for the first one
     struct heartyfs_directory root_dir[1]; // 484 bytes
-}; // Overall: 500 bytes
+    int ext_block;          // 4 bytes, block of heartyfs_ext or 0 if none
+}; // Overall: 504 bytes
 
 struct heartyfs_inode 
 {
-    int type;               // 4 bytes
-    char name[28];          // 28 bytes
-    int size;               // 4 bytes
+    uint16_t type;          // 2 bytes, 0 for a file, plus INODE_FLAG_* bits
+    uint16_t mode;          // 2 bytes, permission bits
+    int length;             // 4 bytes, bytes of the file
+    int64_t mtime;          // 8 bytes, last change of the content, nanoseconds since the epoch
+    int64_t ctime;          // 8 bytes, last change of the content or the metadata
+    uint16_t uid;           // 2 bytes, owner
+    uint16_t gid;           // 2 bytes, group
+    int xattr_block;        // 4 bytes, block of heartyfs_xattr_block or 0 if none
+    uint16_t size;          // 2 bytes, data blocks
+    uint16_t links;         // 2 bytes, names in the live tree beyond the first (0 for one name)
     int data_blocks[MAX_DATA_BLOCKS];   // 476 bytes
 };  // Overall: 512 bytes
 
+struct heartyfs_xattr_block
+{
+    int used;               // 4 bytes, bytes of records in use
+    uint8_t records[XATTR_AREA];    // 508 bytes, heartyfs_xattr_record one after the other
+};  // Overall: 512 bytes
+
+struct heartyfs_xattr_record
+{
+    uint8_t name_length;    // 1 byte
+    uint8_t value_length;   // 1 byte
+    char data[];            // The name, then the value, neither terminated
+} __attribute__((packed));  // Overall: 2 bytes + name + value
+
 struct heartyfs_data_block 
 {
     int size;                       // 4 bytes
     char name[DATA_BLOCK_SIZE];     // 508 bytes
 };  // Overall: 512 bytes
 
+struct heartyfs_ext
+{
+    int snapshot_dir;       // 4 bytes, directory block listing the snapshots or 0
+    int refcount_blocks[REFCOUNT_TABLE_BLOCKS]; // 128 bytes, share count table (1 byte per block)
+    int dedup_blocks[DEDUP_INDEX_BLOCKS];       // 32 bytes, content hash index buckets
+    int checksum_start;     // 4 bytes, first block of the CRC32C table or 0 if none
+    int checksum_blocks;    // 4 bytes, blocks of the CRC32C table (4 bytes per block)
+};  // Overall: 172 bytes
+
+struct heartyfs_frame_header
+{
+    int raw_size;           // 4 bytes, size of the unit before compression
+    int stored_size;        // 4 bytes, bytes that follow; equal to raw_size when stored raw
+};  // Overall: 8 bytes
+
+struct heartyfs_dedup_entry
+{
+    uint32_t tag;           // 4 bytes, upper half of the content hash
+    int block_id;           // 4 bytes, 0 when the entry is empty
+};  // Overall: 8 bytes
+
+struct heartyfs_entry_info
+{
+    int block_id;           // Block of the directory or inode
+    int type;               // 1 for a directory, 0 for a file, plus INODE_FLAG_* bits
+    long size;              // Bytes of a file, or entries of a directory without "." and ".."
+    int blocks;             // Blocks used: the inode, its data and xattr blocks, or the directory block
+    int links;              // Names of a file, 1 unless it has hard links
+    int mode;               // Permission bits of a file
+    int uid;                // Owner of a file
+    int gid;                // Group of a file
+    int64_t mtime;          // Last change of the content of a file, in nanoseconds
+    int64_t ctime;          // Last change of its content or metadata, in nanoseconds
+    char name[HEARTYFS_NAME_MAX + 1];   // Entry name in the parent directory
+};
+
+struct heartyfs_cache_slot
+{
+    int block_id;           // -1 when the slot is empty
+    uint8_t dirty;          // 1 when the slot must be written back
+    uint8_t referenced;     // CLOCK reference bit
+    uint8_t pinned;         // Holders of the slot, it is never evicted while above 0
+};
+
+struct heartyfs_cache_stats
+{
+    long hits;              // Lookups served without I/O
+    long misses;            // Lookups that read from the image
+    long evictions;         // Slots reused for another block
+    long writebacks;        // Blocks written back to the image
+    long write_batches;     // pwritev calls used for those blocks
+    long dedup_shared;      // Data blocks shared instead of allocated
+    long compress_in;       // File bytes given to the compressor
+    long compress_out;      // Frame bytes stored for them
+    long checksum_verified; // Blocks checked against their checksum
+    long checksum_errors;   // Blocks that did not match it
+    long quota_denied;      // Charges refused by a directory quota
+    long commits;           // Operations handed to heartyfs_dev_commit
+    long fsyncs;            // Durable flushes (msync or fsync)
+    long fsync_us;          // Time spent in them, in microseconds
+    long fsync_histogram[FSYNC_HISTOGRAM_BUCKETS]; // Bucket i: [2^i, 2^(i+1)) microseconds
+    int pinned;             // Slots currently pinned
+};
+
+struct heartyfs_dev
+{
+    int fd;                 // File descriptor of the disk image
+    int backend;            // HEARTYFS_BACKEND_MMAP or HEARTYFS_BACKEND_PREAD
+    size_t size;            // Size of the disk image in bytes
+    int num_blocks;         // Number of blocks in the disk image
+    int block_groups;       // Number of block groups, BLOCK_GROUP_SIZE blocks each
+    uint8_t *bitmap;        // The bitmaps of every block group, one after the other
+    void *map;              // mmap backend: the whole image
+    uint8_t *meta;          // pread backend: resident superblock and bitmaps
+    uint8_t *slot_data;     // pread backend: HEARTYFS_CACHE_BLOCKS cached blocks
+    struct heartyfs_cache_slot *slots;
+    int cache_blocks;       // pread backend: number of cache slots
+    int *index;             // pread backend: block id -> slot, -1 if not cached
+    int *dirty_ids;         // pread backend: scratch list for write-back
+    int hand;               // pread backend: CLOCK hand
+    int dedup;              // 1 when HEARTYFS_DEDUP=1 shares identical data blocks
+    int compress;           // 1 when HEARTYFS_COMPRESS=1 compresses newly written files
+    int checksum;           // 1 when HEARTYFS_CHECKSUM=1 adds a checksum table to the image
+    uint32_t *checksums;    // CRC32C of every block, NULL when the image has no checksum table
+    uint8_t *block_state;   // CHECKSUM_* bits of every block since the table was loaded
+    int checksums_changed;  // 1 when the table must be stored on the next flush
+    int reserve_next;       // Next block of the run reserved by heartyfs_reserve_run
+    int reserve_end;        // One past the end of that run, equal to reserve_next when none
+    int durability;         // HEARTYFS_DURABILITY_* flush policy of heartyfs_dev_commit
+    int group_ms;           // Group commit: most milliseconds a commit waits for its flush
+    int group_ops;          // Group commit: most commits waiting for one flush
+    int pending_ops;        // Commits since the last durable flush
+    struct timespec pending_since;  // When the oldest of them was made
+    int *charge_dirs;       // Directories charged for blocks added to or dropped from a file
+    int charge_count;       // Number of them, one per live name of the file
+    struct heartyfs_cache_stats stats;
+};
+
 #ifndef HEARTYFS_H
 #define HEARTYFS_H
 
+// Block device operations
+int heartyfs_dev_open(struct heartyfs_dev *dev, const char *path);
+int heartyfs_dev_remap(struct heartyfs_dev *dev, int num_blocks);
+int heartyfs_bitmap_block(int group);
+void *heartyfs_block(struct heartyfs_dev *dev, int block_id);
+void heartyfs_dirty(struct heartyfs_dev *dev, void *ptr);
+int heartyfs_pin(struct heartyfs_dev *dev, void *ptr);
+void heartyfs_unpin(struct heartyfs_dev *dev, void *ptr);
+void heartyfs_unpin_all(struct heartyfs_dev *dev);
+void heartyfs_prefetch(struct heartyfs_dev *dev, int *block_ids, int count);
+int heartyfs_dev_flush(struct heartyfs_dev *dev);
+int heartyfs_dev_barrier(struct heartyfs_dev *dev);
+int heartyfs_dev_unlock(struct heartyfs_dev *dev);
+int heartyfs_dev_lock(struct heartyfs_dev *dev);
+int heartyfs_dev_set_durability(struct heartyfs_dev *dev, const char *mode);
+int heartyfs_dev_commit(struct heartyfs_dev *dev);
+int heartyfs_dev_commit_due(struct heartyfs_dev *dev);
+void heartyfs_dev_print_stats(struct heartyfs_dev *dev, FILE *out);
+void heartyfs_dev_close(struct heartyfs_dev *dev);
+
 // Bitmap operations
 void free_block(int block_id, uint8_t *bitmap);
 void occupy_block(int block_id, uint8_t *bitmap);
-int find_free_block(uint8_t *bitmap);
+int find_free_block(struct heartyfs_dev *dev, uint8_t *bitmap);
+int find_free_run(struct heartyfs_dev *dev, uint8_t *bitmap, int length);
+void heartyfs_reserve_run(struct heartyfs_dev *dev, int start, int length);
 int status_block(int block_id, uint8_t *bitmap);
+int take_block(struct heartyfs_dev *dev, uint8_t *bitmap);
+void give_block(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap);
 
 // Entry operations
+int dir_self_id(struct heartyfs_directory *dir);
+int dir_parent_id(struct heartyfs_directory *dir);
+void dir_set_self(struct heartyfs_directory *dir, int block_id);
+void dir_set_parent(struct heartyfs_directory *dir, int block_id);
+void dir_start(struct heartyfs_directory *dir, struct heartyfs_dir_cursor *cursor, int with_dots);
+int dir_next(struct heartyfs_directory *dir, struct heartyfs_dir_cursor *cursor,
+                struct heartyfs_dir_entry *entry);
+int dir_has_room(struct heartyfs_directory *dir, const char *name);
+int dir_add(struct heartyfs_directory *dir, const char *name, int block_id);
+int dir_replace_id(struct heartyfs_directory *dir, const char *name, int old_id, int new_id);
+int dir_rename_entry(struct heartyfs_directory *dir, const char *old_name, const char *new_name);
+int heartyfs_dir_upgrade(struct heartyfs_dev *dev);
 int search_entry_in_dir(struct heartyfs_directory *parent_dir, char *target_name);
-int dir_string_check(char *input_str, char *dir_name, void* buffer,
+int dir_string_check(char *input_str, char *dir_name, struct heartyfs_dev *dev,
                         struct heartyfs_directory **parent_dir, uint8_t *bitmap);
-int create_entry(struct heartyfs_superblock *superblock, struct heartyfs_directory *parent_dir, 
-                    char *target_name, int target_block_id, uint8_t *bitmap);
-int remove_entry(struct heartyfs_superblock *superblock, void* buffer, 
+int create_entry(struct heartyfs_dev *dev, struct heartyfs_directory *parent_dir, 
+                    char *target_name, int target_block_id);
+int remove_entry(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev, 
                     int parent_block_id, char *target_name);
+int heartyfs_rename(struct heartyfs_dev *dev, struct heartyfs_directory *src_parent, char *src_name,
+                    struct heartyfs_directory *dst_parent, char *dst_name, uint8_t *bitmap);
+int heartyfs_readdir_plus(struct heartyfs_dev *dev, struct heartyfs_directory *dir,
+                            struct heartyfs_entry_info *infos);
+int heartyfs_entry_info(struct heartyfs_dev *dev, int block_id, char *name,
+                            struct heartyfs_entry_info *info);
+
+// File operations
+void heartyfs_format(struct heartyfs_dev *dev);
+int allocate_datablock(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev, 
+                        uint8_t *bitmap, struct heartyfs_inode *inode,
+                        struct heartyfs_data_block **datablock);
+int write_datablock(struct heartyfs_dev *dev, uint8_t *bitmap, struct heartyfs_inode *inode,
+                        char *data, int size);
+
+// Metadata operations
+int64_t heartyfs_now(void);
+void heartyfs_inode_init(struct heartyfs_dev *dev, struct heartyfs_inode *inode);
+void heartyfs_touch(struct heartyfs_dev *dev, struct heartyfs_inode *inode, int content);
+int heartyfs_xattr_get(struct heartyfs_dev *dev, struct heartyfs_inode *inode, const char *name,
+                        void *value, int size);
+int heartyfs_xattr_set(struct heartyfs_dev *dev, int block_id, const char *name,
+                        const void *value, int size, uint8_t *bitmap);
+int heartyfs_xattr_remove(struct heartyfs_dev *dev, int block_id, const char *name, uint8_t *bitmap);
+int heartyfs_xattr_list(struct heartyfs_dev *dev, struct heartyfs_inode *inode, char *list, int size);
+int heartyfs_inode_upgrade(struct heartyfs_dev *dev);
+
+// Space accounting operations
+long heartyfs_entry_charge(struct heartyfs_dev *dev, int block_id);
+int heartyfs_quota_check(struct heartyfs_dev *dev, int dir_id, long delta);
+void heartyfs_charge(struct heartyfs_dev *dev, int dir_id, long delta);
+int heartyfs_charge_file(struct heartyfs_dev *dev, int block_id, int parent_id);
+int heartyfs_charge_blocks(struct heartyfs_dev *dev, int delta);
+void heartyfs_charge_clear(struct heartyfs_dev *dev);
+int heartyfs_usage_upgrade(struct heartyfs_dev *dev);
+
+// Resize operations
+int heartyfs_add_blocks(uint8_t *bitmap, int first, int last);
+int heartyfs_grow(struct heartyfs_dev *dev);
+
+// Deduplication operations
+uint64_t heartyfs_hash(const void *data, size_t length, uint64_t seed);
+int heartyfs_dedup_lookup(struct heartyfs_dev *dev, struct heartyfs_data_block *content);
+void heartyfs_dedup_insert(struct heartyfs_dev *dev, int block_id,
+                            struct heartyfs_data_block *content, uint8_t *bitmap);
+void heartyfs_dedup_remove(struct heartyfs_dev *dev, int block_id);
+
+// Compression operations
+int lz_compress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity);
+int lz_decompress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity);
+int write_unit(struct heartyfs_dev *dev, uint8_t *bitmap, struct heartyfs_inode *inode,
+                    char *data, int size);
+int frame_size_of(struct heartyfs_data_block *datablock);
+int decode_frame(char *frame, char *out);
+int read_unit(struct heartyfs_dev *dev, struct heartyfs_inode *inode, int *block_index,
+                char *out, char *scratch);
+long heartyfs_file_size(struct heartyfs_dev *dev, struct heartyfs_inode *inode);
+
+// Checksum operations
+uint32_t heartyfs_crc32c(const void *data, size_t length);
+int heartyfs_checksum_load(struct heartyfs_dev *dev);
+int heartyfs_checksum_create(struct heartyfs_dev *dev, uint8_t *bitmap);
+void heartyfs_checksum_release(struct heartyfs_dev *dev);
+int heartyfs_checksum_verify(struct heartyfs_dev *dev, int block_id, const void *data);
+void heartyfs_checksum_update(struct heartyfs_dev *dev, int block_id, const void *data);
+int heartyfs_checksum_store(struct heartyfs_dev *dev);
+
+// Parallel read operations
+long heartyfs_read_parallel(struct heartyfs_dev *dev, int block_id, int out_fd, int threads);
 
-// Cleanup operation
-void cleanup(void *buffer, int fd);
+// Copy-on-write operations
+struct heartyfs_ext *heartyfs_get_ext(struct heartyfs_dev *dev, uint8_t *bitmap);
+int share_count(struct heartyfs_dev *dev, int block_id);
+int heartyfs_find_names(struct heartyfs_dev *dev, int block_id, char (*paths)[PATH_MAX], int max_paths);
+int share_add(struct heartyfs_dev *dev, int block_id, int delta);
+int create_share_table(struct heartyfs_dev *dev, struct heartyfs_ext *ext, uint8_t *bitmap);
+int heartyfs_unshare(struct heartyfs_dev *dev, struct heartyfs_directory *parent_dir,
+                        char *target_name, uint8_t *bitmap);
+void heartyfs_release(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap);
+int heartyfs_link(struct heartyfs_dev *dev, int block_id, struct heartyfs_directory *dst_parent,
+                    char *dst_name, uint8_t *bitmap);
+void heartyfs_unlink(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap);
+void heartyfs_release_data(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap);
+int heartyfs_snapshot_create(struct heartyfs_dev *dev, char *snapshot_name, uint8_t *bitmap);
+int heartyfs_snapshot_root(struct heartyfs_dev *dev, char *snapshot_name);
+int heartyfs_snapshot_delete(struct heartyfs_dev *dev, char *snapshot_name, uint8_t *bitmap);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,339 @@
+/*
+ * heartyfs_checksum.c
+ *
+ * Brief
+ * - This program provides block checksums. Every block of the image has a CRC32C in an
+ *   on-image table; a block is checked against it when it is first read, and its checksum is
+ *   recomputed when it is written back, so silent corruption of the image is reported.
+ *
+ * Data Structures:
+ * - Checksum table: A run of contiguous blocks referenced from the extension block, holding
+ *   one little-endian uint32_t per block of the image. A checksum of 0 means "not covered";
+ *   the blocks of the table itself are never covered.
+ * - `dev->checksums`: The whole table, loaded when the device is opened and stored back on
+ *   every flush if it changed. `dev->block_state` remembers which blocks were already verified
+ *   and, for the mmap backend, which ones were modified since.
+ *
+ * Design Decisions:
+ * - CRC32C uses the SSE4.2 `crc32` instruction when the CPU has it, eight bytes at a time,
+ *   and a byte-wise table otherwise. Both give the same values, so images move between hosts.
+ * - The table lives in memory, outside the block cache, so updating a checksum during
+ *   write-back never loads or evicts another block.
+ * - The pread backend verifies blocks as they are read from the image and checksums them as
+ *   they are written back. The mmap backend verifies a block the first time it is accessed
+ *   and checksums the blocks marked by heartyfs_dirty on flush. The superblock and the bitmaps
+ *   are changed without heartyfs_dirty, so they are checksummed on every flush.
+ * - A mismatch is reported and counted, and the block is still returned; the scrub tool
+ *   lists every bad block of the image.
+ * - The table is added to an image by opening it once with HEARTYFS_CHECKSUM=1. After that
+ *   every tool keeps it up to date.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78      // Castagnoli polynomial, bit-reversed
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw = -1;          // 1 when the CPU has SSE4.2, -1 before the first call
+
+/*
+ * @brief Builds the byte-wise lookup table of the portable implementation.
+ */
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#else
+    crc32c_hw = 0;
+#endif
+}
+
+#if defined(__x86_64__)
+/*
+ * @brief Updates a CRC32C with the SSE4.2 instruction, eight bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+    while (length-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/*
+ * @brief Computes the CRC32C (Castagnoli) of a buffer.
+ *
+ * @param data          The bytes to checksum.
+ * @param length        Number of bytes.
+ * @return uint32_t     The checksum.
+ */
+uint32_t heartyfs_crc32c(const void *data, size_t length)
+{
+    if (crc32c_hw < 0) crc32c_init();
+    const uint8_t *p = data;
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+    if (crc32c_hw) return ~crc32c_sse42(crc, p, length);
+#endif
+    while (length-- > 0) crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+/*
+ * @brief Forgets the loaded checksum table. Nothing is written back.
+ *
+ * @param dev           The open device.
+ */
+void heartyfs_checksum_release(struct heartyfs_dev *dev)
+{
+    free(dev->checksums);
+    free(dev->block_state);
+    dev->checksums = NULL;
+    dev->block_state = NULL;
+    dev->checksums_changed = 0;
+}
+
+/*
+ * @brief Locates the checksum table of the image.
+ *
+ * @param dev           The open device.
+ * @param start         Output: the first block of the table.
+ * @return int          Blocks of the table, 0 if there is none, -1 if its location is corrupt.
+ */
+static int table_location(struct heartyfs_dev *dev, int *start)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->checksum_start <= 0) return 0;
+    *start = ext->checksum_start;
+    int blocks = ext->checksum_blocks;
+    if (*start < 2 || blocks <= 0 || *start + blocks > dev->num_blocks
+            || (long) blocks * BLOCK_SIZE < (long) dev->num_blocks * (long) sizeof(uint32_t))
+    {
+        return -1;
+    }
+    return blocks;
+}
+
+/*
+ * @brief Loads the checksum table of the image, if it has one, and verifies the superblock
+ *        and the bitmaps, which were read before the table.
+ *
+ * @param dev           The open device.
+ * @return int          1 if the table was loaded, 0 if there is none, -1 on failure.
+ */
+int heartyfs_checksum_load(struct heartyfs_dev *dev)
+{
+    heartyfs_checksum_release(dev);
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->ext_block <= 0 || superblock->ext_block >= dev->num_blocks) return 0;
+
+    int start = 0;
+    int blocks = table_location(dev, &start);
+    if (blocks == 0) return 0;
+    if (blocks < 0)
+    {
+        printf("Error: The checksum table is corrupted\n");
+        return -1;
+    }
+
+    size_t table_size = (size_t) dev->num_blocks * sizeof(uint32_t);
+    dev->checksums = malloc(table_size);
+    dev->block_state = calloc(dev->num_blocks, 1);
+    if (dev->checksums == NULL || dev->block_state == NULL)
+    {
+        heartyfs_checksum_release(dev);
+        printf("Error: Cannot allocate the checksum table\n");
+        return -1;
+    }
+    off_t offset = (off_t) start * BLOCK_SIZE;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP) memcpy(dev->checksums, (uint8_t *) dev->map + offset, table_size);
+    else if (pread(dev->fd, dev->checksums, table_size, offset) != (ssize_t) table_size)
+    {
+        heartyfs_checksum_release(dev);
+        perror("Cannot read the checksum table\n");
+        return -1;
+    }
+
+    heartyfs_checksum_verify(dev, 0, heartyfs_block(dev, 0));
+    for (int group = 0; group < dev->block_groups; group++)
+    {
+        int block_id = heartyfs_bitmap_block(group);
+        heartyfs_checksum_verify(dev, block_id, heartyfs_block(dev, block_id));
+    }
+    return 1;
+}
+
+/*
+ * @brief Adds a checksum table to the image and checksums every block.
+ *
+ * @param dev           The open device.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if there is no room for the table or on I/O error.
+ */
+int heartyfs_checksum_create(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, bitmap);
+    if (ext == NULL) return -1;
+    if (ext->checksum_start > 0) return heartyfs_checksum_load(dev);
+
+    int blocks = (dev->num_blocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int start = find_free_run(dev, bitmap, blocks);
+    if (start < 0 || superblock->free_blocks < blocks)
+    {
+        printf("Error: There is no room for a checksum table of %d blocks\n", blocks);
+        return -1;
+    }
+    for (int i = 0; i < blocks; i++) occupy_block(start + i, bitmap);
+    superblock->free_blocks -= blocks;
+    ext->checksum_start = start;
+    ext->checksum_blocks = blocks;
+    heartyfs_dirty(dev, ext);
+
+    // Write everything out so the image holds what gets checksummed
+    if (heartyfs_dev_flush(dev) < 0) return -1;
+    dev->checksums = calloc(dev->num_blocks, sizeof(uint32_t));
+    dev->block_state = calloc(dev->num_blocks, 1);
+    if (dev->checksums == NULL || dev->block_state == NULL)
+    {
+        heartyfs_checksum_release(dev);
+        printf("Error: Cannot allocate the checksum table\n");
+        return -1;
+    }
+
+    uint8_t batch[HEARTYFS_IO_BATCH * BLOCK_SIZE];
+    for (int first = 0; first < dev->num_blocks; first += HEARTYFS_IO_BATCH)
+    {
+        int count = dev->num_blocks - first < HEARTYFS_IO_BATCH ? dev->num_blocks - first : HEARTYFS_IO_BATCH;
+        uint8_t *data = batch;
+        if (dev->backend == HEARTYFS_BACKEND_MMAP) data = (uint8_t *) dev->map + (size_t) first * BLOCK_SIZE;
+        else if (pread(dev->fd, batch, (size_t) count * BLOCK_SIZE, (off_t) first * BLOCK_SIZE)
+                    != (ssize_t) count * BLOCK_SIZE)
+        {
+            heartyfs_checksum_release(dev);
+            perror("Cannot read the image to checksum it\n");
+            return -1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            int block_id = first + i;
+            if (block_id >= start && block_id < start + blocks) continue;  // The table itself
+            dev->checksums[block_id] = heartyfs_crc32c(data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+            dev->block_state[block_id] = CHECKSUM_VERIFIED;
+        }
+    }
+    dev->checksums_changed = 1;
+    printf("Success: Added a checksum table of %d blocks at block %d\n", blocks, start);
+    return 1;
+}
+
+/*
+ * @brief Checks a block that was just read against its checksum.
+ *
+ * @param dev           The open device, with a checksum table loaded.
+ * @param block_id      The ID of the block.
+ * @param data          Its BLOCK_SIZE bytes.
+ * @return int          1 if it matches or is not covered, -1 if it does not match.
+ */
+int heartyfs_checksum_verify(struct heartyfs_dev *dev, int block_id, const void *data)
+{
+    dev->block_state[block_id] |= CHECKSUM_VERIFIED;
+    if (dev->checksums[block_id] == 0) return 1;
+    dev->stats.checksum_verified++;
+    if (heartyfs_crc32c(data, BLOCK_SIZE) == dev->checksums[block_id]) return 1;
+
+    dev->stats.checksum_errors++;
+    printf("Error: Block %d does not match its checksum\n", block_id);
+    return -1;
+}
+
+/*
+ * @brief Recomputes the checksum of a block that is being written.
+ *
+ * @param dev           The open device, with a checksum table loaded.
+ * @param block_id      The ID of the block.
+ * @param data          Its new BLOCK_SIZE bytes.
+ */
+void heartyfs_checksum_update(struct heartyfs_dev *dev, int block_id, const void *data)
+{
+    uint32_t crc = heartyfs_crc32c(data, BLOCK_SIZE);
+    if (dev->checksums[block_id] != crc)
+    {
+        dev->checksums[block_id] = crc;
+        dev->checksums_changed = 1;
+    }
+    dev->block_state[block_id] = CHECKSUM_VERIFIED;
+}
+
+/*
+ * @brief Checksums the blocks changed since the last flush and stores the table on the image.
+ *        Called by heartyfs_dev_flush after the blocks themselves were written back.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success or without a table, -1 on I/O error.
+ */
+int heartyfs_checksum_store(struct heartyfs_dev *dev)
+{
+    if (dev->checksums == NULL) return 0;
+    int start = 0;
+    if (table_location(dev, &start) <= 0)
+    {
+        heartyfs_checksum_release(dev);     // The table is gone, e.g. the image was formatted
+        return 0;
+    }
+
+    heartyfs_checksum_update(dev, 0, heartyfs_block(dev, 0));
+    for (int group = 0; group < dev->block_groups; group++)
+    {
+        int block_id = heartyfs_bitmap_block(group);
+        heartyfs_checksum_update(dev, block_id, heartyfs_block(dev, block_id));
+    }
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        for (int i = 2; i < dev->num_blocks; i++)
+        {
+            if (dev->block_state[i] & CHECKSUM_STALE)
+            {
+                heartyfs_checksum_update(dev, i, (uint8_t *) dev->map + (size_t) i * BLOCK_SIZE);
+            }
+        }
+    }
+    if (!dev->checksums_changed) return 0;
+
+    size_t table_size = (size_t) dev->num_blocks * sizeof(uint32_t);
+    off_t offset = (off_t) start * BLOCK_SIZE;
+    dev->checksums_changed = 0;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        memcpy((uint8_t *) dev->map + offset, dev->checksums, table_size);
+        return 0;
+    }
+    if (pwrite(dev->fd, dev->checksums, table_size, offset) != (ssize_t) table_size)
+    {
+        perror("Cannot write the checksum table\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * heartyfs_compress.c
+ *
+ * Brief
+ * - This program provides transparent compression of file data. File content is cut into
+ *   compression units of COMPRESS_UNIT_SIZE bytes, each unit is compressed with a built-in
+ *   LZ4-style codec, and the result is stored as a frame over as few data blocks as needed.
+ *
+ * Data Structures:
+ * - Frame: A `heartyfs_frame_header` (raw and stored size) followed by the stored bytes,
+ *   spread over consecutive entries of `inode->data_blocks`. Every frame starts on a fresh
+ *   data block so each unit can be decoded on its own.
+ * - INODE_FLAG_COMPRESSED in `inode->type` marks a file whose data blocks hold frames.
+ *
+ * Design Decisions:
+ * - The codec writes the LZ4 block format (token, literals, 16-bit offset, match length)
+ *   with a single-probe hash table, favouring speed over ratio. It has no dependencies.
+ * - A unit that does not shrink is stored raw inside its frame, so incompressible data
+ *   costs only the 8-byte frame header.
+ * - Readers pass their own output and scratch buffers, so one pair of buffers is reused for
+ *   a whole file and concurrent readers never share state.
+ * - A file is compressed when it is first written with HEARTYFS_COMPRESS=1. It keeps its
+ *   format afterwards, so appends never mix frames with plain blocks.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+#define LZ_MF_LIMIT 12          // A match must start this far before the end of the input
+#define LZ_LAST_LITERALS 5      // The input always ends with this many literals
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/*
+ * @brief Writes a length that did not fit in its token nibble as 255-byte steps.
+ */
+static uint8_t *lz_write_length(uint8_t *op, int length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+/*
+ * @brief Compresses a buffer in the LZ4 block format.
+ *
+ * @param src           The bytes to compress.
+ * @param src_size      Number of bytes.
+ * @param dst           Output buffer.
+ * @param dst_capacity  Size of the output buffer.
+ * @return int          The compressed size, or 0 if it does not fit in dst_capacity.
+ */
+int lz_compress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity)
+{
+    int table[1 << LZ_HASH_LOG];
+    memset(table, 0xFF, sizeof(table));     // -1: no position seen yet
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+
+    if (src_size >= LZ_MF_LIMIT + 1)
+    {
+        const uint8_t *match_limit = end - LZ_MF_LIMIT;
+        const uint8_t *extend_limit = end - LZ_LAST_LITERALS;
+        while (ip < match_limit)
+        {
+            uint32_t sequence = lz_read32(ip);
+            uint32_t h = lz_hash(sequence);
+            int ref_position = table[h];
+            table[h] = ip - src;
+            if (ref_position < 0 || (ip - src) - ref_position > LZ_MAX_OFFSET
+                    || lz_read32(src + ref_position) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            // Extend the match forward
+            const uint8_t *ref = src + ref_position;
+            int match_length = LZ_MIN_MATCH;
+            while (ip + match_length < extend_limit && ref[match_length] == ip[match_length]) match_length++;
+
+            // Emit the sequence: token, literal length, literals, offset, match length
+            int literal_length = ip - anchor;
+            if (op + 1 + literal_length + literal_length / 255 + 1 + 2
+                    + match_length / 255 + 1 > op_end)
+            {
+                return 0;
+            }
+            uint8_t *token = op++;
+            int literal_nibble = literal_length >= 15 ? 15 : literal_length;
+            if (literal_length >= 15) op = lz_write_length(op, literal_length - 15);
+            memcpy(op, anchor, literal_length);
+            op += literal_length;
+            int offset = ip - ref;
+            *op++ = (uint8_t) (offset & 0xFF);
+            *op++ = (uint8_t) (offset >> 8);
+            int match_code = match_length - LZ_MIN_MATCH;
+            int match_nibble = match_code >= 15 ? 15 : match_code;
+            if (match_code >= 15) op = lz_write_length(op, match_code - 15);
+            *token = (uint8_t) ((literal_nibble << 4) | match_nibble);
+
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    // The last sequence carries only literals
+    int literal_length = end - anchor;
+    if (op + 1 + literal_length + literal_length / 255 + 1 > op_end) return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t) ((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15) op = lz_write_length(op, literal_length - 15);
+    memcpy(op, anchor, literal_length);
+    op += literal_length;
+    return op - dst;
+}
+
+/*
+ * @brief Decompresses a buffer in the LZ4 block format, checking every bound.
+ *
+ * @param src           The compressed bytes.
+ * @param src_size      Number of compressed bytes.
+ * @param dst           Output buffer.
+ * @param dst_capacity  Size of the output buffer.
+ * @return int          The decompressed size, or -1 if the input is corrupt.
+ */
+int lz_decompress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+
+    while (ip < end)
+    {
+        int token = *ip++;
+        int literal_length = token >> 4;
+        if (literal_length == 15)
+        {
+            int step;
+            do
+            {
+                if (ip >= end) return -1;
+                step = *ip++;
+                literal_length += step;
+            } while (step == 255);
+        }
+        if (literal_length > end - ip || literal_length > op_end - op) return -1;
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip >= end) break;   // Last sequence
+
+        if (end - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) return -1;
+        int match_length = token & 15;
+        if (match_length == 15)
+        {
+            int step;
+            do
+            {
+                if (ip >= end) return -1;
+                step = *ip++;
+                match_length += step;
+            } while (step == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > op_end - op) return -1;
+
+        // Byte by byte, the match may overlap the output it copies from
+        const uint8_t *ref = op - offset;
+        for (int i = 0; i < match_length; i++) op[i] = ref[i];
+        op += match_length;
+    }
+    return op - dst;
+}
+
+/*
+ * @brief Appends file content to an inode. Compressed files get one frame per
+ *        COMPRESS_UNIT_SIZE bytes; plain files get one data block per DATA_BLOCK_SIZE bytes.
+ *        The length and the modification time of the inode follow.
+ *
+ * @param dev        The open disk image.
+ * @param bitmap     Bitmap indicating block availability.
+ * @param inode      Inode receiving the data.
+ * @param data       The bytes to store.
+ * @param size       Number of bytes, at most COMPRESS_UNIT_SIZE.
+ *
+ * @return int       1 on success, -1 if no space or inode full. A unit that would not fit
+ *                   in the inode is rejected before any block is allocated.
+ */
+int write_unit(struct heartyfs_dev *dev, uint8_t *bitmap, struct heartyfs_inode *inode,
+                    char *data, int size)
+{
+    if (inode->size == 0 && dev->compress) inode->type |= INODE_FLAG_COMPRESSED;
+    if (!(inode->type & INODE_FLAG_COMPRESSED))
+    {
+        if (inode->size + (size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE > MAX_DATA_BLOCKS)
+        {
+            printf("Error: The file is larger than %d bytes\n", MAX_DATA_BLOCKS * DATA_BLOCK_SIZE);
+            return -1;
+        }
+        for (int offset = 0; offset < size; offset += DATA_BLOCK_SIZE)
+        {
+            int length = size - offset < DATA_BLOCK_SIZE ? size - offset : DATA_BLOCK_SIZE;
+            if (write_datablock(dev, bitmap, inode, data + offset, length) != 1) return -1;
+            inode->length += length;
+        }
+        heartyfs_touch(dev, inode, 1);
+        return 1;
+    }
+
+    // Build the frame: header, then compressed (or raw) unit
+    char frame[sizeof(struct heartyfs_frame_header) + COMPRESS_UNIT_SIZE];
+    struct heartyfs_frame_header header;
+    header.raw_size = size;
+    header.stored_size = lz_compress((uint8_t *) data, size,
+                                        (uint8_t *) frame + sizeof(header), size - 1);
+    if (header.stored_size == 0)
+    {
+        header.stored_size = size;  // Does not shrink, store it raw
+        memcpy(frame + sizeof(header), data, size);
+    }
+    memcpy(frame, &header, sizeof(header));
+    int frame_size = sizeof(header) + header.stored_size;
+    if (inode->size + (frame_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE > MAX_DATA_BLOCKS)
+    {
+        printf("Error: The compressed file does not fit in %d data blocks\n", MAX_DATA_BLOCKS);
+        return -1;
+    }
+    dev->stats.compress_in += size;
+    dev->stats.compress_out += frame_size;
+
+    for (int offset = 0; offset < frame_size; offset += DATA_BLOCK_SIZE)
+    {
+        int length = frame_size - offset < DATA_BLOCK_SIZE ? frame_size - offset : DATA_BLOCK_SIZE;
+        if (write_datablock(dev, bitmap, inode, frame + offset, length) != 1) return -1;
+    }
+    inode->length += size;
+    heartyfs_touch(dev, inode, 1);
+    return 1;
+}
+
+/*
+ * @brief Returns the size of the frame that starts in the given data block.
+ *
+ * @param datablock     The first data block of the frame.
+ * @return int          Bytes of header and stored data, or -1 if the header is corrupt.
+ */
+int frame_size_of(struct heartyfs_data_block *datablock)
+{
+    struct heartyfs_frame_header header;
+    if (datablock->size < (int) sizeof(header)) return -1;
+    memcpy(&header, datablock->name, sizeof(header));
+    if (header.raw_size <= 0 || header.raw_size > COMPRESS_UNIT_SIZE
+            || header.stored_size <= 0 || header.stored_size > header.raw_size)
+    {
+        return -1;
+    }
+    return sizeof(header) + header.stored_size;
+}
+
+/*
+ * @brief Decodes a frame gathered from its data blocks.
+ *
+ * @param frame         The frame: header, then the stored bytes.
+ * @param out           Output buffer of COMPRESS_UNIT_SIZE bytes.
+ * @return int          Number of bytes placed in out, or -1 if the data is corrupt.
+ */
+int decode_frame(char *frame, char *out)
+{
+    struct heartyfs_frame_header header;
+    memcpy(&header, frame, sizeof(header));
+    char *stored = frame + sizeof(header);
+    if (header.stored_size == header.raw_size)
+    {
+        memcpy(out, stored, header.raw_size);
+        return header.raw_size;
+    }
+    int raw_size = lz_decompress((uint8_t *) stored, header.stored_size, (uint8_t *) out, COMPRESS_UNIT_SIZE);
+    return raw_size == header.raw_size ? raw_size : -1;
+}
+
+/*
+ * @brief Reads the next unit of a file: one data block of a plain file, or one decoded
+ *        frame of a compressed file.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode to read.
+ * @param block_index   Index into inode->data_blocks; advanced past the unit.
+ * @param out           Output buffer of COMPRESS_UNIT_SIZE bytes.
+ * @param scratch       Scratch buffer of COMPRESS_SCRATCH_SIZE bytes.
+ * @return int          Number of bytes placed in out, or -1 if the data is corrupt.
+ */
+int read_unit(struct heartyfs_dev *dev, struct heartyfs_inode *inode, int *block_index,
+                char *out, char *scratch)
+{
+    struct heartyfs_data_block *datablock = heartyfs_block(dev, inode->data_blocks[*block_index]);
+    if (datablock == NULL || datablock->size < 0 || datablock->size > DATA_BLOCK_SIZE) return -1;
+    if (!(inode->type & INODE_FLAG_COMPRESSED))
+    {
+        memcpy(out, datablock->name, datablock->size);
+        (*block_index)++;
+        return datablock->size;
+    }
+
+    // Gather the frame from consecutive data blocks
+    int frame_size = frame_size_of(datablock);
+    if (frame_size < 0) return -1;
+    int gathered = 0;
+    while (gathered < frame_size)
+    {
+        if (*block_index >= inode->size) return -1;
+        datablock = heartyfs_block(dev, inode->data_blocks[*block_index]);
+        if (datablock == NULL || datablock->size <= 0 || gathered + datablock->size > frame_size) return -1;
+        memcpy(scratch + gathered, datablock->name, datablock->size);
+        gathered += datablock->size;
+        (*block_index)++;
+    }
+    return decode_frame(scratch, out);
+}
+
+/*
+ * @brief Measures the length of a file in bytes from its data blocks. Plain files sum their
+ *        data block sizes; compressed files sum the raw sizes in their frame headers without
+ *        decoding. inode->length holds the same value; this is for checking and converting it.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode of the file.
+ * @return long         The file length, or -1 if the data is corrupt.
+ */
+long heartyfs_file_size(struct heartyfs_dev *dev, struct heartyfs_inode *inode)
+{
+    // Work on a copy, reading the data blocks may evict the inode block
+    struct heartyfs_inode copy;
+    memcpy(&copy, inode, sizeof(copy));
+    inode = &copy;
+
+    long total = 0;
+    int block_index = 0;
+    while (block_index < inode->size)
+    {
+        struct heartyfs_data_block *datablock = heartyfs_block(dev, inode->data_blocks[block_index]);
+        if (datablock == NULL || datablock->size < 0 || datablock->size > DATA_BLOCK_SIZE) return -1;
+        if (!(inode->type & INODE_FLAG_COMPRESSED))
+        {
+            total += datablock->size;
+            block_index++;
+            continue;
+        }
+
+        // Skip over the blocks of the frame
+        struct heartyfs_frame_header header;
+        memcpy(&header, datablock->name, sizeof(header));
+        int frame_size = sizeof(header) + header.stored_size;
+        int gathered = 0;
+        while (gathered < frame_size)
+        {
+            if (block_index >= inode->size) return -1;
+            datablock = heartyfs_block(dev, inode->data_blocks[block_index++]);
+            if (datablock == NULL || datablock->size <= 0) return -1;
+            gathered += datablock->size;
+        }
+        total += header.raw_size;
+    }
+    return total;
+}
@@ -0,0 +1,660 @@
+/*
+ * heartyfs_cow.c
+ *
+ * Brief
+ * - This program provides copy-on-write sharing of blocks between the live tree and
+ *   point-in-time snapshots of it. A snapshot shares every unchanged block with the
+ *   live tree; a shared directory or inode is copied the first time the live tree
+ *   modifies it. Hard links share one inode between several names of the live tree.
+ *
+ * Data Structures:
+ * - `heartyfs_ext`: Extension block referenced from the superblock. It holds the snapshot
+ *   directory and the block ids of the share count table.
+ * - Share count table: One byte per block counting the owners of that block beyond the
+ *   first. 0 means the block is owned by exactly one directory or inode.
+ * - Snapshot directory: A regular directory block whose entries point at snapshot roots.
+ *
+ * Design Decisions:
+ * - Share counts are pushed down lazily. Taking a snapshot copies the root directory and
+ *   only bumps the counts of the root's children, so it costs O(root entries), not
+ *   O(image size). Copying a shared directory or inode later bumps the counts of its
+ *   own children, one level at a time.
+ * - Mutating tools resolve their path with a bitmap, which unshares every directory on
+ *   the way down (see dir_string_check). Data blocks are never modified in place, so only
+ *   directories, inodes and xattr blocks (see heartyfs_meta.c) are ever copied. The one
+ *   exception is a data block whose count is already at MAX_SHARE_COUNT (dedup can fill
+ *   it): the new owner gets its own copy rather than wrapping the count.
+ * - The extension block and the share count table are allocated on the first snapshot,
+ *   so images without snapshots keep their original layout.
+ * - Every name of a hard-linked inode is an owner in the share count table, so removal needs
+ *   no special case. `inode->links` counts the live names on top of that, which tells a
+ *   snapshot owner apart from another link: an inode is copied only when a snapshot still
+ *   owns it, and then every live name moves to the copy together.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+#include <limits.h>
+
+/*
+ * @brief Returns the extension block, allocating it first if bitmap is given.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap used to allocate the block, or NULL to only look it up.
+ * @return struct heartyfs_ext*  The extension block, or NULL if there is none.
+ */
+struct heartyfs_ext *heartyfs_get_ext(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->ext_block > 0) return heartyfs_block(dev, superblock->ext_block);
+    if (bitmap == NULL) return NULL;
+
+    int ext_block = take_block(dev, bitmap);
+    if (ext_block < 0) return NULL;
+    struct heartyfs_ext *ext = heartyfs_block(dev, ext_block);
+    if (!heartyfs_pin(dev, ext))
+    {
+        give_block(dev, ext_block, bitmap);
+        return NULL;
+    }
+    memset(ext, 0, BLOCK_SIZE);
+    heartyfs_dirty(dev, ext);
+    superblock->ext_block = ext_block;
+    return ext;
+}
+
+/*
+ * @brief Locates the share count byte of a block.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the block.
+ * @return uint8_t*     Pointer to the count, or NULL if there is no share count table.
+ */
+static uint8_t *share_slot(struct heartyfs_dev *dev, int block_id)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL) return NULL;
+    int table_block = ext->refcount_blocks[block_id / BLOCK_SIZE];
+    if (table_block <= 0) return NULL;
+    uint8_t *table = heartyfs_block(dev, table_block);
+    return table + block_id % BLOCK_SIZE;
+}
+
+/*
+ * @brief Returns how many owners a block has beyond the first one.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the block.
+ * @return int          0 if the block is not shared.
+ */
+int share_count(struct heartyfs_dev *dev, int block_id)
+{
+    uint8_t *count = share_slot(dev, block_id);
+    return count == NULL ? 0 : *count;
+}
+
+/*
+ * @brief Adds delta to the share count of a block. Does nothing without a share count table.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the block.
+ * @param delta         +1 when an owner is added, -1 when one is dropped.
+ * @return int          1 on success, -1 if the count would pass MAX_SHARE_COUNT (left unchanged).
+ */
+int share_add(struct heartyfs_dev *dev, int block_id, int delta)
+{
+    uint8_t *count = share_slot(dev, block_id);
+    if (count == NULL) return 1;
+    if (*count + delta > MAX_SHARE_COUNT) return -1;
+    *count += delta;
+    heartyfs_dirty(dev, count);
+    return 1;
+}
+
+/*
+ * @brief Returns the i-th block owned by an inode: its data blocks, then its xattr block.
+ */
+static int *owned_block(struct heartyfs_inode *inode, int i)
+{
+    return i < inode->size ? &inode->data_blocks[i] : &inode->xattr_block;
+}
+
+/*
+ * @brief Adds an owner to every data block and the xattr block of a freshly copied inode.
+ *        A block whose count is already full is copied instead, so the new inode owns that
+ *        copy alone.
+ *
+ * @param dev           The open disk image.
+ * @param src_id        The block of the inode that was copied.
+ * @param copy_id       The block of the copy.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if there is no space (nothing is changed then).
+ */
+static int share_data_blocks(struct heartyfs_dev *dev, int src_id, int copy_id, uint8_t *bitmap)
+{
+    struct heartyfs_inode *copied_file = heartyfs_block(dev, copy_id);
+    int owned = copied_file->size + (copied_file->xattr_block > 0);
+    for (int i = 0; i < owned; i++)
+    {
+        int data_id = *owned_block(heartyfs_block(dev, copy_id), i);
+        if (share_add(dev, data_id, 1) == 1) continue;
+
+        int new_data_id = take_block(dev, bitmap);
+        if (new_data_id < 0)
+        {
+            // Undo the owners added so far, the copies differ from the source
+            for (int j = 0; j < i; j++)
+            {
+                int done_id = *owned_block(heartyfs_block(dev, copy_id), j);
+                if (done_id != *owned_block(heartyfs_block(dev, src_id), j)) give_block(dev, done_id, bitmap);
+                else share_add(dev, done_id, -1);
+            }
+            return -1;
+        }
+        uint8_t data[BLOCK_SIZE];
+        memcpy(data, heartyfs_block(dev, data_id), BLOCK_SIZE);
+        void *new_data = heartyfs_block(dev, new_data_id);
+        memcpy(new_data, data, BLOCK_SIZE);
+        heartyfs_dirty(dev, new_data);
+        copied_file = heartyfs_block(dev, copy_id);
+        *owned_block(copied_file, i) = new_data_id;
+        heartyfs_dirty(dev, copied_file);
+    }
+    return 1;
+}
+
+/*
+ * @brief Checks that every entry of a directory can take one more owner.
+ *
+ * @param dev           The open disk image.
+ * @param dir           The directory.
+ * @return int          1 if every count has room, -1 otherwise.
+ */
+static int dir_share_room(struct heartyfs_dev *dev, struct heartyfs_directory *dir)
+{
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(dir, &cursor, 0);
+    while (dir_next(dir, &cursor, &entry))
+    {
+        if (share_count(dev, entry.block_id) >= MAX_SHARE_COUNT) return -1;
+    }
+    return 1;
+}
+
+/*
+ * @brief Allocates the share count table covering every block of the image.
+ *
+ * @param dev           The open disk image.
+ * @param ext           The extension block.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if the image is too large or full.
+ */
+int create_share_table(struct heartyfs_dev *dev, struct heartyfs_ext *ext, uint8_t *bitmap)
+{
+    int table_blocks = (dev->num_blocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (table_blocks > REFCOUNT_TABLE_BLOCKS)
+    {
+        printf("Error: The image is too large for the share count table\n");
+        return -1;
+    }
+    for (int i = 0; i < table_blocks; i++)
+    {
+        if (ext->refcount_blocks[i] > 0) continue;
+        int table_block = take_block(dev, bitmap);
+        if (table_block < 0) return -1;
+        uint8_t *table = heartyfs_block(dev, table_block);
+        memset(table, 0, BLOCK_SIZE);
+        heartyfs_dirty(dev, table);
+        ext->refcount_blocks[i] = table_block;
+        heartyfs_dirty(dev, ext);
+    }
+    return 1;
+}
+
+/*
+ * @brief Finds the paths of every live name of an inode with a walk of the live tree.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the inode.
+ * @param paths         Output: room for max_paths paths of PATH_MAX bytes.
+ * @param max_paths     Number of paths that fit in paths.
+ * @return int          The number of paths found, or -1 if out of memory.
+ */
+int heartyfs_find_names(struct heartyfs_dev *dev, int block_id, char (*paths)[PATH_MAX], int max_paths)
+{
+    int capacity = DIR_MAX_ENTRIES;
+    int top = 0;
+    int *stack = malloc(capacity * sizeof(*stack));
+    char (*stack_paths)[PATH_MAX] = malloc(capacity * PATH_MAX);
+    if (stack == NULL || stack_paths == NULL)
+    {
+        free(stack);
+        free(stack_paths);
+        return -1;
+    }
+    stack[top] = 0;
+    stack_paths[top][0] = '\0';
+    top++;
+
+    int found = 0;
+    int visited = 0;
+    while (top > 0 && found < max_paths && visited++ < dev->num_blocks)
+    {
+        top--;
+        int dir_id = stack[top];
+        char dir_path[PATH_MAX];
+        snprintf(dir_path, sizeof(dir_path), "%s", stack_paths[top]);
+        struct heartyfs_directory listed;
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        memcpy(&listed, dir_id == 0 ? superblock->root_dir : heartyfs_block(dev, dir_id), sizeof(listed));
+
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(&listed, &cursor, 0);
+        while (found < max_paths && dir_next(&listed, &cursor, &entry))
+        {
+            int child_id = entry.block_id;
+            if (child_id == block_id)
+            {
+                snprintf(paths[found++], PATH_MAX, "%s/%s", dir_path, entry.file_name);
+                continue;
+            }
+            struct heartyfs_directory *child = heartyfs_block(dev, child_id);
+            if (child == NULL || child->type != 1) continue;
+            if (top == capacity)
+            {
+                int *grown = realloc(stack, 2 * capacity * sizeof(*stack));
+                char (*grown_paths)[PATH_MAX] = grown != NULL ? realloc(stack_paths, 2 * capacity * PATH_MAX) : NULL;
+                if (grown_paths == NULL)
+                {
+                    free(grown != NULL ? grown : stack);
+                    free(stack_paths);
+                    return -1;
+                }
+                stack = grown;
+                stack_paths = grown_paths;
+                capacity *= 2;
+            }
+            stack[top] = child_id;
+            snprintf(stack_paths[top], PATH_MAX, "%s/%s", dir_path, entry.file_name);
+            top++;
+        }
+    }
+    free(stack);
+    free(stack_paths);
+    return found;
+}
+
+/*
+ * @brief Gives a hard-linked inode its own copy if a snapshot still owns it, and points
+ *        every live name at the copy, so all names keep seeing the same content.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the inode.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          The block of the live inode afterwards, or -1 on failure.
+ */
+static int unshare_linked(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap)
+{
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    int names = inode->links + 1;
+    char (*paths)[PATH_MAX] = malloc(names * PATH_MAX);
+    struct heartyfs_directory **parents = malloc(names * sizeof(*parents));
+    int found = paths != NULL && parents != NULL ? heartyfs_find_names(dev, block_id, paths, names) : -1;
+
+    // Resolving each name as a writer makes every directory holding one private
+    for (int i = 0; i < found; i++)
+    {
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        char file_name[FILENAME_MAX];
+        parents[i] = superblock->root_dir;
+        if (dir_string_check(paths[i], file_name, dev, &parents[i], bitmap) != 1) found = -1;
+        else snprintf(paths[i], PATH_MAX, "%s", file_name);     // Keep only the name
+    }
+
+    int result = found < 0 ? -1 : block_id;
+    inode = heartyfs_block(dev, block_id);
+    if (found > 0 && share_count(dev, block_id) > inode->links)
+    {
+        // A snapshot owns it too: the live names move to a copy together
+        int new_block_id = take_block(dev, bitmap);
+        if (new_block_id > 0)
+        {
+            uint8_t copy[BLOCK_SIZE];
+            memcpy(copy, heartyfs_block(dev, block_id), BLOCK_SIZE);
+            struct heartyfs_inode *copied_file = heartyfs_block(dev, new_block_id);
+            memcpy(copied_file, copy, BLOCK_SIZE);
+            heartyfs_dirty(dev, copied_file);
+            if (share_data_blocks(dev, block_id, new_block_id, bitmap) != 1)
+            {
+                give_block(dev, new_block_id, bitmap);
+                new_block_id = -1;
+                found = 0;
+            }
+            for (int i = 0; i < found; i++)
+            {
+                if (dir_replace_id(parents[i], paths[i], block_id, new_block_id) == 1)
+                {
+                    heartyfs_dirty(dev, parents[i]);
+                    share_add(dev, block_id, -1);
+                    if (i > 0) share_add(dev, new_block_id, 1);
+                }
+            }
+        }
+        result = new_block_id;
+    }
+    if (result < 0) printf("Error: Can not copy the linked file\n");
+    free(paths);
+    free(parents);
+    return result;
+}
+
+/*
+ * @brief Gives the target entry of parent_dir its own copy of a shared directory or inode.
+ *        The parent must already be private to the live tree.
+ *
+ * @param dev           The open disk image.
+ * @param parent_dir    The directory holding the entry.
+ * @param target_name   The name of the entry.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          The block ID the entry points to afterwards, or -1 on failure.
+ */
+int heartyfs_unshare(struct heartyfs_dev *dev, struct heartyfs_directory *parent_dir,
+                        char *target_name, uint8_t *bitmap)
+{
+    int old_block_id = search_entry_in_dir(parent_dir, target_name);
+    if (old_block_id <= 1 || strcmp(target_name, ".") == 0 || strcmp(target_name, "..") == 0)
+    {
+        return old_block_id;
+    }
+
+    struct heartyfs_inode *old_file = heartyfs_block(dev, old_block_id);
+    if (old_file->type != 1 && old_file->links > 0) return unshare_linked(dev, old_block_id, bitmap);
+    if (share_count(dev, old_block_id) == 0) return old_block_id;
+
+    int new_block_id = take_block(dev, bitmap);
+    if (new_block_id < 0)
+    {
+        printf("Error: No space left to copy the shared entry %s\n", target_name);
+        return -1;
+    }
+    uint8_t copy[BLOCK_SIZE];
+    memcpy(copy, heartyfs_block(dev, old_block_id), BLOCK_SIZE);
+    void *new_block = heartyfs_block(dev, new_block_id);
+    memcpy(new_block, copy, BLOCK_SIZE);
+
+    // Both copies now own the children of the block
+    if (*(int *) new_block == 1)
+    {
+        struct heartyfs_directory *copied_dir = new_block;
+        if (dir_share_room(dev, copied_dir) != 1)
+        {
+            give_block(dev, new_block_id, bitmap);
+            printf("Error: The entries of %s are shared too many times\n", target_name);
+            return -1;
+        }
+        dir_set_self(copied_dir, new_block_id);
+        dir_set_parent(copied_dir, dir_self_id(parent_dir));
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(copied_dir, &cursor, 0);
+        while (dir_next(copied_dir, &cursor, &entry)) share_add(dev, entry.block_id, 1);
+    }
+    else if (share_data_blocks(dev, old_block_id, new_block_id, bitmap) != 1)
+    {
+        give_block(dev, new_block_id, bitmap);
+        printf("Error: No space left to copy the shared entry %s\n", target_name);
+        return -1;
+    }
+    new_block = heartyfs_block(dev, new_block_id);
+    heartyfs_dirty(dev, new_block);
+    share_add(dev, old_block_id, -1);
+
+    dir_replace_id(parent_dir, target_name, old_block_id, new_block_id);
+    heartyfs_dirty(dev, parent_dir);
+    return new_block_id;
+}
+
+/*
+ * @brief Drops one owner of a data block, freeing it when no owner is left.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the data block.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ */
+void heartyfs_release_data(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap)
+{
+    if (share_count(dev, block_id) > 0)
+    {
+        share_add(dev, block_id, -1);
+        return;
+    }
+    heartyfs_dedup_remove(dev, block_id);
+    give_block(dev, block_id, bitmap);
+}
+
+/*
+ * @brief Drops one owner of a directory or inode. When no owner is left, the block is
+ *        cleared and freed, and the owners of its children are dropped in turn.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the directory or inode block.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ */
+void heartyfs_release(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap)
+{
+    if (share_count(dev, block_id) > 0)
+    {
+        share_add(dev, block_id, -1);
+        return;
+    }
+
+    // Work on a copy, releasing the children may evict the block once the pins run out
+    uint8_t copy[BLOCK_SIZE];
+    memcpy(copy, heartyfs_block(dev, block_id), BLOCK_SIZE);
+    if (*(int *) copy == 1)
+    {
+        struct heartyfs_directory *target_dir = (struct heartyfs_directory *) copy;
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(target_dir, &cursor, 0);
+        while (dir_next(target_dir, &cursor, &entry)) heartyfs_release(dev, entry.block_id, bitmap);
+    }
+    else
+    {
+        struct heartyfs_inode *target_file = (struct heartyfs_inode *) copy;
+        for (int i = 0; i < target_file->size; i++)
+        {
+            heartyfs_release_data(dev, target_file->data_blocks[i], bitmap);
+        }
+        if (target_file->xattr_block > 0) heartyfs_release_data(dev, target_file->xattr_block, bitmap);
+    }
+    void *block = heartyfs_block(dev, block_id);
+    memset(block, 0, BLOCK_SIZE);
+    heartyfs_dirty(dev, block);
+    give_block(dev, block_id, bitmap);
+}
+
+/*
+ * @brief Adds a hard link: a new name in dst_parent for an existing file.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the file's inode.
+ * @param dst_parent    The directory receiving the new name, private to the live tree.
+ * @param dst_name      The new name.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 on failure.
+ */
+int heartyfs_link(struct heartyfs_dev *dev, int block_id, struct heartyfs_directory *dst_parent,
+                    char *dst_name, uint8_t *bitmap)
+{
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    if (inode == NULL || inode->type == 1)
+    {
+        printf("Error: Can not link a directory\n");
+        return -1;
+    }
+    if (strlen(dst_name) > HEARTYFS_NAME_MAX || search_entry_in_dir(dst_parent, dst_name) >= 0)
+    {
+        printf("Error: The entry %s has already existed or its name is too long\n", dst_name);
+        return -1;
+    }
+
+    // Every name is an owner in the share count table
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, bitmap);
+    if (ext == NULL || create_share_table(dev, ext, bitmap) != 1) return -1;
+    if (share_count(dev, block_id) >= MAX_SHARE_COUNT - 1)
+    {
+        printf("Error: The file has too many links\n");
+        return -1;
+    }
+
+    // The new name is charged the whole file
+    long charge = heartyfs_entry_charge(dev, block_id);
+    if (heartyfs_quota_check(dev, dir_self_id(dst_parent), charge) != 1) return -1;
+    if (create_entry(dev, dst_parent, dst_name, block_id) != 1) return -1;
+    heartyfs_charge(dev, dir_self_id(dst_parent), charge);
+    inode = heartyfs_block(dev, block_id);
+    share_add(dev, block_id, 1);
+    inode->links++;
+    heartyfs_touch(dev, inode, 0);
+    printf("Success: Linked %s to block %d\n", dst_name, block_id);
+    return 1;
+}
+
+/*
+ * @brief Drops one live name of a file or directory whose entry was just removed. The block
+ *        is freed once no name and no snapshot owns it.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the inode or directory.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ */
+void heartyfs_unlink(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap)
+{
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    if (inode->type != 1 && inode->links > 0)
+    {
+        // The other live names move to their own copy first if a snapshot still owns the
+        // inode, so the snapshot keeps its link count
+        int live_id = unshare_linked(dev, block_id, bitmap);
+        inode = heartyfs_block(dev, live_id > 0 ? live_id : block_id);
+        inode->links--;
+        heartyfs_touch(dev, inode, 0);
+    }
+    heartyfs_release(dev, block_id, bitmap);
+}
+
+/*
+ * @brief Takes a snapshot of the live tree. The snapshot root is a copy of the root
+ *        directory, every other block is shared with the live tree.
+ *
+ * @param dev               The open disk image.
+ * @param snapshot_name     The name of the snapshot.
+ * @param bitmap            The bitmap tracking the status of blocks.
+ * @return int              1 on success, -1 on failure.
+ */
+int heartyfs_snapshot_create(struct heartyfs_dev *dev, char *snapshot_name, uint8_t *bitmap)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, bitmap);
+    if (ext == NULL || !heartyfs_pin(dev, ext)) return -1;
+    if (create_share_table(dev, ext, bitmap) != 1) return -1;
+
+    // The snapshot directory is an ordinary directory listing the snapshot roots
+    if (ext->snapshot_dir <= 0)
+    {
+        int snapshot_dir_id = take_block(dev, bitmap);
+        if (snapshot_dir_id < 0) return -1;
+        struct heartyfs_directory *snapshot_dir = heartyfs_block(dev, snapshot_dir_id);
+        memset(snapshot_dir, 0, BLOCK_SIZE);
+        snapshot_dir->type = 1;
+        snprintf(snapshot_dir->name, sizeof(snapshot_dir->name), "%s", "snapshots");
+        create_entry(dev, snapshot_dir, ".", snapshot_dir_id);
+        create_entry(dev, snapshot_dir, "..", 0);
+        ext->snapshot_dir = snapshot_dir_id;
+        heartyfs_dirty(dev, ext);
+    }
+    struct heartyfs_directory *snapshot_dir = heartyfs_block(dev, ext->snapshot_dir);
+    if (!heartyfs_pin(dev, snapshot_dir)) return -1;
+    if (search_entry_in_dir(snapshot_dir, snapshot_name) >= 0)
+    {
+        printf("Error: The snapshot %s has already existed\n", snapshot_name);
+        return -1;
+    }
+    if (!dir_has_room(snapshot_dir, snapshot_name))
+    {
+        printf("Error: The snapshot directory is full\n");
+        return -1;
+    }
+
+    int snapshot_root_id = take_block(dev, bitmap);
+    if (snapshot_root_id < 0) return -1;
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    struct heartyfs_directory *snapshot_root = heartyfs_block(dev, snapshot_root_id);
+    memset(snapshot_root, 0, BLOCK_SIZE);
+    memcpy(snapshot_root, superblock->root_dir, sizeof(struct heartyfs_directory));
+    dir_set_self(snapshot_root, snapshot_root_id);
+    dir_set_parent(snapshot_root, snapshot_root_id);
+    if (dir_share_room(dev, snapshot_root) != 1)
+    {
+        give_block(dev, snapshot_root_id, bitmap);
+        printf("Error: The entries of the root directory are shared too many times\n");
+        return -1;
+    }
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(snapshot_root, &cursor, 0);
+    while (dir_next(snapshot_root, &cursor, &entry)) share_add(dev, entry.block_id, 1);
+    heartyfs_dirty(dev, snapshot_root);
+
+    if (create_entry(dev, snapshot_dir, snapshot_name, snapshot_root_id) != 1) return -1;
+    printf("Success: The snapshot %s was created at block %d\n", snapshot_name, snapshot_root_id);
+    return 1;
+}
+
+/*
+ * @brief Looks up the root directory block of a snapshot.
+ *
+ * @param dev               The open disk image.
+ * @param snapshot_name     The name of the snapshot.
+ * @return int              The block ID of the snapshot root, or -1 if there is no such snapshot.
+ */
+int heartyfs_snapshot_root(struct heartyfs_dev *dev, char *snapshot_name)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->snapshot_dir <= 0) return -1;
+    struct heartyfs_directory *snapshot_dir = heartyfs_block(dev, ext->snapshot_dir);
+    if (strcmp(snapshot_name, ".") == 0 || strcmp(snapshot_name, "..") == 0) return -1;
+    return search_entry_in_dir(snapshot_dir, snapshot_name);
+}
+
+/*
+ * @brief Deletes a snapshot, freeing every block no longer owned by another tree.
+ *
+ * @param dev               The open disk image.
+ * @param snapshot_name     The name of the snapshot.
+ * @param bitmap            The bitmap tracking the status of blocks.
+ * @return int              1 on success, -1 if there is no such snapshot.
+ */
+int heartyfs_snapshot_delete(struct heartyfs_dev *dev, char *snapshot_name, uint8_t *bitmap)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->snapshot_dir <= 0)
+    {
+        printf("Error: Can not find the snapshot %s\n", snapshot_name);
+        return -1;
+    }
+    struct heartyfs_directory *snapshot_dir = heartyfs_block(dev, ext->snapshot_dir);
+    if (!heartyfs_pin(dev, snapshot_dir)) return -1;
+    int snapshot_root_id = search_entry_in_dir(snapshot_dir, snapshot_name);
+    if (snapshot_root_id <= 0 || remove_entry(NULL, dev, ext->snapshot_dir, snapshot_name) != 1)
+    {
+        printf("Error: Can not find the snapshot %s\n", snapshot_name);
+        return -1;
+    }
+    heartyfs_release(dev, snapshot_root_id, bitmap);
+    printf("Success: The snapshot %s was deleted\n", snapshot_name);
+    return 1;
+}
@@ -0,0 +1,263 @@
+/*
+ * heartyfs_dedup.c
+ *
+ * Brief
+ * - This program provides inline deduplication of file data. Before a new data block is
+ *   allocated, its content is hashed and looked up in an on-image index; if a block with
+ *   the same content already exists, the inode shares that block instead.
+ *
+ * Data Structures:
+ * - Hash index: DEDUP_INDEX_BLOCKS bucket blocks referenced from the extension block.
+ *   Each bucket holds `heartyfs_dedup_entry` records of (hash tag, block id).
+ * - Shared data blocks are reference counted with the same share count table used by
+ *   copy-on-write snapshots, so freeing and snapshots need no special cases.
+ *
+ * Design Decisions:
+ * - Blocks are hashed with XXH64, a fast non-cryptographic hash. A hash match is always
+ *   confirmed with a full compare of the 512 bytes, so collisions never share data.
+ * - The index is a best-effort cache: a full bucket overwrites an older entry, and an entry
+ *   is removed when its block is freed, so it never points at a reused block.
+ * - Dedup is enabled per process with HEARTYFS_DEDUP=1; the index is still kept up to date
+ *   on free by every tool once it exists.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= hash_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/*
+ * @brief Hashes a buffer with XXH64. The four independent lanes of the main loop let the
+ *        compiler keep the whole 32-byte stripe in flight.
+ *
+ * @param data          The bytes to hash.
+ * @param length        Number of bytes.
+ * @param seed          Hash seed.
+ * @return uint64_t     The 64-bit hash.
+ */
+uint64_t heartyfs_hash(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + length;
+    uint64_t h64;
+
+    if (length >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do
+        {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+        h64 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h64 = hash_merge(h64, v1);
+        h64 = hash_merge(h64, v2);
+        h64 = hash_merge(h64, v3);
+        h64 = hash_merge(h64, v4);
+    }
+    else h64 = seed + PRIME64_5;
+    h64 += (uint64_t) length;
+
+    while (p + 8 <= end)
+    {
+        h64 ^= hash_round(0, read64(p));
+        h64 = rotl64(h64, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h64 ^= (uint64_t) read32(p) * PRIME64_1;
+        h64 = rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h64 ^= (*p) * PRIME64_5;
+        h64 = rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    // Final avalanche
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+/*
+ * @brief Returns the index bucket a content hash falls into.
+ *
+ * @param dev           The open disk image.
+ * @param hash          The content hash.
+ * @return struct heartyfs_dedup_entry*  The bucket entries, pinned until the caller unpins
+ *                                      them, or NULL if there is no index or no pin left.
+ */
+static struct heartyfs_dedup_entry *find_bucket(struct heartyfs_dev *dev, uint64_t hash)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL) return NULL;
+    int bucket_block = ext->dedup_blocks[hash % DEDUP_INDEX_BLOCKS];
+    if (bucket_block <= 0) return NULL;
+    struct heartyfs_dedup_entry *bucket = heartyfs_block(dev, bucket_block);
+    if (!heartyfs_pin(dev, bucket)) return NULL;    // Stays valid while candidate blocks are compared
+    return bucket;
+}
+
+/*
+ * @brief Allocates the hash index buckets and the share count table.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if the disk is full.
+ */
+static int create_index(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, bitmap);
+    if (ext == NULL || !heartyfs_pin(dev, ext)) return -1;
+    if (create_share_table(dev, ext, bitmap) != 1) return -1;
+    for (int i = 0; i < DEDUP_INDEX_BLOCKS; i++)
+    {
+        if (ext->dedup_blocks[i] > 0) continue;
+        int bucket_block = take_block(dev, bitmap);
+        if (bucket_block < 0) return -1;
+        void *bucket = heartyfs_block(dev, bucket_block);
+        memset(bucket, 0, BLOCK_SIZE);
+        heartyfs_dirty(dev, bucket);
+        ext->dedup_blocks[i] = bucket_block;
+        heartyfs_dirty(dev, ext);
+    }
+    return 1;
+}
+
+/*
+ * @brief Looks for an existing data block with exactly the given content.
+ *
+ * @param dev           The open disk image.
+ * @param content       The full content of the block about to be written.
+ * @return int          The ID of a block that can be shared, or -1 if there is none.
+ */
+int heartyfs_dedup_lookup(struct heartyfs_dev *dev, struct heartyfs_data_block *content)
+{
+    uint64_t hash = heartyfs_hash(content, BLOCK_SIZE, 0);
+    struct heartyfs_dedup_entry *bucket = find_bucket(dev, hash);
+    if (bucket == NULL) return -1;
+
+    uint32_t tag = (uint32_t) (hash >> 32);
+    int found = -1;
+    for (size_t i = 0; i < DEDUP_ENTRIES_PER_BLOCK && found < 0; i++)
+    {
+        if (bucket[i].block_id <= 0 || bucket[i].tag != tag) continue;
+        int block_id = bucket[i].block_id;
+        if (share_count(dev, block_id) >= MAX_SHARE_COUNT) continue;
+        if (memcmp(heartyfs_block(dev, block_id), content, BLOCK_SIZE) == 0) found = block_id;
+    }
+    heartyfs_unpin(dev, bucket);
+    return found;
+}
+
+/*
+ * @brief Records a newly written data block in the hash index.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the data block.
+ * @param content       The content of the data block.
+ * @param bitmap        The bitmap tracking the status of blocks, used to create the index.
+ */
+void heartyfs_dedup_insert(struct heartyfs_dev *dev, int block_id,
+                            struct heartyfs_data_block *content, uint8_t *bitmap)
+{
+    uint64_t hash = heartyfs_hash(content, BLOCK_SIZE, 0);
+    struct heartyfs_dedup_entry *bucket = find_bucket(dev, hash);
+    if (bucket == NULL)
+    {
+        if (create_index(dev, bitmap) != 1) return;
+        bucket = find_bucket(dev, hash);
+        if (bucket == NULL) return;
+    }
+
+    // Take an empty entry, or overwrite one picked by the hash when the bucket is full
+    size_t slot = (hash >> 8) % DEDUP_ENTRIES_PER_BLOCK;
+    for (size_t i = 0; i < DEDUP_ENTRIES_PER_BLOCK; i++)
+    {
+        if (bucket[i].block_id <= 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    bucket[slot].tag = (uint32_t) (hash >> 32);
+    bucket[slot].block_id = block_id;
+    heartyfs_dirty(dev, bucket);
+    heartyfs_unpin(dev, bucket);
+}
+
+/*
+ * @brief Drops the index entry of a data block that is about to be freed.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the data block.
+ */
+void heartyfs_dedup_remove(struct heartyfs_dev *dev, int block_id)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->dedup_blocks[0] <= 0) return;
+
+    uint64_t hash = heartyfs_hash(heartyfs_block(dev, block_id), BLOCK_SIZE, 0);
+    struct heartyfs_dedup_entry *bucket = find_bucket(dev, hash);
+    if (bucket == NULL) return;
+    for (size_t i = 0; i < DEDUP_ENTRIES_PER_BLOCK; i++)
+    {
+        if (bucket[i].block_id == block_id)
+        {
+            bucket[i].block_id = 0;
+            bucket[i].tag = 0;
+            heartyfs_dirty(dev, bucket);
+        }
+    }
+    heartyfs_unpin(dev, bucket);
+}
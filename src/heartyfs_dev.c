@@ -0,0 +1,947 @@
+/*
+ * heartyfs_dev.c
+ *
+ * Brief
+ * - This program provides the block-device layer that sits under every heartyfs tool.
+ *   Callers ask for a block by id and receive a pointer to its 512 bytes, no matter
+ *   which backend actually holds the image.
+ *
+ * Data Structures:
+ * - `heartyfs_dev`: The open image, its backend, and the backend private state.
+ * - Block cache: A fixed array of BLOCK_SIZE slots with an index from block id to slot,
+ *   used by the pread backend in place of the page cache. Each slot carries a CLOCK
+ *   reference bit, a dirty flag and a pin flag.
+ *
+ * Design Decisions:
+ * - The mmap backend keeps the original behaviour: one shared mapping of the whole image,
+ *   synced with `msync` on close.
+ * - The pread backend never maps the image. Blocks 0 and 1 (superblock and bitmap) stay
+ *   resident for the lifetime of the device, every other block goes through the cache.
+ * - The image is split into block groups of BLOCK_GROUP_SIZE blocks, the blocks one bitmap
+ *   block covers. The bitmap of the first group is block 1, the bitmap of every other group
+ *   is its first block. All bitmaps are kept resident one after the other, so callers index
+ *   one bitmap with any block id. The mmap backend keeps them in the mapping while there is
+ *   one group and copies them otherwise; either way they are written back on every flush.
+ * - The device covers total_blocks of the superblock. A larger image file is taken over by
+ *   heartyfs_grow, and heartyfs_dev_remap resizes the device to match.
+ * - Data blocks are evicted with CLOCK (second chance). The directory a path resolves to,
+ *   and blocks an operation holds on to, are pinned and never evicted; at most half of the
+ *   cache can be pinned so data blocks always have room. A pin over that budget fails and
+ *   the operation stops instead of holding a block that may be evicted under it.
+ * - Misses for a list of blocks are batched into `preadv` calls over contiguous runs. When a
+ *   dirty block has to be evicted, every unpinned dirty block is written back at once in block
+ *   order with `pwritev` over contiguous runs, instead of one random write per eviction.
+ * - The image is locked with `flock` while a device is open, so tools started together take
+ *   turns. A long-running tool can drop the lock between steps with heartyfs_dev_unlock and
+ *   take it back with heartyfs_dev_lock, which forgets every cached block another process may
+ *   have rewritten in between.
+ * - Blocks read from the image are checked against the checksum table when the image has one,
+ *   and blocks written back get a new checksum (see heartyfs_checksum.c).
+ * - Operations end with heartyfs_dev_commit, which applies the durability mode chosen with
+ *   HEARTYFS_DURABILITY: "sync" (the default) flushes after every operation, "group" flushes
+ *   once HEARTYFS_GROUP_OPS operations are waiting or the oldest of them waited
+ *   HEARTYFS_GROUP_MS milliseconds, and "async" leaves the writing to the kernel. An explicit
+ *   heartyfs_dev_flush is always durable, and closing the device flushes in every mode but
+ *   async. Operations that order their own steps, such as rename, call heartyfs_dev_barrier
+ *   between them, which flushes only in sync mode: group and async already accept losing
+ *   recent operations in a crash. Every msync and fsync is timed into a log2 histogram of
+ *   microseconds.
+ * - The backend is chosen with the HEARTYFS_BACKEND environment variable ("mmap" or "pread"),
+ *   the cache size with HEARTYFS_CACHE_BLOCKS, and HEARTYFS_STATS=1 prints the cache counters
+ *   when the device is closed.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+/*
+ * @brief Returns the cache slot data of the given slot index.
+ */
+static uint8_t *slot_data(struct heartyfs_dev *dev, int slot)
+{
+    return dev->slot_data + (size_t) slot * BLOCK_SIZE;
+}
+
+/*
+ * @brief Writes a run of cache slots back to the image with a single `pwritev`.
+ *
+ * @param dev           The open device.
+ * @param slots         Slot indexes holding consecutive block ids.
+ * @param count         Number of slots in the run.
+ * @return int          0 on success, -1 on I/O error.
+ */
+static int write_run(struct heartyfs_dev *dev, int *slots, int count)
+{
+    struct iovec iov[HEARTYFS_IO_BATCH];
+    for (int i = 0; i < count; i++)
+    {
+        iov[i].iov_base = slot_data(dev, slots[i]);
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    off_t offset = (off_t) dev->slots[slots[0]].block_id * BLOCK_SIZE;
+    if (dev->checksums != NULL)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            heartyfs_checksum_update(dev, dev->slots[slots[i]].block_id, slot_data(dev, slots[i]));
+        }
+    }
+    if (pwritev(dev->fd, iov, count, offset) != (ssize_t) count * BLOCK_SIZE)
+    {
+        perror("Cannot write blocks back to the disk file\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) dev->slots[slots[i]].dirty = 0;
+    dev->stats.writebacks += count;
+    dev->stats.write_batches++;
+    return 0;
+}
+
+/*
+ * @brief Compares two block ids for qsort.
+ */
+static int compare_block_id(const void *a, const void *b)
+{
+    return *(int *) a - *(int *) b;
+}
+
+/*
+ * @brief Writes dirty cache slots back in block order, coalescing contiguous runs.
+ *
+ * @param dev           The open device.
+ * @param with_pinned   1 to also write back pinned slots, 0 to leave them dirty.
+ * @return int          0 on success, -1 on I/O error.
+ */
+static int write_back(struct heartyfs_dev *dev, int with_pinned)
+{
+    // Collect the dirty slots in block order so runs can be coalesced
+    int *dirty = dev->dirty_ids;
+    int count = 0;
+    for (int i = 0; i < dev->cache_blocks; i++)
+    {
+        struct heartyfs_cache_slot *slot = &dev->slots[i];
+        if (slot->block_id >= 0 && slot->dirty && (with_pinned || !slot->pinned))
+        {
+            dirty[count++] = slot->block_id;
+        }
+    }
+    qsort(dirty, count, sizeof(int), compare_block_id);
+    for (int i = 0; i < count; i++) dirty[i] = dev->index[dirty[i]];
+
+    int status = 0;
+    int start = 0;
+    while (start < count)
+    {
+        int run = 1;
+        while (start + run < count && run < HEARTYFS_IO_BATCH
+                && dev->slots[dirty[start + run]].block_id
+                    == dev->slots[dirty[start]].block_id + run)
+        {
+            run++;
+        }
+        if (write_run(dev, &dirty[start], run) < 0) status = -1;
+        start += run;
+    }
+    return status;
+}
+
+/*
+ * @brief Picks a cache slot for a new block with CLOCK, skipping pinned slots.
+ *        A dirty victim triggers a batched write-back of all unpinned dirty slots.
+ *
+ * @param dev           The open device.
+ * @return int          The slot index now free to be filled.
+ */
+static int evict_slot(struct heartyfs_dev *dev)
+{
+    int slot;
+    while (1)
+    {
+        slot = dev->hand;
+        dev->hand = (dev->hand + 1) % dev->cache_blocks;
+        struct heartyfs_cache_slot *candidate = &dev->slots[slot];
+        if (candidate->pinned) continue;
+        if (candidate->referenced)
+        {
+            candidate->referenced = 0;  // Second chance
+            continue;
+        }
+        break;
+    }
+
+    struct heartyfs_cache_slot *victim = &dev->slots[slot];
+    if (victim->block_id >= 0)
+    {
+        if (victim->dirty) write_back(dev, 0);
+        dev->index[victim->block_id] = -1;
+        victim->block_id = -1;
+        dev->stats.evictions++;
+    }
+    return slot;
+}
+
+/*
+ * @brief Fills a cache slot's bookkeeping after its data was read from the image.
+ */
+static void install_slot(struct heartyfs_dev *dev, int slot, int block_id)
+{
+    dev->slots[slot].block_id = block_id;
+    dev->slots[slot].dirty = 0;
+    dev->slots[slot].referenced = 1;
+    dev->slots[slot].pinned = 0;
+    dev->index[block_id] = slot;
+}
+
+/*
+ * @brief Frees the backend resources and closes the image without writing anything back.
+ *
+ * @param dev           The device to release.
+ */
+static void release_dev(struct heartyfs_dev *dev)
+{
+    heartyfs_checksum_release(dev);
+    heartyfs_charge_clear(dev);
+    if (dev->backend == HEARTYFS_BACKEND_MMAP && dev->block_groups > 1) free(dev->bitmap);
+    dev->bitmap = NULL;
+    free(dev->meta);
+    free(dev->slot_data);
+    free(dev->slots);
+    free(dev->index);
+    free(dev->dirty_ids);
+    dev->dirty_ids = NULL;
+    dev->map = NULL;
+    dev->meta = NULL;
+    dev->slot_data = NULL;
+    dev->slots = NULL;
+    dev->index = NULL;
+    if (dev->fd >= 0)
+    {
+        close(dev->fd);                     // Close the file descriptor
+        dev->fd = -1;
+    }
+}
+
+/*
+ * @brief Returns the block holding the bitmap of a block group.
+ *
+ * @param group         The index of the group.
+ * @return int          Block 1 for the first group, the first block of the group otherwise.
+ */
+int heartyfs_bitmap_block(int group)
+{
+    return group == 0 ? 1 : group * BLOCK_GROUP_SIZE;
+}
+
+/*
+ * @brief Returns the resident bitmap held by a block, or NULL if it holds none.
+ */
+static uint8_t *resident_bitmap(struct heartyfs_dev *dev, int block_id)
+{
+    if (block_id == 1) return dev->bitmap;
+    if (block_id == 0 || block_id % BLOCK_GROUP_SIZE != 0) return NULL;
+    return dev->bitmap + (size_t) (block_id / BLOCK_GROUP_SIZE) * BLOCK_SIZE;
+}
+
+/*
+ * @brief Reads the bitmaps of the block groups from first_group on into the resident bitmaps.
+ *
+ * @param dev           The open device.
+ * @param first_group   The first group to read.
+ * @return int          0 on success, -1 on I/O error.
+ */
+static int load_bitmaps(struct heartyfs_dev *dev, int first_group)
+{
+    for (int group = first_group; group < dev->block_groups; group++)
+    {
+        uint8_t *bitmap = dev->bitmap + (size_t) group * BLOCK_SIZE;
+        off_t offset = (off_t) heartyfs_bitmap_block(group) * BLOCK_SIZE;
+        if (dev->backend == HEARTYFS_BACKEND_MMAP) memcpy(bitmap, (uint8_t *) dev->map + offset, BLOCK_SIZE);
+        else if (pread(dev->fd, bitmap, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        {
+            perror("Cannot read the bitmap of a block group\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief Writes the resident bitmaps back to their blocks. The pread backend writes the
+ *        first one together with the superblock, and so does the mmap backend with one group.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 on I/O error.
+ */
+static int store_bitmaps(struct heartyfs_dev *dev)
+{
+    if (dev->backend == HEARTYFS_BACKEND_MMAP && dev->block_groups == 1) return 0;
+    int status = 0;
+    for (int group = dev->backend == HEARTYFS_BACKEND_MMAP ? 0 : 1; group < dev->block_groups; group++)
+    {
+        uint8_t *bitmap = dev->bitmap + (size_t) group * BLOCK_SIZE;
+        off_t offset = (off_t) heartyfs_bitmap_block(group) * BLOCK_SIZE;
+        if (dev->backend == HEARTYFS_BACKEND_MMAP) memcpy((uint8_t *) dev->map + offset, bitmap, BLOCK_SIZE);
+        else if (pwrite(dev->fd, bitmap, BLOCK_SIZE, offset) != BLOCK_SIZE) status = -1;
+    }
+    return status;
+}
+
+/*
+ * @brief Resizes the device to the first num_blocks blocks of the image file: the mmap
+ *        backend maps them again, the pread backend grows its block index, and the resident
+ *        bitmaps gain one block per new block group, read from the image. No block pointer
+ *        of the device may be used across this call.
+ *
+ * @param dev           The open device.
+ * @param num_blocks    The new number of blocks, at least the current one.
+ * @return int          0 on success, -1 on failure, the device then keeps its old size.
+ */
+int heartyfs_dev_remap(struct heartyfs_dev *dev, int num_blocks)
+{
+    if (num_blocks < dev->num_blocks || num_blocks > HEARTYFS_MAX_BLOCKS) return -1;
+    if (num_blocks == dev->num_blocks) return 0;
+    int old_blocks = dev->num_blocks;
+    int old_groups = dev->block_groups;
+    int groups = (num_blocks + BLOCK_GROUP_SIZE - 1) / BLOCK_GROUP_SIZE;
+    size_t size = (size_t) num_blocks * BLOCK_SIZE;
+
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, dev->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        uint8_t *bitmap = groups == 1 ? (uint8_t *) map + BLOCK_SIZE
+                        : old_groups == 1 ? malloc((size_t) groups * BLOCK_SIZE)
+                        : realloc(dev->bitmap, (size_t) groups * BLOCK_SIZE);
+        if (bitmap == NULL)
+        {
+            munmap(map, size);
+            return -1;
+        }
+        munmap(dev->map, dev->size);
+        dev->map = map;
+        dev->bitmap = bitmap;
+        if (groups > 1 && old_groups == 1) old_groups = 0;  // The first bitmap is copied too
+    }
+    else
+    {
+        int *index = realloc(dev->index, num_blocks * sizeof(int));
+        if (index != NULL) dev->index = index;
+        uint8_t *meta = index != NULL ? realloc(dev->meta, (size_t) (groups + 1) * BLOCK_SIZE) : NULL;
+        if (meta == NULL) return -1;
+        for (int i = old_blocks; i < num_blocks; i++) dev->index[i] = -1;
+        dev->meta = meta;
+        dev->bitmap = meta + BLOCK_SIZE;
+    }
+
+    if (dev->checksums != NULL)
+    {
+        uint32_t *checksums = realloc(dev->checksums, num_blocks * sizeof(uint32_t));
+        if (checksums != NULL) dev->checksums = checksums;
+        uint8_t *block_state = realloc(dev->block_state, num_blocks);
+        if (block_state != NULL) dev->block_state = block_state;
+        if (checksums == NULL || block_state == NULL) heartyfs_checksum_release(dev);
+        else
+        {
+            memset(checksums + old_blocks, 0, (num_blocks - old_blocks) * sizeof(uint32_t));
+            memset(block_state + old_blocks, 0, num_blocks - old_blocks);
+        }
+    }
+
+    dev->num_blocks = num_blocks;
+    dev->size = size;
+    dev->block_groups = groups;
+    return load_bitmaps(dev, old_groups);
+}
+
+/*
+ * @brief Opens the disk image with the backend selected by HEARTYFS_BACKEND.
+ *
+ * @param dev           The device structure to fill in.
+ * @param path          Path of the disk image.
+ * @return int          0 on success, -1 if the image cannot be opened or mapped.
+ */
+int heartyfs_dev_open(struct heartyfs_dev *dev, const char *path)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0)
+    {
+        perror("Cannot open the disk file\n");
+        return -1;
+    }
+    if (flock(dev->fd, LOCK_EX) < 0)
+    {
+        perror("Cannot lock the disk file\n");
+        close(dev->fd);
+        return -1;
+    }
+
+    struct stat st;
+    struct heartyfs_superblock head;
+    if (fstat(dev->fd, &st) < 0 || st.st_size < 2 * BLOCK_SIZE
+            || pread(dev->fd, &head, sizeof(head), 0) != sizeof(head))
+    {
+        printf("Error: The disk file is too small\n");
+        close(dev->fd);
+        return -1;
+    }
+
+    // Cover the blocks of the file system; a fresh image covers the whole file
+    long file_blocks = st.st_size / BLOCK_SIZE;
+    dev->num_blocks = file_blocks < HEARTYFS_MAX_BLOCKS ? file_blocks : HEARTYFS_MAX_BLOCKS;
+    if (head.root_dir->name[0] != '\0' && head.total_blocks >= 2 && head.total_blocks < dev->num_blocks)
+    {
+        dev->num_blocks = head.total_blocks;
+    }
+    dev->size = (size_t) dev->num_blocks * BLOCK_SIZE;
+    dev->block_groups = (dev->num_blocks + BLOCK_GROUP_SIZE - 1) / BLOCK_GROUP_SIZE;
+
+    char *dedup = getenv("HEARTYFS_DEDUP");
+    dev->dedup = dedup != NULL && strcmp(dedup, "1") == 0;
+    char *compress = getenv("HEARTYFS_COMPRESS");
+    dev->compress = compress != NULL && strcmp(compress, "1") == 0;
+
+    dev->group_ms = HEARTYFS_GROUP_MS;
+    dev->group_ops = HEARTYFS_GROUP_OPS;
+    char *durability = getenv("HEARTYFS_DURABILITY");
+    if (durability != NULL && heartyfs_dev_set_durability(dev, durability) < 0)
+    {
+        printf("Error: Unknown durability mode %s, using sync\n", durability);
+    }
+    char *group_ms = getenv("HEARTYFS_GROUP_MS");
+    if (group_ms != NULL && atoi(group_ms) > 0) dev->group_ms = atoi(group_ms);
+    char *group_ops = getenv("HEARTYFS_GROUP_OPS");
+    if (group_ops != NULL && atoi(group_ops) > 0) dev->group_ops = atoi(group_ops);
+
+    char *backend = getenv("HEARTYFS_BACKEND");
+    if (backend != NULL && strcmp(backend, "pread") == 0)
+    {
+        dev->backend = HEARTYFS_BACKEND_PREAD;
+        dev->cache_blocks = HEARTYFS_CACHE_BLOCKS;
+        char *cache_blocks = getenv("HEARTYFS_CACHE_BLOCKS");
+        if (cache_blocks != NULL && atoi(cache_blocks) >= 2 * HEARTYFS_IO_BATCH)
+        {
+            dev->cache_blocks = atoi(cache_blocks);
+        }
+        dev->meta = malloc((size_t) (dev->block_groups + 1) * BLOCK_SIZE);
+        dev->slot_data = malloc((size_t) dev->cache_blocks * BLOCK_SIZE);
+        dev->slots = calloc(dev->cache_blocks, sizeof(struct heartyfs_cache_slot));
+        dev->dirty_ids = malloc(dev->cache_blocks * sizeof(int));
+        dev->index = malloc(dev->num_blocks * sizeof(int));
+        if (dev->meta == NULL || dev->slot_data == NULL || dev->slots == NULL
+                || dev->dirty_ids == NULL || dev->index == NULL)
+        {
+            printf("Error: Cannot allocate the block cache\n");
+            release_dev(dev);
+            return -1;
+        }
+        for (int i = 0; i < dev->cache_blocks; i++) dev->slots[i].block_id = -1;
+        for (int i = 0; i < dev->num_blocks; i++) dev->index[i] = -1;
+
+        // Superblock and bitmaps stay resident
+        dev->bitmap = dev->meta + BLOCK_SIZE;
+        if (pread(dev->fd, dev->meta, 2 * BLOCK_SIZE, 0) != 2 * BLOCK_SIZE)
+        {
+            perror("Cannot read the superblock and bitmap\n");
+            release_dev(dev);
+            return -1;
+        }
+        if (load_bitmaps(dev, 1) < 0)
+        {
+            release_dev(dev);
+            return -1;
+        }
+    }
+    else
+    {
+        dev->backend = HEARTYFS_BACKEND_MMAP;
+        dev->map = mmap(NULL, dev->size, PROT_READ|PROT_WRITE, MAP_SHARED, dev->fd, 0);
+        if (dev->map == MAP_FAILED)
+        {
+            perror("Cannot map the disk file onto memory\n");
+            dev->map = NULL;
+            close(dev->fd);
+            return -1;
+        }
+
+        // One bitmap is used in place, more are copied so they sit one after the other
+        dev->bitmap = dev->block_groups == 1 ? (uint8_t *) dev->map + BLOCK_SIZE
+                                             : malloc((size_t) dev->block_groups * BLOCK_SIZE);
+        if (dev->bitmap == NULL)
+        {
+            printf("Error: Cannot allocate the bitmaps\n");
+            munmap(dev->map, dev->size);
+            release_dev(dev);
+            return -1;
+        }
+        if (dev->block_groups > 1) load_bitmaps(dev, 0);
+    }
+
+    // Load the checksum table, or add one when asked to
+    char *checksum = getenv("HEARTYFS_CHECKSUM");
+    dev->checksum = checksum != NULL && strcmp(checksum, "1") == 0;
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (heartyfs_checksum_load(dev) == 0 && dev->checksum && superblock->root_dir->name[0] != '\0')
+    {
+        heartyfs_checksum_create(dev, heartyfs_block(dev, 1));
+    }
+
+    // Images with fixed directory entries are converted once
+    if (heartyfs_dir_upgrade(dev) < 0)
+    {
+        printf("Error: Cannot convert the directories of the image\n");
+        heartyfs_dev_close(dev);
+        return -1;
+    }
+
+    // Images without inode metadata are converted once
+    if (heartyfs_inode_upgrade(dev) < 0)
+    {
+        printf("Error: Cannot convert the inodes of the image\n");
+        heartyfs_dev_close(dev);
+        return -1;
+    }
+
+    // Images without directory usage are counted once
+    if (heartyfs_usage_upgrade(dev) < 0)
+    {
+        printf("Error: Cannot count the directory usage of the image\n");
+        heartyfs_dev_close(dev);
+        return -1;
+    }
+
+    // An image file grown by heartyfs_resize is taken over
+    if (heartyfs_grow(dev) < 0)
+    {
+        printf("Error: Cannot add the new blocks of the image file\n");
+        heartyfs_dev_close(dev);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief Returns a pointer to the content of the given block.
+ *
+ * @param dev           The open device.
+ * @param block_id      The ID of the block to access.
+ * @return void*        Pointer to BLOCK_SIZE bytes, or NULL if the block cannot be read.
+ */
+void *heartyfs_block(struct heartyfs_dev *dev, int block_id)
+{
+    if (block_id < 0 || block_id >= dev->num_blocks) return NULL;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        uint8_t *bitmap = dev->block_groups > 1 ? resident_bitmap(dev, block_id) : NULL;
+        if (bitmap != NULL) return bitmap;
+        void *block = (uint8_t *) dev->map + (size_t) block_id * BLOCK_SIZE;
+        if (dev->checksums != NULL && !(dev->block_state[block_id] & CHECKSUM_VERIFIED))
+        {
+            heartyfs_checksum_verify(dev, block_id, block);
+        }
+        return block;
+    }
+    if (block_id < 2 || block_id % BLOCK_GROUP_SIZE == 0)
+    {
+        dev->stats.hits++;
+        return block_id == 0 ? dev->meta : resident_bitmap(dev, block_id);
+    }
+
+    int slot = dev->index[block_id];
+    if (slot >= 0)
+    {
+        dev->stats.hits++;
+        dev->slots[slot].referenced = 1;
+        return slot_data(dev, slot);
+    }
+
+    dev->stats.misses++;
+    slot = evict_slot(dev);
+    if (pread(dev->fd, slot_data(dev, slot), BLOCK_SIZE, (off_t) block_id * BLOCK_SIZE) != BLOCK_SIZE)
+    {
+        perror("Cannot read a block from the disk file\n");
+        return NULL;
+    }
+    install_slot(dev, slot, block_id);
+    if (dev->checksums != NULL) heartyfs_checksum_verify(dev, block_id, slot_data(dev, slot));
+    return slot_data(dev, slot);
+}
+
+/*
+ * @brief Marks the block that contains the given pointer as modified.
+ *
+ * @param dev           The open device.
+ * @param ptr           Any pointer returned by heartyfs_block() (or inside that block).
+ */
+void heartyfs_dirty(struct heartyfs_dev *dev, void *ptr)
+{
+    uint8_t *p = (uint8_t *) ptr;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        // The mapping writes itself back; only the checksum has to follow
+        uint8_t *map = dev->map;
+        if (dev->checksums != NULL && p >= map && p < map + dev->size)
+        {
+            dev->block_state[(p - map) / BLOCK_SIZE] |= CHECKSUM_STALE;
+        }
+        return;
+    }
+    uint8_t *base = dev->slot_data;
+    if (p >= base && p < base + (size_t) dev->cache_blocks * BLOCK_SIZE)
+    {
+        dev->slots[(p - base) / BLOCK_SIZE].dirty = 1;
+    }
+    // Pointers into the resident superblock/bitmaps are always written back
+}
+
+/*
+ * @brief Pins the block that contains the given pointer so it is never evicted.
+ *        Used for hot directory blocks and for blocks held across an operation. A block
+ *        can be pinned by several holders; it stays pinned until each of them unpins it.
+ *
+ * @param dev           The open device.
+ * @param ptr           Any pointer returned by heartyfs_block() (or inside that block).
+ * @return int          1 if the block is pinned (or always resident), 0 if the pin budget is
+ *                      used up. The pointer must not be kept after a 0.
+ */
+int heartyfs_pin(struct heartyfs_dev *dev, void *ptr)
+{
+    if (dev->backend == HEARTYFS_BACKEND_MMAP) return 1;
+    uint8_t *p = (uint8_t *) ptr;
+    uint8_t *base = dev->slot_data;
+    if (p < base || p >= base + (size_t) dev->cache_blocks * BLOCK_SIZE) return 1;
+
+    struct heartyfs_cache_slot *slot = &dev->slots[(p - base) / BLOCK_SIZE];
+    if (slot->pinned == UINT8_MAX || (slot->pinned == 0 && dev->stats.pinned >= dev->cache_blocks / 2))
+    {
+        printf("Error: The block cache is too small for this operation, raise HEARTYFS_CACHE_BLOCKS\n");
+        return 0;
+    }
+    if (slot->pinned++ == 0) dev->stats.pinned++;
+    return 1;
+}
+
+/*
+ * @brief Gives up one pin taken with heartyfs_pin. The block can be evicted again once
+ *        every holder has unpinned it.
+ *
+ * @param dev           The open device.
+ * @param ptr           The pointer that was pinned.
+ */
+void heartyfs_unpin(struct heartyfs_dev *dev, void *ptr)
+{
+    if (dev->backend == HEARTYFS_BACKEND_MMAP) return;
+    uint8_t *p = (uint8_t *) ptr;
+    uint8_t *base = dev->slot_data;
+    if (p < base || p >= base + (size_t) dev->cache_blocks * BLOCK_SIZE) return;
+
+    struct heartyfs_cache_slot *slot = &dev->slots[(p - base) / BLOCK_SIZE];
+    if (slot->pinned > 0 && --slot->pinned == 0) dev->stats.pinned--;
+}
+
+/*
+ * @brief Drops every pin. Pins last for one operation; a long-running frontend calls this
+ *        when an operation completes so the pin budget is never used up.
+ *
+ * @param dev           The open device.
+ */
+void heartyfs_unpin_all(struct heartyfs_dev *dev)
+{
+    if (dev->backend == HEARTYFS_BACKEND_MMAP) return;
+    for (int i = 0; i < dev->cache_blocks; i++) dev->slots[i].pinned = 0;
+    dev->stats.pinned = 0;
+}
+
+/*
+ * @brief Loads a list of blocks into the cache, batching misses on contiguous ids.
+ *
+ * @param dev           The open device.
+ * @param block_ids     The block ids that will be accessed soon.
+ * @param count         Number of ids in the list.
+ */
+void heartyfs_prefetch(struct heartyfs_dev *dev, int *block_ids, int count)
+{
+    if (dev->backend == HEARTYFS_BACKEND_MMAP) return;
+    if (count > dev->cache_blocks / 4) count = dev->cache_blocks / 4;
+
+    int i = 0;
+    while (i < count)
+    {
+        // Collect a run of consecutive ids that are not cached yet
+        struct iovec iov[HEARTYFS_IO_BATCH];
+        int slots[HEARTYFS_IO_BATCH];
+        int first = block_ids[i];
+        int run = 0;
+        while (i < count && run < HEARTYFS_IO_BATCH && block_ids[i] == first + run
+                && block_ids[i] >= 2 && block_ids[i] < dev->num_blocks
+                && dev->index[block_ids[i]] < 0)
+        {
+            slots[run] = evict_slot(dev);
+            dev->slots[slots[run]].pinned = 1;  // Reserved until installed, so the run never reuses it
+            iov[run].iov_base = slot_data(dev, slots[run]);
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+            i++;
+        }
+        if (run == 0)
+        {
+            i++;
+            continue;
+        }
+        dev->stats.misses += run;
+        if (preadv(dev->fd, iov, run, (off_t) first * BLOCK_SIZE) != (ssize_t) run * BLOCK_SIZE)
+        {
+            perror("Cannot read blocks from the disk file\n");
+            for (int j = 0; j < run; j++) dev->slots[slots[j]].pinned = 0;
+            return;
+        }
+        for (int j = 0; j < run; j++)
+        {
+            install_slot(dev, slots[j], first + j);
+            if (dev->checksums != NULL) heartyfs_checksum_verify(dev, first + j, slot_data(dev, slots[j]));
+        }
+    }
+}
+
+/*
+ * @brief Returns the microseconds elapsed since the given time.
+ */
+static long elapsed_us(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * @brief Writes every modified block to the image, and waits for it to be durable if asked.
+ *
+ * @param dev           The open device.
+ * @param durable       1 to msync or fsync the image, 0 to leave the writing to the kernel.
+ * @return int          0 on success, -1 on I/O error.
+ */
+static int write_out(struct heartyfs_dev *dev, int durable)
+{
+    int status = 0;
+    if (dev->backend == HEARTYFS_BACKEND_PREAD && write_back(dev, 1) < 0) status = -1;
+    if (store_bitmaps(dev) < 0) status = -1;
+    if (heartyfs_checksum_store(dev) < 0) status = -1;
+    if (dev->backend == HEARTYFS_BACKEND_PREAD
+            && pwrite(dev->fd, dev->meta, 2 * BLOCK_SIZE, 0) != 2 * BLOCK_SIZE) status = -1;
+    if (!durable) return status;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int synced = dev->backend == HEARTYFS_BACKEND_MMAP ? msync(dev->map, dev->size, MS_SYNC)
+                                                       : fsync(dev->fd);
+    if (synced < 0) status = -1;
+    long us = elapsed_us(&start);
+    int bucket = 0;
+    while (bucket < FSYNC_HISTOGRAM_BUCKETS - 1 && us >= (2L << bucket)) bucket++;
+    dev->stats.fsync_histogram[bucket]++;
+    dev->stats.fsyncs++;
+    dev->stats.fsync_us += us;
+    dev->pending_ops = 0;
+    return status;
+}
+
+/*
+ * @brief Writes every modified block back to the image and waits for it to be durable,
+ *        whatever the durability mode.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 on I/O error.
+ */
+int heartyfs_dev_flush(struct heartyfs_dev *dev)
+{
+    return write_out(dev, 1);
+}
+
+/*
+ * @brief Makes the steps of an operation so far durable before the next ones, in sync mode
+ *        only. Group and async mode leave the order to the next flush.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 on I/O error.
+ */
+int heartyfs_dev_barrier(struct heartyfs_dev *dev)
+{
+    if (dev->durability != HEARTYFS_DURABILITY_SYNC) return 0;
+    return heartyfs_dev_flush(dev);
+}
+
+/*
+ * @brief Selects the durability mode applied by heartyfs_dev_commit.
+ *
+ * @param dev           The open device.
+ * @param mode          "sync", "group" or "async".
+ * @return int          0 on success, -1 if the mode is unknown (the mode is left unchanged).
+ */
+int heartyfs_dev_set_durability(struct heartyfs_dev *dev, const char *mode)
+{
+    if (strcmp(mode, "sync") == 0) dev->durability = HEARTYFS_DURABILITY_SYNC;
+    else if (strcmp(mode, "group") == 0) dev->durability = HEARTYFS_DURABILITY_GROUP;
+    else if (strcmp(mode, "async") == 0) dev->durability = HEARTYFS_DURABILITY_ASYNC;
+    else return -1;
+    return 0;
+}
+
+/*
+ * @brief Ends one modifying operation: flushes now in sync mode, once the group is full in
+ *        group mode, and never in async mode.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 if a flush failed.
+ */
+int heartyfs_dev_commit(struct heartyfs_dev *dev)
+{
+    dev->stats.commits++;
+    if (dev->durability == HEARTYFS_DURABILITY_ASYNC) return 0;
+    if (dev->pending_ops++ == 0) clock_gettime(CLOCK_MONOTONIC, &dev->pending_since);
+    if (dev->durability == HEARTYFS_DURABILITY_SYNC || dev->pending_ops >= dev->group_ops)
+    {
+        return heartyfs_dev_flush(dev);
+    }
+    return heartyfs_dev_commit_due(dev);
+}
+
+/*
+ * @brief Flushes the waiting group if its oldest operation waited group_ms. A long-running
+ *        frontend calls it from a timer so a quiet group still becomes durable in time.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success or when nothing is due, -1 if the flush failed.
+ */
+int heartyfs_dev_commit_due(struct heartyfs_dev *dev)
+{
+    if (dev->pending_ops == 0 || elapsed_us(&dev->pending_since) < dev->group_ms * 1000L) return 0;
+    return heartyfs_dev_flush(dev);
+}
+
+/*
+ * @brief Syncs every change and lets other processes lock the image.
+ *        No block pointer of the device may be used until heartyfs_dev_lock returns.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 on I/O error.
+ */
+int heartyfs_dev_unlock(struct heartyfs_dev *dev)
+{
+    int status = heartyfs_dev_flush(dev);
+    if (flock(dev->fd, LOCK_UN) < 0) status = -1;
+    return status;
+}
+
+/*
+ * @brief Locks the image again after heartyfs_dev_unlock. The pread backend drops its cache
+ *        and rereads the superblock and bitmaps, since another process may have changed them.
+ *        The device follows an image grown in between.
+ *
+ * @param dev           The open device.
+ * @return int          0 on success, -1 on I/O error.
+ */
+int heartyfs_dev_lock(struct heartyfs_dev *dev)
+{
+    if (flock(dev->fd, LOCK_EX) < 0) return -1;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        // The shared mapping is always current, only copied bitmaps and the checksum table
+        // have to be reloaded
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        if (superblock->total_blocks > dev->num_blocks && heartyfs_dev_remap(dev, superblock->total_blocks) < 0) return -1;
+        if (dev->block_groups > 1 && load_bitmaps(dev, 0) < 0) return -1;
+        return heartyfs_checksum_load(dev) < 0 ? -1 : 0;
+    }
+
+    for (int i = 0; i < dev->cache_blocks; i++)
+    {
+        if (dev->slots[i].block_id >= 0) dev->index[dev->slots[i].block_id] = -1;
+        memset(&dev->slots[i], 0, sizeof(dev->slots[i]));
+        dev->slots[i].block_id = -1;
+    }
+    dev->stats.pinned = 0;
+    if (pread(dev->fd, dev->meta, 2 * BLOCK_SIZE, 0) != 2 * BLOCK_SIZE)
+    {
+        perror("Cannot read the superblock and bitmap\n");
+        return -1;
+    }
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->total_blocks > dev->num_blocks && heartyfs_dev_remap(dev, superblock->total_blocks) < 0) return -1;
+    if (load_bitmaps(dev, 1) < 0) return -1;
+    return heartyfs_checksum_load(dev) < 0 ? -1 : 0;
+}
+
+/*
+ * @brief Prints the block cache counters and hit rate.
+ *
+ * @param dev           The open device.
+ * @param out           The stream to print to.
+ */
+void heartyfs_dev_print_stats(struct heartyfs_dev *dev, FILE *out)
+{
+    struct heartyfs_cache_stats *stats = &dev->stats;
+    long lookups = stats->hits + stats->misses;
+    double hit_rate = lookups > 0 ? 100.0 * stats->hits / lookups : 0.0;
+    fprintf(out, "Stats: backend=%s cache_blocks=%d pinned=%d\n",
+            dev->backend == HEARTYFS_BACKEND_MMAP ? "mmap" : "pread",
+            dev->cache_blocks, stats->pinned);
+    fprintf(out, "Stats: hits=%ld misses=%ld hit_rate=%.1f%% evictions=%ld\n",
+            stats->hits, stats->misses, hit_rate, stats->evictions);
+    fprintf(out, "Stats: writebacks=%ld write_batches=%ld\n",
+            stats->writebacks, stats->write_batches);
+    if (dev->dedup) fprintf(out, "Stats: dedup_shared=%ld\n", stats->dedup_shared);
+    if (dev->checksums != NULL)
+    {
+        fprintf(out, "Stats: checksum_verified=%ld checksum_errors=%ld\n",
+                stats->checksum_verified, stats->checksum_errors);
+    }
+    if (stats->compress_in > 0)
+    {
+        fprintf(out, "Stats: compress_in=%ld compress_out=%ld ratio=%.2fx\n",
+                stats->compress_in, stats->compress_out,
+                (double) stats->compress_in / stats->compress_out);
+    }
+    if (stats->commits > 0 || dev->durability != HEARTYFS_DURABILITY_SYNC)
+    {
+        static const char *modes[] = {"sync", "group", "async"};
+        fprintf(out, "Stats: durability=%s commits=%ld fsyncs=%ld fsync_avg=%ldus\n",
+                modes[dev->durability], stats->commits, stats->fsyncs,
+                stats->fsyncs > 0 ? stats->fsync_us / stats->fsyncs : 0);
+        for (int i = 0; i < FSYNC_HISTOGRAM_BUCKETS; i++)
+        {
+            if (stats->fsync_histogram[i] == 0) continue;
+            fprintf(out, "Stats: fsync %ld-%ldus: %ld\n", i == 0 ? 0 : 1L << i, (2L << i) - 1,
+                    stats->fsync_histogram[i]);
+        }
+    }
+}
+
+/*
+ * @brief Flushes, releases the backend resources, and closes the image. In async mode the
+ *        changes are handed to the kernel without waiting for them to be durable.
+ *
+ * @param dev           The open device.
+ */
+void heartyfs_dev_close(struct heartyfs_dev *dev)
+{
+    int durable = dev->durability != HEARTYFS_DURABILITY_ASYNC;
+    if (dev->backend == HEARTYFS_BACKEND_MMAP)
+    {
+        if (dev->map != NULL)
+        {
+            write_out(dev, durable);        // Sync changes to the file
+            munmap(dev->map, dev->size);    // Unmap the memory
+        }
+    }
+    else if (dev->meta != NULL)
+    {
+        write_out(dev, durable);
+    }
+    char *stats = getenv("HEARTYFS_STATS");
+    if (stats != NULL && strcmp(stats, "1") == 0 && dev->fd >= 0)
+    {
+        heartyfs_dev_print_stats(dev, stdout);
+    }
+    release_dev(dev);
+}
@@ -0,0 +1,457 @@
+/*
+ * heartyfs_dir.c
+ *
+ * Brief
+ * - This program provides the directory entry format: the entries of a directory are
+ *   variable-length records packed one after the other, so short names take little room
+ *   and names can be up to HEARTYFS_NAME_MAX bytes. Every other module goes through the
+ *   functions here instead of reading the records.
+ *
+ * Data Structures:
+ * - `heartyfs_dir_record`: One entry on disk: the block id, a 16-bit hash of the name, the
+ *   name length, then the name itself without a terminator. Records are not aligned.
+ * - `heartyfs_dir_entry`: One entry unpacked for callers, with a terminated name.
+ * - `heartyfs_dir_cursor`: The byte offset and position of the next record, used to walk a
+ *   directory without scanning it again for every entry.
+ *
+ * Design Decisions:
+ * - Records sit in the DIR_RECORD_AREA bytes that held the fixed entries, so the directory
+ *   header, and the root directory inside the superblock, keep their layout.
+ * - "." and ".." are always the first two records, so the directory itself and its parent
+ *   are found without a scan.
+ * - Lookups compare the cached hash and the length before the name, so a scan reads little
+ *   more than the record headers, and the headers of short names share cache lines.
+ * - A removed entry is replaced by the last one, as with the fixed entries, so the order of
+ *   the remaining entries is the same as before.
+ * - Images made before this format have fixed 32-byte entries. They are converted in place
+ *   the first time they are opened (see heartyfs_dir_upgrade); superblock->type records
+ *   the format.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+struct heartyfs_legacy_directory
+{
+    int type;
+    char name[CHAR_SIZE];
+    int size;
+    struct
+    {
+        int block_id;
+        char file_name[CHAR_SIZE];
+    } entries[DIR_RECORD_AREA / 32];
+};
+
+/*
+ * @brief Returns the 16-bit hash of a name, stored in its record.
+ */
+static uint16_t name_hash(const char *name, int length)
+{
+    uint64_t hash = heartyfs_hash(name, length, 0);
+    return (uint16_t) (hash ^ (hash >> 16) ^ (hash >> 32) ^ (hash >> 48));
+}
+
+/*
+ * @brief Returns the record at the given cursor.
+ */
+static struct heartyfs_dir_record *record_at(struct heartyfs_directory *dir, int cursor)
+{
+    return (struct heartyfs_dir_record *) (dir->records + cursor);
+}
+
+/*
+ * @brief Returns the bytes taken by the record at the given cursor.
+ */
+static int record_length(struct heartyfs_directory *dir, int cursor)
+{
+    return DIR_RECORD_HEADER + record_at(dir, cursor)->name_length;
+}
+
+/*
+ * @brief Returns the cursor of the index-th record, or of the end of the records when index
+ *        is dir->size. Stops early on a corrupt record.
+ */
+static int record_cursor(struct heartyfs_directory *dir, int index)
+{
+    int cursor = 0;
+    for (int i = 0; i < index && cursor + DIR_RECORD_HEADER <= DIR_RECORD_AREA; i++)
+    {
+        cursor += record_length(dir, cursor);
+    }
+    return cursor <= DIR_RECORD_AREA ? cursor : DIR_RECORD_AREA;
+}
+
+/*
+ * @brief Finds the record of a name.
+ *
+ * @param dir           The directory to search.
+ * @param name          The name to find.
+ * @param index         Output: the position of the record, may be NULL.
+ * @return int          The cursor of the record, or -1 if the name is not there.
+ */
+static int find_record(struct heartyfs_directory *dir, const char *name, int *index)
+{
+    int length = strlen(name);
+    if (length > HEARTYFS_NAME_MAX) return -1;
+    uint16_t hash = name_hash(name, length);
+    int cursor = 0;
+    for (int i = 0; i < dir->size && cursor + DIR_RECORD_HEADER <= DIR_RECORD_AREA; i++)
+    {
+        struct heartyfs_dir_record *record = record_at(dir, cursor);
+        if (record->hash == hash && record->name_length == length
+                && cursor + DIR_RECORD_HEADER + length <= DIR_RECORD_AREA
+                && memcmp(record->name, name, length) == 0)
+        {
+            if (index != NULL) *index = i;
+            return cursor;
+        }
+        cursor += DIR_RECORD_HEADER + record->name_length;
+    }
+    return -1;
+}
+
+/*
+ * @brief Writes a record at the given cursor, moving the records from there on to make room.
+ *        The caller checked that it fits.
+ */
+static void insert_record(struct heartyfs_directory *dir, int cursor, int used,
+                            const char *name, int length, int block_id)
+{
+    memmove(dir->records + cursor + DIR_RECORD_HEADER + length, dir->records + cursor, used - cursor);
+    struct heartyfs_dir_record *record = record_at(dir, cursor);
+    record->block_id = block_id;
+    record->hash = name_hash(name, length);
+    record->name_length = length;
+    memcpy(record->name, name, length);
+}
+
+/*
+ * @brief Drops the record at the given cursor, moving the following records down.
+ */
+static void delete_record(struct heartyfs_directory *dir, int cursor, int used)
+{
+    int length = record_length(dir, cursor);
+    memmove(dir->records + cursor, dir->records + cursor + length, used - cursor - length);
+    memset(dir->records + used - length, 0, length);
+}
+
+/*
+ * @brief Returns the block of the directory itself, its "." entry.
+ */
+int dir_self_id(struct heartyfs_directory *dir)
+{
+    return record_at(dir, 0)->block_id;
+}
+
+/*
+ * @brief Returns the block of the parent directory, the ".." entry.
+ */
+int dir_parent_id(struct heartyfs_directory *dir)
+{
+    return record_at(dir, record_length(dir, 0))->block_id;
+}
+
+/*
+ * @brief Points the "." entry at another block. The caller marks the directory dirty.
+ */
+void dir_set_self(struct heartyfs_directory *dir, int block_id)
+{
+    record_at(dir, 0)->block_id = block_id;
+}
+
+/*
+ * @brief Points the ".." entry at another block. The caller marks the directory dirty.
+ */
+void dir_set_parent(struct heartyfs_directory *dir, int block_id)
+{
+    record_at(dir, record_length(dir, 0))->block_id = block_id;
+}
+
+/*
+ * @brief Starts a walk of a directory.
+ *
+ * @param dir           The directory to walk.
+ * @param cursor        Output: the cursor to pass to dir_next.
+ * @param with_dots     1 to walk "." and ".." too, 0 to start after them.
+ */
+void dir_start(struct heartyfs_directory *dir, struct heartyfs_dir_cursor *cursor, int with_dots)
+{
+    cursor->index = with_dots ? 0 : 2;
+    cursor->offset = record_cursor(dir, cursor->index);
+}
+
+/*
+ * @brief Reads the entry at the cursor and moves the cursor to the next one.
+ *
+ * @param dir           The directory to walk.
+ * @param cursor        In and out: the cursor from dir_start.
+ * @param entry         Output: the entry.
+ * @return int          1 if an entry was read, 0 at the end of the directory.
+ */
+int dir_next(struct heartyfs_directory *dir, struct heartyfs_dir_cursor *cursor,
+                struct heartyfs_dir_entry *entry)
+{
+    if (cursor->index >= dir->size || cursor->offset + DIR_RECORD_HEADER > DIR_RECORD_AREA) return 0;
+    struct heartyfs_dir_record *record = record_at(dir, cursor->offset);
+    if (cursor->offset + DIR_RECORD_HEADER + record->name_length > DIR_RECORD_AREA) return 0;
+    entry->block_id = record->block_id;
+    memcpy(entry->file_name, record->name, record->name_length);
+    entry->file_name[record->name_length] = '\0';
+    cursor->offset += DIR_RECORD_HEADER + record->name_length;
+    cursor->index++;
+    return 1;
+}
+
+/*
+ * @brief Tells whether an entry with the given name still fits in the directory.
+ *
+ * @return int          1 if it fits, 0 otherwise.
+ */
+int dir_has_room(struct heartyfs_directory *dir, const char *name)
+{
+    int length = strlen(name);
+    if (length > HEARTYFS_NAME_MAX) return 0;
+    return record_cursor(dir, dir->size) + DIR_RECORD_HEADER + length <= DIR_RECORD_AREA;
+}
+
+/*
+ * @brief Appends an entry, without create_entry's checks and message. The caller checked
+ *        that the name is new and marks the directory dirty.
+ *
+ * @param dir           The directory receiving the entry.
+ * @param name          The name of the entry.
+ * @param block_id      The block it points at.
+ * @return int          1 on success, -1 if the entry does not fit.
+ */
+int dir_add(struct heartyfs_directory *dir, const char *name, int block_id)
+{
+    if (!dir_has_room(dir, name)) return -1;
+    int used = record_cursor(dir, dir->size);
+    insert_record(dir, used, used, name, strlen(name), block_id);
+    dir->size++;
+    return 1;
+}
+
+/*
+ * @brief Points the entry with the given name at another block. The caller marks the
+ *        directory dirty.
+ *
+ * @param dir           The directory holding the entry.
+ * @param name          The name of the entry.
+ * @param old_id        The block the entry must point at now, or -1 for any.
+ * @param new_id        The block it points at afterwards.
+ * @return int          1 if the entry was changed, -1 if there is no such entry.
+ */
+int dir_replace_id(struct heartyfs_directory *dir, const char *name, int old_id, int new_id)
+{
+    int cursor = find_record(dir, name, NULL);
+    if (cursor < 0 || (old_id >= 0 && record_at(dir, cursor)->block_id != old_id)) return -1;
+    record_at(dir, cursor)->block_id = new_id;
+    return 1;
+}
+
+/*
+ * @brief Renames an entry in place, keeping its position. The caller marks the directory
+ *        dirty.
+ *
+ * @param dir           The directory holding the entry.
+ * @param old_name      The current name.
+ * @param new_name      The new name.
+ * @return int          1 on success, -1 if there is no such entry or the new name does not fit.
+ */
+int dir_rename_entry(struct heartyfs_directory *dir, const char *old_name, const char *new_name)
+{
+    int cursor = find_record(dir, old_name, NULL);
+    int length = strlen(new_name);
+    if (cursor < 0 || length > HEARTYFS_NAME_MAX) return -1;
+    int used = record_cursor(dir, dir->size);
+    if (used - record_length(dir, cursor) + DIR_RECORD_HEADER + length > DIR_RECORD_AREA) return -1;
+
+    int block_id = record_at(dir, cursor)->block_id;
+    delete_record(dir, cursor, used);
+    used -= DIR_RECORD_HEADER + strlen(old_name);
+    insert_record(dir, cursor, used, new_name, length, block_id);
+    return 1;
+}
+
+/*
+ * @brief Searches for an entry with the specified name in the given directory.
+ *
+ * @param parent_dir    The directory structure to search in.
+ * @param target_name   The name of the entry to search for.
+ * @return int          The block ID of the found entry, or -1 if not found.
+ */
+int search_entry_in_dir(struct heartyfs_directory *parent_dir, char *target_name)
+{
+    int cursor = find_record(parent_dir, target_name, NULL);
+    return cursor < 0 ? -1 : record_at(parent_dir, cursor)->block_id;
+}
+
+/*
+ * @brief Creates a new entry in the specified parent directory.
+ *
+ * @param dev                   The open disk image.
+ * @param parent_dir            The directory structure where the entry will be created.
+ * @param target_name           The name of the entry to create.
+ * @param target_block_id       The block ID assigned to the entry.
+ * @return int                  1 on success, -1 if the name is too long or the directory is full.
+ */
+int create_entry(struct heartyfs_dev *dev, struct heartyfs_directory *parent_dir,
+                    char *target_name, int target_block_id)
+{
+    int length = strlen(target_name);
+    if (length > HEARTYFS_NAME_MAX)
+    {
+        printf("Error: The name %s is too long\n", target_name);
+        return -1;
+    }
+    if (dir_add(parent_dir, target_name, target_block_id) != 1)
+    {
+        printf("Error: The directory is full\n");
+        return -1;
+    }
+    heartyfs_dirty(dev, parent_dir);
+    printf("Success: Created entry %s at %s with id %d\n", target_name, parent_dir->name, target_block_id);
+    return 1;
+}
+
+/*
+ * @brief Removes the specified entry from a parent directory.
+ *
+ * @param superblock            The superblock structure of the filesystem.
+ * @param dev                   The open disk image.
+ * @param parent_block_id       The block ID of the parent directory.
+ * @param target_name           The name of the entry to remove.
+ * @return int                  - 1 on success, -1 if the entry is not found or if the removal is denied.
+ */
+int remove_entry(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev,
+                    int parent_block_id, char *target_name)
+{
+    struct heartyfs_directory *parent_dir = NULL;
+    if (parent_block_id == 0) parent_dir = superblock->root_dir;
+    else parent_dir = heartyfs_block(dev, parent_block_id);
+    if (strcmp(target_name, ".") == 0 || strcmp(target_name, "..") == 0)
+    {
+        printf("Denied: Refuse to remove this entry %s\n", target_name);
+        return -1;
+    }
+
+    int index;
+    int cursor = find_record(parent_dir, target_name, &index);
+    if (cursor < 0)
+    {
+        printf("Error: Can not find the entry %s\n", target_name);
+        return -1;
+    }
+
+    // Move the last entry to the removed entry
+    int last = record_cursor(parent_dir, parent_dir->size - 1);
+    int used = last + record_length(parent_dir, last);
+    if (index == parent_dir->size - 1) delete_record(parent_dir, cursor, used);
+    else
+    {
+        uint8_t moved[DIR_RECORD_HEADER + HEARTYFS_NAME_MAX];
+        struct heartyfs_dir_record *record = (struct heartyfs_dir_record *) moved;
+        memcpy(moved, record_at(parent_dir, last), used - last);
+        delete_record(parent_dir, last, used);
+        used = last;
+        delete_record(parent_dir, cursor, used);
+        used -= DIR_RECORD_HEADER + strlen(target_name);
+        insert_record(parent_dir, cursor, used, record->name, record->name_length, record->block_id);
+    }
+    parent_dir->size--;
+    heartyfs_dirty(dev, parent_dir);
+    printf("Success: Removed entry %s\n", target_name);
+    return 1;
+}
+
+/*
+ * @brief Converts one directory block from fixed 32-byte entries to records.
+ *
+ * @return int          1 on success, -1 if its entries do not fit as records.
+ */
+static int upgrade_dir(struct heartyfs_directory *dir)
+{
+    struct heartyfs_legacy_directory legacy;
+    memcpy(&legacy, dir, sizeof(legacy));
+    memset(dir->records, 0, DIR_RECORD_AREA);
+    int used = 0;
+    for (int i = 0; i < legacy.size; i++)
+    {
+        int length = strnlen(legacy.entries[i].file_name, CHAR_SIZE - 1);
+        if (used + DIR_RECORD_HEADER + length > DIR_RECORD_AREA)
+        {
+            memcpy(dir, &legacy, sizeof(legacy));
+            return -1;
+        }
+        insert_record(dir, used, used, legacy.entries[i].file_name, length, legacy.entries[i].block_id);
+        used += DIR_RECORD_HEADER + length;
+    }
+    return 1;
+}
+
+/*
+ * @brief Converts every directory of an image made with fixed 32-byte entries, in the live
+ *        tree and in the snapshots, to records. Does nothing on an image already converted.
+ *
+ * @param dev           The open disk image.
+ * @return int          1 on success, -1 if a directory could not be converted.
+ */
+int heartyfs_dir_upgrade(struct heartyfs_dev *dev)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->type >= HEARTYFS_FORMAT_PACKED_DIRS || superblock->root_dir->name[0] == '\0') return 1;
+
+    // Directory blocks shared with snapshots are converted once
+    uint8_t *seen = calloc(dev->num_blocks, 1);
+    int *stack = malloc(dev->num_blocks * sizeof(int));
+    if (seen == NULL || stack == NULL)
+    {
+        free(seen);
+        free(stack);
+        return -1;
+    }
+    int top = 0;
+    stack[top++] = 0;
+    seen[0] = 1;
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext != NULL && ext->snapshot_dir > 1 && ext->snapshot_dir < dev->num_blocks)
+    {
+        stack[top++] = ext->snapshot_dir;
+        seen[ext->snapshot_dir] = 1;
+    }
+
+    int status = 1;
+    while (top > 0 && status == 1)
+    {
+        int block_id = stack[--top];
+        struct heartyfs_directory *dir = block_id == 0 ? superblock->root_dir : heartyfs_block(dev, block_id);
+        if (dir == NULL || dir->type != 1) continue;
+
+        // Queue the subdirectories before their ids are packed away
+        struct heartyfs_legacy_directory *legacy = (struct heartyfs_legacy_directory *) dir;
+        for (int i = 2; i < legacy->size && i < DIR_RECORD_AREA / 32; i++)
+        {
+            int child_id = legacy->entries[i].block_id;
+            if (child_id > 1 && child_id < dev->num_blocks && !seen[child_id])
+            {
+                stack[top++] = child_id;
+                seen[child_id] = 1;
+            }
+        }
+        status = upgrade_dir(dir);
+        if (status == 1) heartyfs_dirty(dev, dir);
+        else printf("Error: The directory %s has too many long names to convert\n", dir->name);
+        superblock = heartyfs_block(dev, 0);
+    }
+    free(seen);
+    free(stack);
+    if (status == 1)
+    {
+        superblock->type = HEARTYFS_FORMAT_PACKED_DIRS;
+        heartyfs_dirty(dev, superblock);
+    }
+    return status;
+}
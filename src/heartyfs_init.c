@@ -24,48 +24,18 @@
 
 int main() 
 {
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot open the disk file\n");
         exit(1);
     }
 
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
-    {
-        perror("Cannot map the disk file onto memory\n");
-        exit(1);
-    }
-
-    // TODO:
-    // Initialize the superblock
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    superblock->total_blocks = NUM_BLOCK;
-    superblock->free_blocks = NUM_BLOCK - 2;
-    superblock->block_size = BLOCK_SIZE;
-
-    // Initialize the bitmap
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
-    memset(bitmap, 0xFF, sizeof(bitmap));   // Set all bits to 1
-
-    // Add root, ., and .. directories
-    struct heartyfs_directory *root_dir = superblock->root_dir;
-    root_dir->type = 1;
-    root_dir->size = 0;
-    snprintf(root_dir->name, sizeof(root_dir->name), "%s", "/");
-    create_entry(superblock, root_dir, ".", 0, bitmap);
-    create_entry(superblock, root_dir, "..", 0, bitmap);
-
-    // Mark occupied
-    occupy_block(0, bitmap);   // Occupied first block for superblock
-    occupy_block(1, bitmap);   // Occupied second block for bitmap
-    memcpy((uint8_t *)(buffer + BLOCK_SIZE), bitmap, sizeof(bitmap)); // Put in the second block
+    // Initialize the superblock, the bitmap and the root directory
+    heartyfs_format(&dev);
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
     
     return 0;
 }
@@ -0,0 +1,470 @@
+/*
+ * heartyfs_meta.c
+ *
+ * Brief
+ * - This program provides the metadata kept in every inode besides its data blocks: the
+ *   permission bits, the owner, the modification and change times, the length of the file
+ *   in bytes, and the extended attributes.
+ *
+ * Data Structures:
+ * - `heartyfs_inode`: mode, uid and gid, mtime and ctime in nanoseconds since the epoch and
+ *   the length, in the 28 bytes that held the name copy of the first inodes, so a file still
+ *   has MAX_DATA_BLOCKS data blocks. `links` is the upper half of the old block count.
+ * - `heartyfs_xattr_block`: An optional block of xattrs, allocated on the first set and freed
+ *   when the last attribute is removed.
+ * - `heartyfs_xattr_record`: One attribute: the name length, the value length, then the
+ *   name and the value without terminators. Records are packed one after the other.
+ *
+ * Design Decisions:
+ * - Everything stat reports lives in the inode block, so heartyfs_entry_info answers with one
+ *   block read and never walks the data blocks or the directories again. readdir_plus hands
+ *   the same attributes out for a whole directory. Only reading the xattrs themselves costs
+ *   a second block.
+ * - mtime changes with the content, ctime with the content, the names, the mode and the
+ *   xattrs. Reads change nothing, so the image is never written by a reader.
+ * - The length is kept by write_unit and the FUSE write path, so the size of a compressed
+ *   file no longer needs its frame headers.
+ * - The xattr block is owned like a data block: a copied inode shares it, and it is copied
+ *   before a change while a snapshot still owns it. It is charged to quotas with the file.
+ * - Images made before this format have the old name copy where the metadata now is. They
+ *   are converted in place the first time they are opened (see heartyfs_inode_upgrade).
+ *   No old count can be trusted in those bytes, so the links are counted again from the
+ *   names in the live tree.
+ *   Every inode is checked before any is changed; if one cannot be converted the image is
+ *   left exactly as it was.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+/*
+ * @brief Returns the current time in nanoseconds since the epoch.
+ */
+int64_t heartyfs_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * @brief Clears a new inode and gives it the default mode, the owner of the process and
+ *        the current time.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode block to fill in.
+ */
+void heartyfs_inode_init(struct heartyfs_dev *dev, struct heartyfs_inode *inode)
+{
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = HEARTYFS_FILE_MODE;
+    inode->uid = (uint16_t) getuid();
+    inode->gid = (uint16_t) getgid();
+    inode->mtime = heartyfs_now();
+    inode->ctime = inode->mtime;
+    heartyfs_dirty(dev, inode);
+}
+
+/*
+ * @brief Records a change of an inode: ctime always, mtime too when the content changed.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode, private to the live tree.
+ * @param content       1 when the data of the file changed, 0 for metadata only.
+ */
+void heartyfs_touch(struct heartyfs_dev *dev, struct heartyfs_inode *inode, int content)
+{
+    inode->ctime = heartyfs_now();
+    if (content) inode->mtime = inode->ctime;
+    heartyfs_dirty(dev, inode);
+}
+
+/*
+ * @brief Copies the xattr block of an inode, or an empty one if it has none.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode.
+ * @param area          Output: the xattrs.
+ */
+static void load_xattrs(struct heartyfs_dev *dev, struct heartyfs_inode *inode,
+                        struct heartyfs_xattr_block *area)
+{
+    struct heartyfs_xattr_block *stored = inode->xattr_block > 0 ? heartyfs_block(dev, inode->xattr_block) : NULL;
+    if (stored != NULL) memcpy(area, stored, sizeof(*area));
+    else memset(area, 0, sizeof(*area));
+    if (area->used < 0 || area->used > XATTR_AREA) area->used = 0;
+}
+
+/*
+ * @brief Finds an attribute in the xattrs.
+ *
+ * @param area          The xattrs.
+ * @param name          The name of the attribute.
+ * @return int          Byte offset of its record, or -1 if there is no such attribute.
+ */
+static int find_xattr(struct heartyfs_xattr_block *area, const char *name)
+{
+    int length = strlen(name);
+    int offset = 0;
+    while (offset + XATTR_RECORD_HEADER <= area->used)
+    {
+        struct heartyfs_xattr_record *record = (struct heartyfs_xattr_record *) (area->records + offset);
+        if (record->name_length == length && memcmp(record->data, name, length) == 0) return offset;
+        offset += XATTR_RECORD_HEADER + record->name_length + record->value_length;
+    }
+    return -1;
+}
+
+/*
+ * @brief Returns the size of the xattr record at the given offset.
+ */
+static int xattr_length(struct heartyfs_xattr_block *area, int offset)
+{
+    struct heartyfs_xattr_record *record = (struct heartyfs_xattr_record *) (area->records + offset);
+    return XATTR_RECORD_HEADER + record->name_length + record->value_length;
+}
+
+/*
+ * @brief Writes changed xattrs back to a file: to its own xattr block, to a new one if it
+ *        had none or shares it with a snapshot, or nowhere once the last attribute is gone.
+ *        The blocks added or dropped are charged to the file chosen by heartyfs_charge_file.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode of the file, private to the live tree.
+ * @param area          The changed xattrs.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if there is no space or a quota refused the block.
+ */
+static int store_xattrs(struct heartyfs_dev *dev, int block_id, struct heartyfs_xattr_block *area,
+                        uint8_t *bitmap)
+{
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    int old_block = inode->xattr_block;
+    int new_block = old_block;
+    if (area->used == 0) new_block = 0;
+    else if (old_block == 0 || share_count(dev, old_block) > 0)
+    {
+        if (old_block == 0 && heartyfs_charge_blocks(dev, 1) != 1) return -1;
+        new_block = take_block(dev, bitmap);
+        if (new_block < 0)
+        {
+            if (old_block == 0) heartyfs_charge_blocks(dev, -1);
+            return -1;
+        }
+    }
+
+    if (new_block > 0)
+    {
+        struct heartyfs_xattr_block *stored = heartyfs_block(dev, new_block);
+        memset(stored, 0, BLOCK_SIZE);
+        memcpy(stored, area, sizeof(int) + area->used);
+        heartyfs_dirty(dev, stored);
+    }
+    if (old_block > 0 && new_block != old_block)
+    {
+        heartyfs_release_data(dev, old_block, bitmap);
+        if (new_block == 0) heartyfs_charge_blocks(dev, -1);
+    }
+    inode = heartyfs_block(dev, block_id);
+    inode->xattr_block = new_block;
+    heartyfs_touch(dev, inode, 0);
+    return 1;
+}
+
+/*
+ * @brief Reads the value of an attribute.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode.
+ * @param name          The name of the attribute.
+ * @param value         Output: the value, not terminated.
+ * @param size          Room in value; 0 only asks for the length.
+ * @return int          The length of the value, -1 if there is no such attribute, or -2 if
+ *                      it does not fit in size bytes.
+ */
+int heartyfs_xattr_get(struct heartyfs_dev *dev, struct heartyfs_inode *inode, const char *name,
+                        void *value, int size)
+{
+    struct heartyfs_xattr_block area;
+    load_xattrs(dev, inode, &area);
+    int offset = find_xattr(&area, name);
+    if (offset < 0) return -1;
+    struct heartyfs_xattr_record *record = (struct heartyfs_xattr_record *) (area.records + offset);
+    if (size == 0) return record->value_length;
+    if (size < record->value_length) return -2;
+    memcpy(value, record->data + record->name_length, record->value_length);
+    return record->value_length;
+}
+
+/*
+ * @brief Sets an attribute, replacing its value if it exists.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode, private to the live tree.
+ * @param name          The name of the attribute, 1 to 255 bytes.
+ * @param value         The value.
+ * @param size          Bytes of value, at most 255.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if the name is invalid, the xattr block is full or
+ *                      there is no space for it.
+ */
+int heartyfs_xattr_set(struct heartyfs_dev *dev, int block_id, const char *name,
+                        const void *value, int size, uint8_t *bitmap)
+{
+    int name_length = strlen(name);
+    if (name_length == 0 || name_length > 255 || size < 0 || size > 255) return -1;
+    struct heartyfs_xattr_block area;
+    load_xattrs(dev, heartyfs_block(dev, block_id), &area);
+    int offset = find_xattr(&area, name);
+    int freed = offset < 0 ? 0 : xattr_length(&area, offset);
+    int record_length = XATTR_RECORD_HEADER + name_length + size;
+    if (area.used - freed + record_length > XATTR_AREA) return -1;
+
+    // Drop the old record, then append the new one
+    if (offset >= 0)
+    {
+        memmove(area.records + offset, area.records + offset + freed, area.used - offset - freed);
+        area.used -= freed;
+    }
+    struct heartyfs_xattr_record *record = (struct heartyfs_xattr_record *) (area.records + area.used);
+    record->name_length = name_length;
+    record->value_length = size;
+    memcpy(record->data, name, name_length);
+    memcpy(record->data + name_length, value, size);
+    area.used += record_length;
+    return store_xattrs(dev, block_id, &area, bitmap);
+}
+
+/*
+ * @brief Removes an attribute.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode, private to the live tree.
+ * @param name          The name of the attribute.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 if there is no such attribute or no space to copy
+ *                      a shared xattr block.
+ */
+int heartyfs_xattr_remove(struct heartyfs_dev *dev, int block_id, const char *name, uint8_t *bitmap)
+{
+    struct heartyfs_xattr_block area;
+    load_xattrs(dev, heartyfs_block(dev, block_id), &area);
+    int offset = find_xattr(&area, name);
+    if (offset < 0) return -1;
+    int freed = xattr_length(&area, offset);
+    memmove(area.records + offset, area.records + offset + freed, area.used - offset - freed);
+    area.used -= freed;
+    return store_xattrs(dev, block_id, &area, bitmap);
+}
+
+/*
+ * @brief Lists the names of the attributes, each terminated by '\0', in the order they were
+ *        set.
+ *
+ * @param dev           The open disk image.
+ * @param inode         The inode.
+ * @param list          Output: the names.
+ * @param size          Room in list; 0 only asks for the length.
+ * @return int          Bytes of the list, or -2 if it does not fit in size bytes.
+ */
+int heartyfs_xattr_list(struct heartyfs_dev *dev, struct heartyfs_inode *inode, char *list, int size)
+{
+    struct heartyfs_xattr_block area;
+    load_xattrs(dev, inode, &area);
+    int total = 0;
+    int offset = 0;
+    while (offset + XATTR_RECORD_HEADER <= area.used)
+    {
+        struct heartyfs_xattr_record *record = (struct heartyfs_xattr_record *) (area.records + offset);
+        if (size > 0)
+        {
+            if (total + record->name_length + 1 > size) return -2;
+            memcpy(list + total, record->data, record->name_length);
+            list[total + record->name_length] = '\0';
+        }
+        total += record->name_length + 1;
+        offset += xattr_length(&area, offset);
+    }
+    return total;
+}
+
+/*
+ * @brief Counts the names of every file in the live tree of an older image. The old link
+ *        count shared its bytes with the name copy, so it cannot be read back.
+ *
+ * @param dev           The open disk image, with packed directories.
+ * @param names         Receives the number of live names of each inode block, 0 for
+ *                      inodes only in snapshots. Holds dev->num_blocks counters.
+ * @return int          1 on success, -1 if out of memory.
+ */
+static int count_names(struct heartyfs_dev *dev, uint8_t *names)
+{
+    uint8_t *seen = calloc(dev->num_blocks, 1);
+    int *stack = malloc(dev->num_blocks * sizeof(int));
+    if (seen == NULL || stack == NULL)
+    {
+        free(seen);
+        free(stack);
+        return -1;
+    }
+    int top = 0;
+    stack[top++] = 0;
+    seen[0] = 1;
+    while (top > 0)
+    {
+        int block_id = stack[--top];
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        struct heartyfs_directory *dir = block_id == 0 ? superblock->root_dir : heartyfs_block(dev, block_id);
+        if (dir == NULL || dir->type != 1) continue;
+
+        // Work on a copy, reading the children may evict the directory block
+        struct heartyfs_directory listed;
+        memcpy(&listed, dir, sizeof(listed));
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(&listed, &cursor, 0);
+        while (dir_next(&listed, &cursor, &entry))
+        {
+            int child_id = entry.block_id;
+            if (child_id <= 1 || child_id >= dev->num_blocks) continue;
+            if (*(int *) heartyfs_block(dev, child_id) != 1)
+            {
+                if (names[child_id] < MAX_SHARE_COUNT) names[child_id]++;
+            }
+            else if (!seen[child_id])
+            {
+                seen[child_id] = 1;
+                stack[top++] = child_id;
+            }
+        }
+    }
+    free(seen);
+    free(stack);
+    return 1;
+}
+
+/*
+ * @brief Converts one inode of an older image: the name copy becomes the default metadata,
+ *        the length is measured from the data blocks, the file has no xattrs, and the link
+ *        count is rebuilt from the names found in the live tree.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode block.
+ * @param now           The time given to mtime and ctime.
+ * @param names         The number of live names of the inode, 0 if only in snapshots.
+ * @param convert       0 to only check that the inode can be converted, 1 to convert it.
+ * @return int          1 on success, -1 if the file has too many data blocks or is corrupt.
+ */
+static int upgrade_inode(struct heartyfs_dev *dev, int block_id, int64_t now, int names, int convert)
+{
+    // Work on a copy, measuring the length may evict the inode block
+    struct heartyfs_inode upgraded;
+    memcpy(&upgraded, heartyfs_block(dev, block_id), sizeof(upgraded));
+    if (upgraded.size > MAX_DATA_BLOCKS) return -1;
+    upgraded.mode = HEARTYFS_FILE_MODE;
+    upgraded.mtime = now;
+    upgraded.ctime = now;
+    upgraded.uid = (uint16_t) getuid();
+    upgraded.gid = (uint16_t) getgid();
+    upgraded.xattr_block = 0;
+    upgraded.links = names > 1 ? names - 1 : 0;
+    for (int i = upgraded.size; i < MAX_DATA_BLOCKS; i++) upgraded.data_blocks[i] = 0;
+    long length = heartyfs_file_size(dev, &upgraded);
+    if (length < 0) return -1;
+    upgraded.length = length;
+    if (!convert) return 1;
+
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    memcpy(inode, &upgraded, sizeof(upgraded));
+    heartyfs_dirty(dev, inode);
+    return 1;
+}
+
+/*
+ * @brief Walks every directory and inode of an older image, in the live tree and in the
+ *        snapshots, either checking that each inode can be converted or converting it.
+ *
+ * @param dev           The open disk image, with packed directories.
+ * @param names         The live names of each inode block, from count_names.
+ * @param convert       0 to only check, 1 to convert.
+ * @return int          1 on success, -1 if an inode could not be converted.
+ */
+static int upgrade_walk(struct heartyfs_dev *dev, const uint8_t *names, int convert)
+{
+    // Blocks shared with snapshots or hard links are converted once
+    uint8_t *seen = calloc(dev->num_blocks, 1);
+    int *stack = malloc(dev->num_blocks * sizeof(int));
+    if (seen == NULL || stack == NULL)
+    {
+        free(seen);
+        free(stack);
+        return -1;
+    }
+    int top = 0;
+    stack[top++] = 0;
+    seen[0] = 1;
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext != NULL && ext->snapshot_dir > 1 && ext->snapshot_dir < dev->num_blocks)
+    {
+        stack[top++] = ext->snapshot_dir;
+        seen[ext->snapshot_dir] = 1;
+    }
+
+    int64_t now = heartyfs_now();
+    int status = 1;
+    while (top > 0 && status == 1)
+    {
+        int block_id = stack[--top];
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        struct heartyfs_directory *dir = block_id == 0 ? superblock->root_dir : heartyfs_block(dev, block_id);
+        if (dir == NULL || dir->type != 1) continue;
+
+        // Work on a copy, converting the children may evict the directory block
+        struct heartyfs_directory listed;
+        memcpy(&listed, dir, sizeof(listed));
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(&listed, &cursor, 0);
+        while (status == 1 && dir_next(&listed, &cursor, &entry))
+        {
+            int child_id = entry.block_id;
+            if (child_id <= 1 || child_id >= dev->num_blocks || seen[child_id]) continue;
+            seen[child_id] = 1;
+            if (*(int *) heartyfs_block(dev, child_id) == 1) stack[top++] = child_id;
+            else if (upgrade_inode(dev, child_id, now, names[child_id], convert) != 1)
+            {
+                printf("Error: The file %s has more than %d data blocks or is corrupt\n",
+                        entry.file_name, MAX_DATA_BLOCKS);
+                status = -1;
+            }
+        }
+    }
+    free(seen);
+    free(stack);
+    return status;
+}
+
+/*
+ * @brief Converts every inode of an image made before the inode metadata, in the live tree
+ *        and in the snapshots. Does nothing on an image already converted. Every inode is
+ *        checked before any is changed, so a refused image is left as it was.
+ *
+ * @param dev           The open disk image, with packed directories.
+ * @return int          1 on success, -1 if an inode could not be converted.
+ */
+int heartyfs_inode_upgrade(struct heartyfs_dev *dev)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->type >= HEARTYFS_FORMAT_INODE_META || superblock->root_dir->name[0] == '\0') return 1;
+    uint8_t *names = calloc(dev->num_blocks, 1);
+    int status = names != NULL && count_names(dev, names) == 1 &&
+                 upgrade_walk(dev, names, 0) == 1 && upgrade_walk(dev, names, 1) == 1 ? 1 : -1;
+    free(names);
+    if (status != 1) return -1;
+
+    superblock = heartyfs_block(dev, 0);
+    superblock->type = HEARTYFS_FORMAT_INODE_META;
+    heartyfs_dirty(dev, superblock);
+    return 1;
+}
@@ -57,12 +57,13 @@ int status_block(int block_id, uint8_t *bitmap)
 /*
  * @brief Searches for a free block in the bitmap.
  *
+ * @param dev           The open disk image.
  * @param bitmap        The bitmap tracking the status of blocks.
  * @return int          The ID of the first free block found, or -1 if no free block is available.
  */
-int find_free_block(uint8_t *bitmap) 
+int find_free_block(struct heartyfs_dev *dev, uint8_t *bitmap) 
 {
-    for (int i = 0; i < NUM_BLOCK; i++) 
+    for (int i = 0; i < dev->num_blocks; i++) 
     {
         if (status_block(i, bitmap) > 0) 
         {
@@ -72,23 +73,107 @@ int find_free_block(uint8_t *bitmap)
     return -1; // No free block found
 }
 
+/*
+ * @brief Searches for the lowest run of consecutive free blocks.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @param length        Number of blocks needed.
+ * @return int          The ID of the first block of the run, or -1 if there is none.
+ */
+int find_free_run(struct heartyfs_dev *dev, uint8_t *bitmap, int length)
+{
+    int run = 0;
+    for (int i = 2; i < dev->num_blocks; i++)
+    {
+        run = status_block(i, bitmap) ? run + 1 : 0;
+        if (run == length) return i - length + 1;
+    }
+    return -1;
+}
+
+/*
+ * @brief Asks for the next allocations to come from a run of free blocks, in order, before
+ *        falling back to the lowest free block. Used to lay out related blocks contiguously.
+ *
+ * @param dev           The open disk image.
+ * @param start         The first block of the run, usually from find_free_run.
+ * @param length        Number of blocks in the run, 0 to drop the reservation.
+ */
+void heartyfs_reserve_run(struct heartyfs_dev *dev, int start, int length)
+{
+    dev->reserve_next = start;
+    dev->reserve_end = length > 0 ? start + length : start;
+}
+
+/*
+ * @brief Picks the block for the next allocation: the next one of the reserved run while it
+ *        lasts, otherwise the lowest free block.
+ */
+static int next_free_block(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    while (dev->reserve_next < dev->reserve_end)
+    {
+        int block_id = dev->reserve_next++;
+        if (status_block(block_id, bitmap) > 0) return block_id;
+    }
+    return find_free_block(dev, bitmap);
+}
+
+/*
+ * @brief Takes a free block from the bitmap and updates the free block count.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          The ID of the block taken, or -1 if the disk is full.
+ */
+int take_block(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    int block_id = next_free_block(dev, bitmap);
+    if (block_id < 0 || superblock->free_blocks <= 0)
+    {
+        printf("Error: There is no free block left in the disk\n");
+        return -1;
+    }
+    occupy_block(block_id, bitmap);
+    superblock->free_blocks--;
+    return block_id;
+}
+
+/*
+ * @brief Gives a block back to the bitmap and updates the free block count.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The ID of the block to give back.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ */
+void give_block(struct heartyfs_dev *dev, int block_id, uint8_t *bitmap)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    free_block(block_id, bitmap);
+    superblock->free_blocks++;
+}
+
 /*
  * @brief -Parses the input directory string to verify the path and update the parent directory.
  *         It will also return the parent directory of the given string that match with the current structure
  * 
  * @param input_str         The directory path string to parse.
  * @param dir_name          The output name of the directory being checked.
- * @param buffer            The memory-mapped buffer of the disk image.
+ * @param dev               The open disk image.
  * @param parent_dir        Pointer to the parent directory structure.
- * @param bitmap            bitmap tracking the status of blocks.
- * @return * int            The difference between the depth of the path and the matched depth.
+ * @param bitmap            bitmap tracking the status of blocks. Writers pass it so that directories
+ *                          shared with a snapshot are copied on the way down; readers pass NULL.
+ * @return * int            The difference between the depth of the path and the matched depth,
+ *                          or -1 if the block cache cannot hold the directory.
  * 
  * eg.  input_str: /dir1/dir2, current structure /dir1/dir3 will 
  *          return 1 and the parent_dir is dir1
  *      input_str: /dir1/dir3, current structure /dir1/dir3 will
  *          return 0 and the parent_dir is dir3
  */
-int dir_string_check(char *input_str, char *dir_name, void* buffer,
+int dir_string_check(char *input_str, char *dir_name, struct heartyfs_dev *dev,
                         struct heartyfs_directory **parent_dir, uint8_t *bitmap)
 {
     char delimiter[2] = "/";
@@ -101,18 +186,43 @@ int dir_string_check(char *input_str, char *dir_name, void* buffer,
         {
             sscanf(token, "%s", dir_name);
             int parent_block_id = search_entry_in_dir(*parent_dir, dir_name);
+            if (depth == 0 && dir_name[0] == SNAPSHOT_PREFIX)    // "/@name/..." is inside a snapshot
+            {
+                parent_block_id = heartyfs_snapshot_root(dev, dir_name + 1);
+                if (parent_block_id > 0 && bitmap != NULL)
+                {
+                    printf("Error: The snapshot %s is read-only\n", dir_name + 1);
+                    parent_block_id = -1;
+                }
+            }
             if (parent_block_id > 0)
             {
-                struct heartyfs_directory *temp_dir = (struct heartyfs_directory *) (buffer + BLOCK_SIZE * parent_block_id);
-                if (temp_dir->type == 1)    // check whether it is a directory or not
+                struct heartyfs_directory *temp_dir = heartyfs_block(dev, parent_block_id);
+                if (temp_dir != NULL && temp_dir->type == 1 && bitmap != NULL)
+                {
+                    // Writers get their own copy of a directory shared with a snapshot
+                    parent_block_id = heartyfs_unshare(dev, *parent_dir, dir_name, bitmap);
+                    temp_dir = parent_block_id > 0 ? heartyfs_block(dev, parent_block_id) : NULL;
+
+                    // A directory shared while its parent was copied still has the old ".."
+                    if (temp_dir != NULL && dir_parent_id(temp_dir) != dir_self_id(*parent_dir))
+                    {
+                        dir_set_parent(temp_dir, dir_self_id(*parent_dir));
+                        heartyfs_dirty(dev, temp_dir);
+                    }
+                }
+                if (temp_dir != NULL && temp_dir->type == 1)    // check whether it is a directory or not
                 {
-                    *parent_dir = (struct heartyfs_directory *) (buffer + BLOCK_SIZE * parent_block_id);
+                    // Only the directory returned stays pinned, so deep paths never use up the pins
+                    if (!heartyfs_pin(dev, temp_dir)) return -1;
+                    heartyfs_unpin(dev, *parent_dir);
+                    *parent_dir = temp_dir;
                     matched_depth++;
                 }
             }
             else if (parent_block_id == 0)
             {
-                struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
+                struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
                 *parent_dir = superblock->root_dir;
                 matched_depth++;
             }
@@ -126,106 +236,350 @@ int dir_string_check(char *input_str, char *dir_name, void* buffer,
 }
 
 /*
- * @brief Searches for an entry with the specified name in the given directory.
- * 
- * @param parent_dir    The directory structure to search in.
- * @param target_name   The name of the entry to search for.
- * @return int          The block ID of the found entry, or -1 if not found.
+ * @brief Moves an entry to another name, in the same or another directory, without touching
+ *        its data blocks. An existing file, or an empty directory, at the new name is replaced.
+ *        In sync mode the new entry is made durable before the old one is removed, so a crash
+ *        in between leaves the entry reachable from both directories, never from neither.
+ *
+ * @param dev           The open disk image.
+ * @param src_parent    The directory holding the entry, private to the live tree.
+ * @param src_name      The current name of the entry.
+ * @param dst_parent    The directory receiving the entry, private to the live tree.
+ * @param dst_name      The new name of the entry.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @return int          1 on success, -1 on failure.
  */
-int search_entry_in_dir(struct heartyfs_directory *parent_dir, char *target_name)
+int heartyfs_rename(struct heartyfs_dev *dev, struct heartyfs_directory *src_parent, char *src_name,
+                    struct heartyfs_directory *dst_parent, char *dst_name, uint8_t *bitmap)
 {
-    for (int i = 0; i < parent_dir->size; i++)
+    if (strcmp(src_name, ".") == 0 || strcmp(src_name, "..") == 0
+            || strcmp(dst_name, ".") == 0 || strcmp(dst_name, "..") == 0)
+    {
+        printf("Denied: Refuse to move the entry %s to %s\n", src_name, dst_name);
+        return -1;
+    }
+    if (strlen(dst_name) > HEARTYFS_NAME_MAX)
+    {
+        printf("Error: The name %s is too long\n", dst_name);
+        return -1;
+    }
+
+    // The moved block gets a new name, so it must not be shared with a snapshot
+    int block_id = heartyfs_unshare(dev, src_parent, src_name, bitmap);
+    if (block_id <= 1)
     {
-        if (strcmp(parent_dir->entries[i].file_name, target_name) == 0)
+        printf("Error: Can not find the entry %s\n", src_name);
+        return -1;
+    }
+    void *block = heartyfs_block(dev, block_id);
+    if (!heartyfs_pin(dev, block)) return -1;
+    int is_dir = *(int *) block == 1;
+    int src_parent_id = dir_self_id(src_parent);
+    int dst_parent_id = dir_self_id(dst_parent);
+
+    // A directory can not move below itself
+    int ancestor_id = dst_parent_id;
+    for (int depth = 0; is_dir && ancestor_id != 0 && depth < dev->num_blocks; depth++)
+    {
+        if (ancestor_id == block_id)
         {
-            return parent_dir->entries[i].block_id;
+            printf("Error: Can not move the directory %s into itself\n", src_name);
+            return -1;
         }
+        struct heartyfs_directory *ancestor = heartyfs_block(dev, ancestor_id);
+        ancestor_id = dir_parent_id(ancestor);
     }
-    return -1;
-}
 
-/*
- * @brief Creates a new entry in the specified parent directory.
- * 
- * @param superblock            The superblock structure of the filesystem.
- * @param parent_dir            The directory structure where the entry will be created.
- * @param target_name           The name of the entry to create.
- * @param target_block_id       The block ID assigned to the entry.
- * @param bitmap                The bitmap tracking the status of blocks.
- * @return int                  1 on success, -1 if the directory is full.
- */
-int create_entry(struct heartyfs_superblock *superblock, struct heartyfs_directory *parent_dir, 
-                    char *target_name, int target_block_id, uint8_t *bitmap)
-{
-    if (parent_dir->size > FILES_PER_DIR - 1)
+    int replaced_id = search_entry_in_dir(dst_parent, dst_name);
+    if (replaced_id == block_id) return 1;  // Already there
+    if (replaced_id > 1)
+    {
+        struct heartyfs_directory *replaced = heartyfs_block(dev, replaced_id);
+        if ((replaced->type == 1) != is_dir)
+        {
+            printf("Error: Can not replace %s with an entry of another type\n", dst_name);
+            return -1;
+        }
+        if (is_dir && replaced->size > 2)
+        {
+            printf("Error: Please empty the directory %s first\n", dst_name);
+            return -1;
+        }
+    }
+    else if (src_parent_id != dst_parent_id && !dir_has_room(dst_parent, dst_name))
     {
         printf("Error: The directory is full\n");
         return -1;
     }
+
+    // The usage of the entry moves with it, and the usage of a replaced entry goes away
+    long moved = heartyfs_entry_charge(dev, block_id);
+    long replaced = replaced_id > 1 ? heartyfs_entry_charge(dev, replaced_id) : 0;
+    if (src_parent_id != dst_parent_id)
+    {
+        heartyfs_charge(dev, src_parent_id, -moved);
+        if (heartyfs_quota_check(dev, dst_parent_id, moved - replaced) != 1)
+        {
+            heartyfs_charge(dev, src_parent_id, moved);
+            return -1;
+        }
+    }
+
+    // Step 1: make the entry reachable under its new name
+    int renamed_in_place = src_parent_id == dst_parent_id && replaced_id <= 1;
+    if (renamed_in_place)
+    {
+        if (dir_rename_entry(src_parent, src_name, dst_name) != 1)
+        {
+            printf("Error: The directory is full\n");
+            return -1;
+        }
+        heartyfs_dirty(dev, src_parent);
+    }
     else
     {
-        int size = parent_dir->size;
-        snprintf(parent_dir->entries[size].file_name, sizeof(parent_dir->entries[size].file_name),
-                    "%s", target_name);
-        parent_dir->entries[size].block_id = target_block_id;
-        parent_dir->size++;
-        printf("Success: Created entry %s at %s with id %d\n", parent_dir->entries[size].file_name, 
-                    parent_dir->name, parent_dir->entries[size].block_id);
+        if (replaced_id > 1)
+        {
+            dir_replace_id(dst_parent, dst_name, -1, block_id);
+            heartyfs_dirty(dev, dst_parent);
+        }
+        else if (create_entry(dev, dst_parent, dst_name, block_id) != 1)
+        {
+            heartyfs_charge(dev, src_parent_id, moved);
+            return -1;
+        }
+    }
+    if (src_parent_id != dst_parent_id) heartyfs_charge(dev, dst_parent_id, moved - replaced);
+    else heartyfs_charge(dev, dst_parent_id, -replaced);
+
+    // Step 2: the moved block follows its entry
+    if (is_dir)
+    {
+        struct heartyfs_directory *moved_dir = block;
+        snprintf(moved_dir->name, sizeof(moved_dir->name), "%s", dst_name);
+        dir_set_parent(moved_dir, dst_parent_id);
+    }
+    else heartyfs_touch(dev, block, 0);
+    heartyfs_dirty(dev, block);
+    heartyfs_dev_barrier(dev);
+
+    // Step 3: drop the old entry and whatever was replaced
+    if (!renamed_in_place)
+    {
+        remove_entry(heartyfs_block(dev, 0), dev, src_parent_id, src_name);
+    }
+    if (replaced_id > 1) heartyfs_unlink(dev, replaced_id, bitmap);
+    printf("Success: Moved %s to %s\n", src_name, dst_name);
+    return 1;
+}
+
+/*
+ * @brief Reads the attributes of one directory or inode block. Only that block is read:
+ *        this is the stat of heartyfs, cheap enough to call for every file of a tree.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the directory or inode (0 for the root directory).
+ * @param name          The name to report for it.
+ * @param info          Output: the attributes.
+ * @return int          1 on success, -1 if the block cannot be read.
+ */
+int heartyfs_entry_info(struct heartyfs_dev *dev, int block_id, char *name,
+                            struct heartyfs_entry_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->block_id = block_id;
+    snprintf(info->name, sizeof(info->name), "%s", name);
+
+    void *block = heartyfs_block(dev, block_id);
+    if (block == NULL) return -1;
+    if (block_id == 0 || *(int *) block == 1)
+    {
+        struct heartyfs_directory *dir = block_id == 0 ? ((struct heartyfs_superblock *) block)->root_dir : block;
+        info->type = 1;
+        info->size = dir->size - 2;
+        info->blocks = 1;
+        info->links = 1;
         return 1;
     }
+    struct heartyfs_inode *inode = block;
+    info->type = inode->type;
+    info->blocks = 1 + inode->size + (inode->xattr_block > 0);
+    info->links = 1 + inode->links;
+    info->size = inode->length;
+    info->mode = inode->mode;
+    info->uid = inode->uid;
+    info->gid = inode->gid;
+    info->mtime = inode->mtime;
+    info->ctime = inode->ctime;
+    return 1;
 }
 
 /*
- * @brief Removes the specified entry from a parent directory.
+ * @brief Lists a directory with the attributes of every entry in one pass, so callers never
+ *        resolve the path of each entry again. "." and ".." are skipped.
+ *
+ * @param dev           The open disk image.
+ * @param dir           The directory to list.
+ * @param infos         Output: room for DIR_MAX_ENTRIES entries.
+ * @return int          The number of entries filled in.
+ */
+int heartyfs_readdir_plus(struct heartyfs_dev *dev, struct heartyfs_directory *dir,
+                            struct heartyfs_entry_info *infos)
+{
+    // Work on a copy, reading the children may evict the directory block
+    struct heartyfs_directory listed;
+    memcpy(&listed, dir, sizeof(listed));
+
+    // Fetch every child block in one batch
+    int block_ids[DIR_MAX_ENTRIES];
+    int count = 0;
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(&listed, &cursor, 0);
+    while (count < DIR_MAX_ENTRIES && dir_next(&listed, &cursor, &entry)) block_ids[count++] = entry.block_id;
+    heartyfs_prefetch(dev, block_ids, count);
+
+    int filled = 0;
+    dir_start(&listed, &cursor, 0);
+    for (int i = 0; i < count && dir_next(&listed, &cursor, &entry); i++)
+    {
+        if (heartyfs_entry_info(dev, block_ids[i], entry.file_name, &infos[filled]) == 1)
+        {
+            filled++;
+        }
+    }
+    return filled;
+}
+
+/*
+ * @brief Initializes an empty filesystem over the whole image: the superblock, the bitmaps
+ *        with every block free, and the root directory with its "." and ".." entries.
+ *
+ * @param dev           The open disk image.
+ */
+void heartyfs_format(struct heartyfs_dev *dev)
+{
+    // Any checksum table goes away with the old contents
+    heartyfs_checksum_release(dev);
+
+    // Initialize the superblock
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    memset(superblock, 0, BLOCK_SIZE);
+    superblock->total_blocks = dev->num_blocks;
+    superblock->block_size = BLOCK_SIZE;
+    superblock->type = HEARTYFS_FORMAT_DIR_USAGE;
+    superblock->ext_block = 0;
+
+    // Initialize the bitmaps, every block but the superblock and the bitmaps is free
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    memset(bitmap, 0, (size_t) dev->block_groups * BLOCK_SIZE);
+    superblock->free_blocks = heartyfs_add_blocks(bitmap, 2, dev->num_blocks);
+
+    // Add root, ., and .. directories
+    struct heartyfs_directory *root_dir = superblock->root_dir;
+    root_dir->type = 1;
+    root_dir->size = 0;
+    snprintf(root_dir->name, sizeof(root_dir->name), "%s", "/");
+    create_entry(dev, root_dir, ".", 0);
+    create_entry(dev, root_dir, "..", 0);
+
+    if (dev->checksum) heartyfs_checksum_create(dev, bitmap);
+}
+
+/*
+ * @brief Allocates a data block and updates the inode. The block is charged to the
+ *        directories chosen with heartyfs_charge_file.
  * 
- * @param superblock            The superblock structure of the filesystem.
- * @param buffer                The memory-mapped buffer of the disk image.
- * @param parent_block_id       The block ID of the parent directory.
- * @param target_name           The name of the entry to remove.
- * @return int                  - 1 on success, -1 if the entry is not found or if the removal is denied.
+ * @param superblock Pointer to the superblock with free block info.
+ * @param dev        The open disk image.
+ * @param bitmap     Bitmap indicating block availability.
+ * @param inode      Inode needing a new data block.
+ * @param datablock  Pointer to store the address of the allocated block.
+ * 
+ * @return int       1 on success, -1 if no space, inode full or over a quota.
  */
-int remove_entry(struct heartyfs_superblock *superblock, void* buffer, 
-                    int parent_block_id, char *target_name)
+int allocate_datablock(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev, 
+                        uint8_t *bitmap, struct heartyfs_inode *inode,
+                        struct heartyfs_data_block **datablock)
 {
-    struct heartyfs_directory *parent_dir = NULL;
-    if (parent_block_id == 0) parent_dir = superblock->root_dir;
-    else parent_dir = (struct heartyfs_directory *) (buffer + BLOCK_SIZE * parent_block_id);
-    if (strcmp(target_name, ".") != 0 && strcmp(target_name, "..") != 0)
+    if (superblock->free_blocks > 0)
     {
-        for (int i = 0; i < parent_dir->size; i++)
+        if (inode->size < MAX_DATA_BLOCKS)
         {
-            if (strcmp(parent_dir->entries[i].file_name, target_name) == 0)
-            {
-                // Move the last entry to the removed entry
-                parent_dir->entries[i] = parent_dir->entries[parent_dir->size - 1];
-                parent_dir->size--;
-                printf("Success: Removed entry %s\n", target_name);
-                return 1;
-            }
+            // The directories of the file pay for the block first
+            if (heartyfs_charge_blocks(dev, 1) != 1) return -1;
+
+            // Get a new datablock
+            int free_block_id = next_free_block(dev, bitmap);
+            *datablock = heartyfs_block(dev, free_block_id);
+            inode->data_blocks[inode->size] = free_block_id;
+            inode->size++;
+            heartyfs_dirty(dev, inode);
+
+            // Mark occupied
+            superblock->free_blocks--;
+            occupy_block(free_block_id, bitmap);
+            return 1;
+        }
+        else 
+        {
+            // The data is still too large
+            printf("Error: The file is larger than %d bytes\n", 
+                    MAX_DATA_BLOCKS * DATA_BLOCK_SIZE);
+            memset(inode->data_blocks, 0, sizeof(inode->data_blocks));
+            heartyfs_dirty(dev, inode);
+            return -1;
         }
-        printf("Error: Can not find the entry %s\n", target_name);
-        return -1;
     }
     else
     {
-        printf("Denied: Refuse to remove this entry %s\n", target_name);
+        printf("There is no space left to create a datablock\n");
         return -1;
     }
 }
 
 /*
- * @brief Cleans up resources, synchronizing and unmapping the buffer, and closing the file.
- * 
- * @param buffer        The memory-mapped buffer of the disk image.
- * @param fd            The file descriptor of the disk image.
+ * @brief Appends one data block holding the given bytes to the inode. With dedup enabled
+ *        on the device, a block with identical content is shared instead of allocated.
+ *
+ * @param dev        The open disk image.
+ * @param bitmap     Bitmap indicating block availability.
+ * @param inode      Inode receiving the data.
+ * @param data       The bytes to store.
+ * @param size       Number of bytes, at most DATA_BLOCK_SIZE.
+ *
+ * @return int       1 on success, -1 if no space, inode full or over a quota.
  */
-void cleanup(void *buffer, int fd) 
+int write_datablock(struct heartyfs_dev *dev, uint8_t *bitmap, struct heartyfs_inode *inode,
+                        char *data, int size)
 {
-    if (buffer != NULL) {
-        msync(buffer, DISK_SIZE, MS_SYNC); // Sync changes to the file
-        munmap(buffer, DISK_SIZE);         // Unmap the memory
-    }
-    if (fd >= 0) {
-        close(fd);                    // Close the file descriptor
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+
+    // Build the block content first so it can be hashed
+    struct heartyfs_data_block content;
+    memset(&content, 0, sizeof(content));
+    memcpy(content.name, data, size);
+    content.size = size;
+
+    if (dev->dedup && inode->size < MAX_DATA_BLOCKS)
+    {
+        int shared_block_id = heartyfs_dedup_lookup(dev, &content);
+        if (shared_block_id > 0)
+        {
+            if (heartyfs_charge_blocks(dev, 1) != 1) return -1;
+            share_add(dev, shared_block_id, 1);
+            dev->stats.dedup_shared++;
+            inode->data_blocks[inode->size] = shared_block_id;
+            inode->size++;
+            heartyfs_dirty(dev, inode);
+            return 1;
+        }
     }
-}
\ No newline at end of file
+
+    struct heartyfs_data_block *datablock = NULL;
+    if (allocate_datablock(superblock, dev, bitmap, inode, &datablock) != 1) return -1;
+    memcpy(datablock, &content, sizeof(content));
+    heartyfs_dirty(dev, datablock);
+    if (dev->dedup) heartyfs_dedup_insert(dev, inode->data_blocks[inode->size - 1], datablock, bitmap);
+    return 1;
+}
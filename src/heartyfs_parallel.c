@@ -0,0 +1,264 @@
+/*
+ * heartyfs_parallel.c
+ *
+ * Brief
+ * - This program provides a parallel read of one file. The data blocks of the file are split
+ *   into ranges that a few threads read, verify and decode at once, and each thread writes its
+ *   part of the file at the right offset of the output with `pwrite`.
+ *
+ * Data Structures:
+ * - Block buffer: The data blocks of the file, in file order, BLOCK_SIZE bytes each. A file
+ *   has at most MAX_DATA_BLOCKS blocks, so the whole file fits in memory.
+ * - `read_span`: One unit of the file (a plain data block, or all blocks of a compressed
+ *   frame) with its position in the output.
+ * - `read_worker`: The range of blocks, then of spans, given to one thread.
+ *
+ * Design Decisions:
+ * - Threads never touch the block cache, which is not thread safe. They read the image with
+ *   `pread` over runs of consecutive block ids, so a defragmented file is read with one call
+ *   per thread, and only read the loaded checksum table.
+ * - Two passes: the threads first load and verify their blocks; the main thread then walks
+ *   the block sizes and frame headers, which is cheap, to place every unit; the threads then
+ *   decode and write their units. Units are split by count, so decompression is spread too.
+ * - Small files are read on the calling thread; a thread is only worth it for at least
+ *   PARALLEL_MIN_BLOCKS blocks.
+ * - The image must be up to date on disk: callers that modified blocks flush first.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+#include <pthread.h>
+
+#define PARALLEL_MAX_THREADS 16
+#define PARALLEL_MIN_BLOCKS 16
+
+struct read_span
+{
+    int first;              // Index of the first data block of the unit
+    int blocks;             // Data blocks of the unit
+    long offset;            // Where the unit goes in the output
+};
+
+struct read_worker
+{
+    struct heartyfs_dev *dev;
+    struct heartyfs_inode *inode;   // Private copy of the inode
+    uint8_t *blocks;        // Block buffer shared by all workers, each fills its own range
+    struct read_span *spans;
+    int first;              // First block (pass 1) or span (pass 2) of the range
+    int last;               // One past the last one
+    int out_fd;             // Output file
+    long verified;          // Blocks checked against their checksum
+    int bad_block;          // First block that failed its checksum, -1 if none
+    int bad_count;          // Blocks that failed it
+    int failed;             // 1 on an I/O error or corrupt data
+    pthread_t thread;
+};
+
+/*
+ * @brief Pass 1: reads and verifies one range of data blocks into the block buffer.
+ */
+static void *load_blocks(void *arg)
+{
+    struct read_worker *worker = arg;
+    struct heartyfs_dev *dev = worker->dev;
+    int *ids = worker->inode->data_blocks;
+    int i = worker->first;
+    while (i < worker->last && !worker->failed)
+    {
+        int run = 1;
+        while (i + run < worker->last && ids[i + run] == ids[i] + run) run++;
+        if (ids[i] < 2 || ids[i] + run > dev->num_blocks
+                || pread(dev->fd, worker->blocks + (size_t) i * BLOCK_SIZE, (size_t) run * BLOCK_SIZE,
+                            (off_t) ids[i] * BLOCK_SIZE) != (ssize_t) run * BLOCK_SIZE)
+        {
+            worker->failed = 1;
+            break;
+        }
+        for (int j = i; j < i + run && dev->checksums != NULL; j++)
+        {
+            uint32_t expected = dev->checksums[ids[j]];
+            if (expected == 0) continue;
+            worker->verified++;
+            if (heartyfs_crc32c(worker->blocks + (size_t) j * BLOCK_SIZE, BLOCK_SIZE) != expected)
+            {
+                if (worker->bad_count++ == 0) worker->bad_block = ids[j];
+            }
+        }
+        i += run;
+    }
+    return NULL;
+}
+
+/*
+ * @brief Pass 2: decodes one range of units and writes each at its offset of the output.
+ */
+static void *write_spans(void *arg)
+{
+    struct read_worker *worker = arg;
+    int compressed = worker->inode->type & INODE_FLAG_COMPRESSED;
+    char *out = malloc(COMPRESS_UNIT_SIZE);
+    char *frame = malloc(COMPRESS_SCRATCH_SIZE);
+    if (out == NULL || frame == NULL) worker->failed = 1;
+
+    for (int s = worker->first; s < worker->last && !worker->failed; s++)
+    {
+        struct read_span *span = &worker->spans[s];
+        struct heartyfs_data_block *datablock =
+            (struct heartyfs_data_block *) (worker->blocks + (size_t) span->first * BLOCK_SIZE);
+        char *data = datablock->name;
+        int size = datablock->size;
+        if (compressed)
+        {
+            int gathered = 0;
+            for (int b = span->first; b < span->first + span->blocks; b++)
+            {
+                datablock = (struct heartyfs_data_block *) (worker->blocks + (size_t) b * BLOCK_SIZE);
+                memcpy(frame + gathered, datablock->name, datablock->size);
+                gathered += datablock->size;
+            }
+            size = decode_frame(frame, out);
+            data = out;
+        }
+        if (size < 0 || pwrite(worker->out_fd, data, size, span->offset) != size) worker->failed = 1;
+    }
+    free(out);
+    free(frame);
+    return NULL;
+}
+
+/*
+ * @brief Runs one pass over `count` items split evenly between the workers.
+ *
+ * @return int          1 if every worker succeeded, -1 otherwise.
+ */
+static int run_pass(struct read_worker *workers, int threads, int count, void *(*pass)(void *))
+{
+    int per_thread = (count + threads - 1) / threads;
+    int started = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].first = t * per_thread < count ? t * per_thread : count;
+        workers[t].last = workers[t].first + per_thread < count ? workers[t].first + per_thread : count;
+        if (t == 0 || pthread_create(&workers[t].thread, NULL, pass, &workers[t]) != 0)
+        {
+            if (t > 0) workers[t].failed = 1;
+            continue;
+        }
+        started |= 1 << t;
+    }
+    pass(&workers[0]);      // The calling thread takes the first range
+    int status = 1;
+    for (int t = 0; t < threads; t++)
+    {
+        if (started & (1 << t)) pthread_join(workers[t].thread, NULL);
+        if (workers[t].failed) status = -1;
+    }
+    return status;
+}
+
+/*
+ * @brief Places every unit of the file in the output, from the sizes and frame headers in
+ *        the block buffer.
+ *
+ * @param inode         The copy of the inode.
+ * @param blocks        The block buffer.
+ * @param spans         Output array of inode->size entries.
+ * @param total         Output: the length of the file.
+ * @return int          Number of units, or -1 if the data is corrupt.
+ */
+static int place_spans(struct heartyfs_inode *inode, uint8_t *blocks, struct read_span *spans, long *total)
+{
+    int count = 0;
+    int index = 0;
+    *total = 0;
+    while (index < inode->size)
+    {
+        struct heartyfs_data_block *datablock =
+            (struct heartyfs_data_block *) (blocks + (size_t) index * BLOCK_SIZE);
+        if (datablock->size < 0 || datablock->size > DATA_BLOCK_SIZE) return -1;
+        spans[count].first = index;
+        spans[count].offset = *total;
+        if (!(inode->type & INODE_FLAG_COMPRESSED))
+        {
+            spans[count++].blocks = 1;
+            *total += datablock->size;
+            index++;
+            continue;
+        }
+
+        int frame_size = frame_size_of(datablock);
+        if (frame_size < 0) return -1;
+        struct heartyfs_frame_header header;
+        memcpy(&header, datablock->name, sizeof(header));
+        int gathered = 0;
+        while (gathered < frame_size)
+        {
+            if (index >= inode->size) return -1;
+            datablock = (struct heartyfs_data_block *) (blocks + (size_t) index * BLOCK_SIZE);
+            if (datablock->size <= 0 || gathered + datablock->size > frame_size) return -1;
+            gathered += datablock->size;
+            index++;
+        }
+        spans[count].blocks = index - spans[count].first;
+        count++;
+        *total += header.raw_size;
+    }
+    return count;
+}
+
+/*
+ * @brief Reads a whole file into a host file descriptor with up to `threads` threads.
+ *
+ * @param dev           The open disk image, flushed if this process modified it.
+ * @param block_id      The inode block of the file.
+ * @param out_fd        The output, written with pwrite from offset 0.
+ * @param threads       Most threads to use.
+ * @return long         Bytes written, or -1 on an I/O error or corrupt data.
+ */
+long heartyfs_read_parallel(struct heartyfs_dev *dev, int block_id, int out_fd, int threads)
+{
+    struct heartyfs_inode inode;
+    struct heartyfs_inode *stored = heartyfs_block(dev, block_id);
+    if (stored == NULL) return -1;
+    memcpy(&inode, stored, sizeof(inode));
+    if (inode.size > MAX_DATA_BLOCKS) return -1;
+    if (inode.size == 0) return 0;
+
+    if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+    if (threads > inode.size / PARALLEL_MIN_BLOCKS) threads = inode.size / PARALLEL_MIN_BLOCKS;
+    if (threads < 1) threads = 1;
+
+    uint8_t *blocks = malloc((size_t) inode.size * BLOCK_SIZE);
+    struct read_span *spans = malloc(inode.size * sizeof(*spans));
+    struct read_worker workers[PARALLEL_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].dev = dev;
+        workers[t].inode = &inode;
+        workers[t].blocks = blocks;
+        workers[t].spans = spans;
+        workers[t].out_fd = out_fd;
+        workers[t].bad_block = -1;
+    }
+
+    long total = -1;
+    int status = blocks != NULL && spans != NULL ? run_pass(workers, threads, inode.size, load_blocks) : -1;
+    for (int t = 0; t < threads; t++)
+    {
+        dev->stats.checksum_verified += workers[t].verified;
+        dev->stats.checksum_errors += workers[t].bad_count;
+        if (workers[t].bad_count > 0)
+        {
+            printf("Error: Block %d does not match its checksum\n", workers[t].bad_block);
+        }
+    }
+    int count = status == 1 ? place_spans(&inode, blocks, spans, &total) : -1;
+    if (count < 0 || run_pass(workers, threads, count, write_spans) != 1) total = -1;
+
+    free(blocks);
+    free(spans);
+    return total;
+}
@@ -0,0 +1,246 @@
+/*
+ * heartyfs_quota.c
+ *
+ * Brief
+ * - This program keeps the space used by every directory subtree, and enforces the optional
+ *   quota of a directory on everything below it. Both are kept up to date on every change,
+ *   so the usage of a subtree and a quota check are read from one directory block.
+ *
+ * Data Structures:
+ * - `heartyfs_directory`: used_blocks and quota_blocks, in the header of every directory.
+ * - `dev->charge_dirs`: The directories holding the names of the file being written; blocks
+ *   added to or dropped from the file are charged to each of them.
+ *
+ * Design Decisions:
+ * - A directory is charged its own block, one block per file name, the data blocks of each
+ *   file, and what its subdirectories are charged. The root directory lives in the
+ *   superblock, so its own block is not counted.
+ * - Usage is logical: a file is charged in full to each of its names, and blocks shared with
+ *   a snapshot or by dedup are charged to every file using them. Snapshots keep the usage of
+ *   the tree at the time they were taken.
+ * - A change is charged to the directory it happens in and to every directory up the ".."
+ *   chain. Writers resolved that chain as private to the live tree, so no snapshot sees it.
+ * - A snapshot root is a copy of the root directory, so it is not charged its own block either.
+ * - Quotas are checked before a block is taken: creating an entry, linking, moving into a
+ *   directory, and allocate_datablock. A quota below the current usage only refuses growth.
+ * - Images made before the counters have the directory name where they now are. They are
+ *   counted once, and the names shortened, the first time the image is opened (see
+ *   heartyfs_usage_upgrade).
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+/*
+ * @brief Returns a directory block, the root directory for block 0.
+ */
+static struct heartyfs_directory *charged_dir(struct heartyfs_dev *dev, int dir_id)
+{
+    if (dir_id == 0) return ((struct heartyfs_superblock *) heartyfs_block(dev, 0))->root_dir;
+    struct heartyfs_directory *dir = heartyfs_block(dev, dir_id);
+    return dir != NULL && dir->type == 1 ? dir : NULL;
+}
+
+/*
+ * @brief Returns the blocks one name of an entry is charged: the usage of a directory, or
+ *        the inode, data and xattr blocks of a file.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the directory or inode.
+ * @return long         The number of blocks.
+ */
+long heartyfs_entry_charge(struct heartyfs_dev *dev, int block_id)
+{
+    void *block = heartyfs_block(dev, block_id);
+    if (block == NULL) return 0;
+    if (*(int *) block == 1) return ((struct heartyfs_directory *) block)->used_blocks;
+    struct heartyfs_inode *inode = block;
+    return 1 + inode->size + (inode->xattr_block > 0);
+}
+
+/*
+ * @brief Checks that delta more blocks fit under the quota of a directory and of every
+ *        directory above it.
+ *
+ * @param dev           The open disk image.
+ * @param dir_id        The directory receiving the blocks.
+ * @param delta         Number of blocks.
+ * @return int          1 if they fit, -1 if a quota would be exceeded.
+ */
+int heartyfs_quota_check(struct heartyfs_dev *dev, int dir_id, long delta)
+{
+    for (int depth = 0; delta > 0 && depth < dev->num_blocks; depth++)
+    {
+        struct heartyfs_directory *dir = charged_dir(dev, dir_id);
+        if (dir == NULL) break;
+        if (dir->quota_blocks > 0 && dir->used_blocks + delta > dir->quota_blocks)
+        {
+            printf("Error: The quota of %s is exceeded, %d of %d blocks used\n",
+                    dir->name, dir->used_blocks, dir->quota_blocks);
+            dev->stats.quota_denied++;
+            return -1;
+        }
+        int parent_id = dir_parent_id(dir);
+        if (dir_id == 0 || parent_id == dir_id) break;
+        dir_id = parent_id;
+    }
+    return 1;
+}
+
+/*
+ * @brief Adds delta blocks to the usage of a directory and of every directory above it.
+ *
+ * @param dev           The open disk image.
+ * @param dir_id        The directory where the change happened, private to the live tree.
+ * @param delta         Number of blocks, negative when they are released.
+ */
+void heartyfs_charge(struct heartyfs_dev *dev, int dir_id, long delta)
+{
+    for (int depth = 0; delta != 0 && depth < dev->num_blocks; depth++)
+    {
+        struct heartyfs_directory *dir = charged_dir(dev, dir_id);
+        if (dir == NULL) break;
+        dir->used_blocks += delta;
+        heartyfs_dirty(dev, dir);
+        int parent_id = dir_parent_id(dir);
+        if (dir_id == 0 || parent_id == dir_id) break;
+        dir_id = parent_id;
+    }
+}
+
+/*
+ * @brief Chooses the directories charged while a file is written: its parent, or, for a file
+ *        with hard links, the directory of every live name. Ends with heartyfs_charge_clear.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode of the file, private to the live tree.
+ * @param parent_id     The directory the file was reached through.
+ * @return int          1 on success, -1 if out of memory.
+ */
+int heartyfs_charge_file(struct heartyfs_dev *dev, int block_id, int parent_id)
+{
+    heartyfs_charge_clear(dev);
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    int names = inode->links + 1;
+    dev->charge_dirs = malloc(names * sizeof(int));
+    if (dev->charge_dirs == NULL) return -1;
+    if (names == 1)
+    {
+        dev->charge_dirs[dev->charge_count++] = parent_id;
+        return 1;
+    }
+
+    char (*paths)[PATH_MAX] = malloc(names * PATH_MAX);
+    int found = paths != NULL ? heartyfs_find_names(dev, block_id, paths, names) : -1;
+    for (int i = 0; i < found; i++)
+    {
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        struct heartyfs_directory *parent_dir = superblock->root_dir;
+        char file_name[FILENAME_MAX];
+        if (dir_string_check(paths[i], file_name, dev, &parent_dir, NULL) == 1)
+        {
+            dev->charge_dirs[dev->charge_count++] = dir_self_id(parent_dir);
+        }
+        heartyfs_unpin(dev, parent_dir);    // Only its id is kept
+    }
+    free(paths);
+    return found < 0 ? -1 : 1;
+}
+
+/*
+ * @brief Charges blocks added to or dropped from the file chosen by heartyfs_charge_file.
+ *        Does nothing when no file was chosen.
+ *
+ * @param dev           The open disk image.
+ * @param delta         Number of blocks, negative when they are released.
+ * @return int          1 on success, -1 if a quota refused the blocks; nothing is charged then.
+ */
+int heartyfs_charge_blocks(struct heartyfs_dev *dev, int delta)
+{
+    for (int i = 0; i < dev->charge_count; i++)
+    {
+        if (heartyfs_quota_check(dev, dev->charge_dirs[i], delta) != 1) return -1;
+    }
+    for (int i = 0; i < dev->charge_count; i++) heartyfs_charge(dev, dev->charge_dirs[i], delta);
+    return 1;
+}
+
+/*
+ * @brief Ends the charging started by heartyfs_charge_file.
+ */
+void heartyfs_charge_clear(struct heartyfs_dev *dev)
+{
+    free(dev->charge_dirs);
+    dev->charge_dirs = NULL;
+    dev->charge_count = 0;
+}
+
+/*
+ * @brief Counts the usage of a directory subtree into its header, and of every directory
+ *        below it.
+ *
+ * @param dev           The open disk image.
+ * @param dir_id        The directory.
+ * @param counted       Usage of each directory block already counted, -1 if not yet.
+ * @return long         The usage of the directory.
+ */
+static long count_usage(struct heartyfs_dev *dev, int dir_id, long *counted)
+{
+    if (counted[dir_id] >= 0) return counted[dir_id];
+    counted[dir_id] = 0;    // Guards corrupt trees with cycles
+
+    // The name loses the bytes that now hold the counters
+    struct heartyfs_directory *dir = charged_dir(dev, dir_id);
+    if (dir == NULL) return 0;
+    dir->name[DIR_NAME_SIZE - 1] = '\0';
+
+    // Work on a copy, counting the children may evict the directory block
+    struct heartyfs_directory listed;
+    memcpy(&listed, dir, sizeof(listed));
+    long used = dir_id == 0 || dir_parent_id(&listed) == dir_id ? 0 : 1;   // Roots and snapshot roots
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(&listed, &cursor, 0);
+    while (dir_next(&listed, &cursor, &entry))
+    {
+        if (entry.block_id <= 1 || entry.block_id >= dev->num_blocks) continue;
+        if (charged_dir(dev, entry.block_id) != NULL) used += count_usage(dev, entry.block_id, counted);
+        else used += heartyfs_entry_charge(dev, entry.block_id);
+    }
+
+    dir = charged_dir(dev, dir_id);
+    dir->used_blocks = used;
+    dir->quota_blocks = 0;
+    heartyfs_dirty(dev, dir);
+    counted[dir_id] = used;
+    return used;
+}
+
+/*
+ * @brief Fills in the usage of every directory of an image made before the counters, in the
+ *        live tree and in the snapshots. Does nothing on an image already converted.
+ *
+ * @param dev           The open disk image, with inode metadata.
+ * @return int          1 on success, -1 if out of memory.
+ */
+int heartyfs_usage_upgrade(struct heartyfs_dev *dev)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    if (superblock->type >= HEARTYFS_FORMAT_DIR_USAGE || superblock->root_dir->name[0] == '\0') return 1;
+    long *counted = malloc(dev->num_blocks * sizeof(long));
+    if (counted == NULL) return -1;
+    for (int i = 0; i < dev->num_blocks; i++) counted[i] = -1;
+    count_usage(dev, 0, counted);
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext != NULL && ext->snapshot_dir > 1 && ext->snapshot_dir < dev->num_blocks)
+    {
+        count_usage(dev, ext->snapshot_dir, counted);
+    }
+    free(counted);
+
+    superblock = heartyfs_block(dev, 0);
+    superblock->type = HEARTYFS_FORMAT_DIR_USAGE;
+    heartyfs_dirty(dev, superblock);
+    return 1;
+}
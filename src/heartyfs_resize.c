@@ -0,0 +1,135 @@
+/*
+ * heartyfs_resize.c
+ *
+ * Brief
+ * - This program grows a file system into a larger image file. heartyfs_resize only extends
+ *   the file; the process holding the image adds the new blocks: the next tool opening it,
+ *   or a mounted FUSE daemon at its next operation.
+ *
+ * Data Structures:
+ * - Block groups: BLOCK_GROUP_SIZE blocks covered by one bitmap block. Group 0 keeps its
+ *   bitmap in block 1, every other group in its own first block (see heartyfs_dev.c).
+ * - `superblock->total_blocks`: The blocks the file system covers, which may be fewer than
+ *   the blocks of the file until it is grown.
+ *
+ * Design Decisions:
+ * - Nothing already on the image moves. New blocks are marked free in the bitmaps, the
+ *   bitmap blocks of new groups are marked used, and total_blocks and free_blocks grow.
+ * - Tables sized by the number of blocks follow: the checksum table is moved to a free run
+ *   large enough for the new size, and the share count table gets the blocks it now needs.
+ *   If no run is large enough for the checksum table, it is dropped with an error and can be
+ *   added again with HEARTYFS_CHECKSUM=1.
+ * - Images only grow, up to HEARTYFS_MAX_BLOCKS, the blocks the share count table can cover.
+ * - Growing is checked with one fstat, so a long-running process can check before each
+ *   operation and pick up a new size without being restarted.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+
+#include "heartyfs.h"
+
+/*
+ * @brief Marks a range of new blocks free, except the bitmap blocks of their block groups.
+ *
+ * @param bitmap        The bitmap tracking the status of blocks, covering the range.
+ * @param first         The first block of the range.
+ * @param last          One past the last block of the range.
+ * @return int          The number of blocks marked free.
+ */
+int heartyfs_add_blocks(uint8_t *bitmap, int first, int last)
+{
+    int added = 0;
+    for (int block_id = first; block_id < last; block_id++)
+    {
+        if (block_id % BLOCK_GROUP_SIZE == 0) occupy_block(block_id, bitmap);
+        else
+        {
+            free_block(block_id, bitmap);
+            added++;
+        }
+    }
+    return added;
+}
+
+/*
+ * @brief Moves the checksum table to a run of free blocks large enough for the image, or
+ *        drops it when there is none.
+ *
+ * @param dev           The open disk image, already grown.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ */
+static void move_checksum_table(struct heartyfs_dev *dev, uint8_t *bitmap)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->checksum_start <= 0) return;
+    int blocks = (dev->num_blocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (ext->checksum_blocks >= blocks) return;
+
+    // The table lives in memory, so only its blocks change
+    int old_start = ext->checksum_start;
+    int old_blocks = ext->checksum_blocks;
+    int start = find_free_run(dev, bitmap, blocks);
+    if (start > 0)
+    {
+        for (int i = 0; i < blocks; i++) occupy_block(start + i, bitmap);
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        superblock->free_blocks -= blocks;
+        if (dev->checksums != NULL)
+        {
+            for (int i = 0; i < blocks; i++) dev->checksums[start + i] = 0;    // Never covered
+            dev->checksums_changed = 1;
+        }
+    }
+    else
+    {
+        printf("Error: There is no room to move the checksum table, it was dropped\n");
+        heartyfs_checksum_release(dev);
+    }
+    ext = heartyfs_get_ext(dev, NULL);
+    ext->checksum_start = start > 0 ? start : 0;
+    ext->checksum_blocks = start > 0 ? blocks : 0;
+    heartyfs_dirty(dev, ext);
+    for (int i = 0; i < old_blocks; i++) give_block(dev, old_start + i, bitmap);
+}
+
+/*
+ * @brief Adds the blocks of a grown image file to the file system. Does nothing when the
+ *        file did not grow or the image is not initialized. No block pointer of the device
+ *        may be used across this call.
+ *
+ * @param dev           The open disk image.
+ * @return int          The number of blocks added, or -1 on failure.
+ */
+int heartyfs_grow(struct heartyfs_dev *dev)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    struct stat st;
+    if (superblock->root_dir->name[0] == '\0' || fstat(dev->fd, &st) < 0) return 0;
+    long file_blocks = st.st_size / BLOCK_SIZE;
+    int num_blocks = file_blocks < HEARTYFS_MAX_BLOCKS ? file_blocks : HEARTYFS_MAX_BLOCKS;
+    int old_blocks = superblock->total_blocks;
+    if (num_blocks <= old_blocks) return 0;
+    if (heartyfs_dev_remap(dev, num_blocks) < 0) return -1;
+
+    // New bitmap blocks start out with every block used
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    int old_groups = (old_blocks + BLOCK_GROUP_SIZE - 1) / BLOCK_GROUP_SIZE;
+    for (int group = old_groups; group < dev->block_groups; group++)
+    {
+        memset(bitmap + (size_t) group * BLOCK_SIZE, 0, BLOCK_SIZE);
+    }
+    int added = heartyfs_add_blocks(bitmap, old_blocks, num_blocks);
+    superblock = heartyfs_block(dev, 0);
+    superblock->total_blocks = num_blocks;
+    superblock->free_blocks += added;
+
+    // Tables with an entry per block follow the new size
+    move_checksum_table(dev, bitmap);
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext != NULL && ext->refcount_blocks[0] > 0 && create_share_table(dev, ext, bitmap) < 0)
+    {
+        printf("Error: Cannot extend the share count table\n");
+        return -1;
+    }
+    return num_blocks - old_blocks;
+}
@@ -0,0 +1,326 @@
+/*
+ * heartyfs_defrag.c
+ *
+ * Brief
+ * - This program moves the data blocks of fragmented files into contiguous free runs, so a
+ *   file can be read back with a few long reads instead of one read per block. It prints a
+ *   fragmentation score of the live tree before and after.
+ *
+ *       bin/heartyfs_defrag              # defragment at the default rate
+ *       bin/heartyfs_defrag 0            # as fast as possible
+ *       bin/heartyfs_defrag -n           # only print the score
+ *
+ * Data Structures:
+ * - `frag_score`: Counters over every file of the live tree. A break is a data block that does
+ *   not follow the previous one on disk; the score is breaks / (blocks - 1) over all files,
+ *   0% when every file is one run and 100% when no two blocks are neighbours.
+ * - Tried map: One byte per block, set once an inode was relocated or skipped, so every file
+ *   is handled at most once.
+ *
+ * Design Decisions:
+ * - A file is moved whole: its blocks are copied into the lowest free run long enough for all
+ *   of them, the copies and their bitmap bits are synced, then the inode is rewritten with the
+ *   new block ids in one block write and synced, and only then are the old blocks freed. A
+ *   crash at any point leaves the file on its old or its new blocks, at worst with leaked blocks.
+ * - Files with a data block shared with another file (dedup or a snapshot) are skipped, since
+ *   moving the block would need every owner rewritten. The dedup index follows the blocks
+ *   that move. Files that exist only inside snapshots are not visited.
+ * - Throttled by a rate in blocks per second (DEFRAG_DEFAULT_RATE unless given). After each
+ *   batch the image lock is dropped and the tool sleeps, so other tools can run in between;
+ *   the tree is walked again after every batch since they may have changed it.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <time.h>
+
+#define DEFRAG_DEFAULT_RATE 1024    // Blocks moved per second
+#define DEFRAG_BATCHES_PER_SECOND 10
+
+struct frag_score
+{
+    int files;              // Files with at least one data block
+    int fragmented;         // Files made of more than one run
+    int blocks;             // Data blocks of those files
+    int breaks;             // Data blocks that do not follow the previous one
+};
+
+/*
+ * @brief Counts the data blocks of an inode that do not follow the previous one.
+ */
+int count_breaks(struct heartyfs_inode *inode)
+{
+    int breaks = 0;
+    for (int i = 1; i < inode->size && i < MAX_DATA_BLOCKS; i++)
+    {
+        if (inode->data_blocks[i] != inode->data_blocks[i - 1] + 1) breaks++;
+    }
+    return breaks;
+}
+
+/*
+ * @brief Collects the inode blocks of every file in the live tree, each one once.
+ *
+ * @param dev           The open disk image.
+ * @param inodes        Output array of num_blocks entries.
+ * @return int          The number of inodes found, or -1 if out of memory.
+ */
+int collect_files(struct heartyfs_dev *dev, int *inodes)
+{
+    uint8_t *seen = calloc(dev->num_blocks, 1);
+    int *stack = malloc(dev->num_blocks * sizeof(int));
+    if (seen == NULL || stack == NULL)
+    {
+        free(seen);
+        free(stack);
+        return -1;
+    }
+
+    int top = 0;
+    int count = 0;
+    stack[top++] = 0;
+    seen[0] = 1;
+    while (top > 0)
+    {
+        int dir_id = stack[--top];
+        struct heartyfs_directory listed;
+        struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+        memcpy(&listed, dir_id == 0 ? superblock->root_dir : heartyfs_block(dev, dir_id), sizeof(listed));
+
+        struct heartyfs_dir_cursor cursor;
+        struct heartyfs_dir_entry entry;
+        dir_start(&listed, &cursor, 0);
+        while (dir_next(&listed, &cursor, &entry))
+        {
+            int child_id = entry.block_id;
+            if (child_id < 2 || child_id >= dev->num_blocks || seen[child_id]) continue;
+            seen[child_id] = 1;     // Hard links and corrupt cycles are visited once
+            if (*(int *) heartyfs_block(dev, child_id) == 1) stack[top++] = child_id;
+            else inodes[count++] = child_id;
+        }
+    }
+    free(seen);
+    free(stack);
+    return count;
+}
+
+/*
+ * @brief Scores the fragmentation of every file in the live tree.
+ *
+ * @param dev           The open disk image.
+ * @param score         Output counters.
+ * @return int          1 on success, -1 if out of memory.
+ */
+int measure(struct heartyfs_dev *dev, struct frag_score *score)
+{
+    memset(score, 0, sizeof(*score));
+    int *inodes = malloc(dev->num_blocks * sizeof(int));
+    int count = inodes == NULL ? -1 : collect_files(dev, inodes);
+    for (int i = 0; i < count; i++)
+    {
+        struct heartyfs_inode *inode = heartyfs_block(dev, inodes[i]);
+        if (inode->size <= 0) continue;
+        int breaks = count_breaks(inode);
+        score->files++;
+        score->blocks += inode->size;
+        score->breaks += breaks;
+        if (breaks > 0) score->fragmented++;
+    }
+    free(inodes);
+    return count < 0 ? -1 : 1;
+}
+
+/*
+ * @brief Prints a fragmentation score.
+ */
+void print_score(char *when, struct frag_score *score)
+{
+    int transitions = score->blocks - score->files;
+    printf("Fragmentation %s: files=%d fragmented=%d extents=%d score=%.1f%%\n", when,
+            score->files, score->fragmented, score->files + score->breaks,
+            transitions > 0 ? 100.0 * score->breaks / transitions : 0.0);
+}
+
+/*
+ * @brief Moves the data blocks of one file into a contiguous free run.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @param inode_id      The inode block of the file.
+ * @return int          Blocks moved, 0 if the file is not fragmented, -1 if a block is shared,
+ *                      -2 if there is no free run long enough, -3 on I/O error.
+ */
+int relocate_file(struct heartyfs_dev *dev, uint8_t *bitmap, int inode_id)
+{
+    struct heartyfs_superblock *superblock = heartyfs_block(dev, 0);
+    struct heartyfs_inode inode;
+    memcpy(&inode, heartyfs_block(dev, inode_id), sizeof(inode));
+    if (inode.size < 2 || inode.size > MAX_DATA_BLOCKS || count_breaks(&inode) == 0) return 0;
+    for (int i = 0; i < inode.size; i++)
+    {
+        if (share_count(dev, inode.data_blocks[i]) > 0) return -1;
+    }
+    int start = find_free_run(dev, bitmap, inode.size);
+    if (start < 0) return -2;
+
+    // Copy every block first; the inode still points at the old ones
+    uint8_t data[BLOCK_SIZE];
+    for (int i = 0; i < inode.size; i++)
+    {
+        memcpy(data, heartyfs_block(dev, inode.data_blocks[i]), BLOCK_SIZE);
+        occupy_block(start + i, bitmap);
+        superblock->free_blocks--;
+        void *copy = heartyfs_block(dev, start + i);
+        memcpy(copy, data, BLOCK_SIZE);
+        heartyfs_dirty(dev, copy);
+    }
+    if (heartyfs_dev_flush(dev) < 0) return -3;
+
+    // Switch the file over in a single block write
+    struct heartyfs_inode *target = heartyfs_block(dev, inode_id);
+    for (int i = 0; i < inode.size; i++) target->data_blocks[i] = start + i;
+    heartyfs_dirty(dev, target);
+    if (heartyfs_dev_flush(dev) < 0) return -3;
+
+    // Free the old blocks, moving their dedup index entries along
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    int indexed = ext != NULL && ext->dedup_blocks[0] > 0;
+    for (int i = 0; i < inode.size; i++)
+    {
+        heartyfs_dedup_remove(dev, inode.data_blocks[i]);
+        if (indexed)
+        {
+            memcpy(data, heartyfs_block(dev, start + i), BLOCK_SIZE);
+            heartyfs_dedup_insert(dev, start + i, (struct heartyfs_data_block *) data, bitmap);
+        }
+        give_block(dev, inode.data_blocks[i], bitmap);
+    }
+    return inode.size;
+}
+
+/*
+ * @brief Relocates fragmented files until about `budget` blocks were moved.
+ *
+ * @param dev           The open disk image.
+ * @param tried         One byte per block, set for inodes already handled.
+ * @param budget        Blocks to move in this batch, or 0 for no limit.
+ * @param counters      Output: [0] files moved, [1] blocks moved, [2] shared, [3] no room.
+ * @return int          1 if files are left for another batch, 0 when done, -1 on failure.
+ */
+int defrag_batch(struct heartyfs_dev *dev, uint8_t *tried, int budget, int *counters)
+{
+    uint8_t *bitmap = heartyfs_block(dev, 1);
+    int *inodes = malloc(dev->num_blocks * sizeof(int));
+    int count = inodes == NULL ? -1 : collect_files(dev, inodes);
+    if (count < 0)
+    {
+        free(inodes);
+        return -1;
+    }
+
+    int moved = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (tried[inodes[i]]) continue;
+        if (budget > 0 && moved >= budget)
+        {
+            free(inodes);
+            return 1;
+        }
+        tried[inodes[i]] = 1;
+        int result = relocate_file(dev, bitmap, inodes[i]);
+        if (result > 0)
+        {
+            counters[0]++;
+            counters[1] += result;
+            moved += result;
+        }
+        else if (result == -1) counters[2]++;
+        else if (result == -2) counters[3]++;
+        else if (result == -3)
+        {
+            free(inodes);
+            return -1;
+        }
+    }
+    free(inodes);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_defrag\n");
+
+    // Validate the command
+    int report_only = argc > 1 && strcmp(argv[1], "-n") == 0;
+    int rate = argc > 1 && !report_only ? atoi(argv[1]) : DEFRAG_DEFAULT_RATE;
+    if (rate < 0)
+    {
+        printf("Usage: filename [-n | blocks_per_second]\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    struct frag_score score;
+    uint8_t *tried = calloc(HEARTYFS_MAX_BLOCKS, 1);  // The image may grow between batches
+    if (tried == NULL || measure(&dev, &score) != 1)
+    {
+        free(tried);
+        heartyfs_dev_close(&dev);
+        printf("Error: Not enough memory to walk the file system\n");
+        exit(1);
+    }
+    print_score("before", &score);
+    if (report_only)
+    {
+        free(tried);
+        heartyfs_dev_close(&dev);
+        return 0;
+    }
+
+    // Move one batch per tick, letting other tools in between batches
+    int budget = rate > 0 ? (rate + DEFRAG_BATCHES_PER_SECOND - 1) / DEFRAG_BATCHES_PER_SECOND : 0;
+    int counters[4] = {0, 0, 0, 0};
+    int status;
+    while ((status = defrag_batch(&dev, tried, budget, counters)) == 1)
+    {
+        if (heartyfs_dev_unlock(&dev) < 0) status = -1;
+        struct timespec pause = {0, 1000000000L / DEFRAG_BATCHES_PER_SECOND};
+        nanosleep(&pause, NULL);
+        if (status < 0 || heartyfs_dev_lock(&dev) < 0)
+        {
+            status = -1;
+            break;
+        }
+    }
+
+    if (status < 0) printf("Error: Defragmentation stopped after %d files\n", counters[0]);
+    else
+    {
+        printf("Success: Moved %d files (%d blocks), skipped %d shared and %d without a free run\n",
+                counters[0], counters[1], counters[2], counters[3]);
+    }
+    if (measure(&dev, &score) == 1) print_score("after", &score);
+
+    // Clean up
+    free(tried);
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
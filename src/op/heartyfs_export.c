@@ -0,0 +1,151 @@
+/*
+ * heartyfs_export.c
+ *
+ * Brief
+ * - This program copies a directory of the filesystem, with everything below it, out to a
+ *   host directory. It is the reverse of heartyfs_import.
+ *
+ *       bin/heartyfs_export / ./out               # the whole tree into ./out
+ *       bin/heartyfs_export /@monday/dir1 ./out   # a directory of a snapshot
+ *       bin/heartyfs_export / ./out 4             # read each file with four threads
+ *
+ * Data Structures:
+ * - `heartyfs_entry_info`: The entries of each directory, filled in by heartyfs_readdir_plus,
+ *   so the walk never holds a pointer into a block that may be evicted.
+ *
+ * Design Decisions:
+ * - Files are written with heartyfs_read_parallel: a few threads read, verify and decode
+ *   ranges of the data blocks and write them at their offsets, so large files are exported at
+ *   the speed of several cores. Compressed files are decoded on the way out.
+ * - Exporting never modifies the image, so it also works inside snapshots. Host directories
+ *   are created as needed; existing host files are overwritten.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <errno.h>
+#include <limits.h>
+
+struct export_totals
+{
+    int files;
+    int dirs;
+    int failed;
+    long bytes;
+};
+
+/*
+ * @brief Writes one file of the image to a host path.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The inode block of the file.
+ * @param path          The host path to create.
+ * @param threads       Most threads reading the file.
+ * @return long         Bytes written, or -1 on failure.
+ */
+long export_file(struct heartyfs_dev *dev, int block_id, char *path, int threads)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Error: Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    long written = heartyfs_read_parallel(dev, block_id, fd, threads);
+    if (written < 0) printf("Error: Cannot export %s, the data is corrupted or unreadable\n", path);
+    close(fd);
+    return written;
+}
+
+/*
+ * @brief Writes a directory of the image and everything below it to a host directory.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the directory.
+ * @param host_dir      The host directory to fill; created if missing.
+ * @param threads       Most threads reading each file.
+ * @param totals        Counters updated with what was exported.
+ */
+void export_tree(struct heartyfs_dev *dev, int block_id, char *host_dir, int threads,
+                    struct export_totals *totals)
+{
+    if (mkdir(host_dir, 0755) < 0 && errno != EEXIST)
+    {
+        printf("Error: Cannot create %s: %s\n", host_dir, strerror(errno));
+        totals->failed++;
+        return;
+    }
+
+    struct heartyfs_directory *dir = heartyfs_block(dev, block_id);
+    if (block_id == 0) dir = ((struct heartyfs_superblock *) dir)->root_dir;
+    if (dir == NULL || dir->type != 1) return;
+    struct heartyfs_entry_info infos[DIR_MAX_ENTRIES];
+    int count = heartyfs_readdir_plus(dev, dir, infos);
+
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", host_dir, infos[i].name);
+        if (infos[i].type == 1)
+        {
+            totals->dirs++;
+            export_tree(dev, infos[i].block_id, path, threads, totals);
+            continue;
+        }
+        long written = export_file(dev, infos[i].block_id, path, threads);
+        if (written < 0) totals->failed++;
+        else
+        {
+            totals->files++;
+            totals->bytes += written;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_export\n");
+
+    // Validate the command
+    int threads = argc > 3 ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc <= 2 || threads < 1)
+    {
+        printf("Usage: filename /path/to/dir /host/dir [threads]\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // The source must be an existing directory
+    struct heartyfs_directory *parent_dir = superblock->root_dir;
+    char dir_name[FILENAME_MAX];
+    int diff = dir_string_check(argv[1], dir_name, &dev, &parent_dir, NULL);
+    if (diff == 0)
+    {
+        struct export_totals totals = {0, 0, 0, 0};
+        export_tree(&dev, dir_self_id(parent_dir), argv[2], threads, &totals);
+        printf("Success: Exported %d files and %d directories (%ld bytes) to %s, failed %d\n",
+                totals.files, totals.dirs, totals.bytes, argv[2], totals.failed);
+    }
+    else printf("Error: No such a directory: %s\n", argv[1]);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * heartyfs_import.c
+ *
+ * Brief
+ * - This program copies a host directory tree into an existing directory of the filesystem
+ *   in one run, instead of one mkdir/creat/write process per node.
+ *
+ *       bin/heartyfs_import ./testdata /           # the contents of ./testdata go into /
+ *       bin/heartyfs_import ./testdata /dir1 4     # with four reader threads
+ *
+ * Data Structures:
+ * - `import_entry`: One host directory entry, and the file content once a reader thread
+ *   loaded it.
+ * - `import_batch`: The entries of one host directory, shared by the reader threads, which
+ *   take the next entry with an atomic counter.
+ *
+ * Design Decisions:
+ * - Directories are imported one at a time. All files of a directory are read on the host in
+ *   parallel first; the image is then built on the main thread only, as the block device
+ *   layer is not thread safe.
+ * - Before a directory is built, the blocks it needs (an inode and the data blocks of each
+ *   file, a block per subdirectory) are counted and a free run that long is reserved with
+ *   heartyfs_reserve_run, so each inode sits right before its data and the files of a
+ *   directory sit together. Without such a run, blocks come from the lowest free ones.
+ * - Files go through write_unit, so HEARTYFS_COMPRESS and HEARTYFS_DEDUP work as for
+ *   heartyfs_write. Entries are imported in name order so the layout is reproducible.
+ * - Files keep their host permission bits and modification time, so tools comparing mtimes
+ *   see an imported tree as unchanged.
+ * - Each imported entry is one operation for heartyfs_dev_commit, so HEARTYFS_DURABILITY
+ *   decides how often the import reaches the disk: after every entry, every group, or at exit.
+ * - Entries that do not fit (long names, full directories, files over the size limit,
+ *   existing names, special files, a directory quota) are reported and skipped; the rest is
+ *   still imported.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define IMPORT_MAX_THREADS 8
+#define IMPORT_MAX_FILE_SIZE ((long) MAX_DATA_BLOCKS * COMPRESS_UNIT_SIZE)
+
+struct import_entry
+{
+    char name[NAME_MAX + 1];
+    int is_dir;             // 1 for a directory, 0 for a regular file
+    int mode;               // Permission bits on the host
+    int64_t mtime;          // Modification time on the host, in nanoseconds
+    char *data;             // File content, filled in by a reader thread
+    long size;              // Bytes of data
+    int error;              // errno of a failed read, 0 on success
+};
+
+struct import_batch
+{
+    char *host_dir;
+    struct import_entry *entries;
+    int count;
+    int next;               // Next entry to read, taken with an atomic add
+};
+
+struct import_totals
+{
+    int files;
+    int dirs;
+    int skipped;
+    long bytes;
+};
+
+/*
+ * @brief Compares two entries by name for qsort.
+ */
+static int compare_entry(const void *a, const void *b)
+{
+    return strcmp(((struct import_entry *) a)->name, ((struct import_entry *) b)->name);
+}
+
+/*
+ * @brief Reads a whole host file into memory.
+ *
+ * @param path          The host path.
+ * @param entry         Receives the content, or the errno of the failure.
+ */
+void read_host_file(char *path, struct import_entry *entry)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        entry->error = errno;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (st.st_size > IMPORT_MAX_FILE_SIZE)
+    {
+        entry->error = EFBIG;
+        close(fd);
+        return;
+    }
+    entry->data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (entry->data == NULL)
+    {
+        entry->error = ENOMEM;
+        close(fd);
+        return;
+    }
+    while (entry->size < st.st_size)
+    {
+        ssize_t count = read(fd, entry->data + entry->size, st.st_size - entry->size);
+        if (count <= 0)
+        {
+            entry->error = count < 0 ? errno : EIO;
+            break;
+        }
+        entry->size += count;
+    }
+    close(fd);
+}
+
+/*
+ * @brief Reads the files of a batch until none is left. Runs on each reader thread.
+ *
+ * @param arg           The `import_batch`.
+ * @return void*        Always NULL; the results are in the entries.
+ */
+void *read_files(void *arg)
+{
+    struct import_batch *batch = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+    {
+        struct import_entry *entry = &batch->entries[index];
+        if (entry->is_dir) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", batch->host_dir, entry->name);
+        read_host_file(path, entry);
+    }
+    return NULL;
+}
+
+/*
+ * @brief Lists a host directory, sorted by name, and reads its files in parallel.
+ *
+ * @param host_dir      The host directory.
+ * @param threads       Number of reader threads.
+ * @param entries       Output: the entries, to be freed by the caller.
+ * @return int          Number of entries, or -1 if the directory cannot be read.
+ */
+int load_host_dir(char *host_dir, int threads, struct import_entry **entries)
+{
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL) return -1;
+    int capacity = DIR_MAX_ENTRIES;
+    int count = 0;
+    *entries = malloc(capacity * sizeof(**entries));
+    struct dirent *item;
+    while (*entries != NULL && (item = readdir(dir)) != NULL)
+    {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) continue;
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", host_dir, item->d_name);
+        if (lstat(path, &st) < 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+        {
+            printf("Error: Skipping %s, not a regular file or directory\n", path);
+            continue;
+        }
+        if (count == capacity)
+        {
+            struct import_entry *grown = realloc(*entries, 2 * capacity * sizeof(**entries));
+            if (grown == NULL)
+            {
+                free(*entries);
+                *entries = NULL;
+                break;
+            }
+            *entries = grown;
+            capacity *= 2;
+        }
+        memset(&(*entries)[count], 0, sizeof(**entries));
+        snprintf((*entries)[count].name, sizeof((*entries)[count].name), "%s", item->d_name);
+        (*entries)[count].is_dir = S_ISDIR(st.st_mode);
+        (*entries)[count].mode = st.st_mode & 07777;
+        (*entries)[count].mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        count++;
+    }
+    closedir(dir);
+    if (*entries == NULL) return -1;
+    qsort(*entries, count, sizeof(**entries), compare_entry);
+
+    // Read every file of the directory in parallel
+    struct import_batch batch = {host_dir, *entries, count, 0};
+    pthread_t workers[IMPORT_MAX_THREADS];
+    int started = 0;
+    while (started < threads && started < count
+            && pthread_create(&workers[started], NULL, read_files, &batch) == 0)
+    {
+        started++;
+    }
+    if (started == 0) read_files(&batch);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    return count;
+}
+
+/*
+ * @brief Returns the directory stored at a block, or the root directory for block 0.
+ */
+struct heartyfs_directory *dir_at(struct heartyfs_dev *dev, int block_id)
+{
+    if (block_id == 0) return ((struct heartyfs_superblock *) heartyfs_block(dev, 0))->root_dir;
+    return heartyfs_block(dev, block_id);
+}
+
+/*
+ * @brief Imports one host file or directory entry into a directory of the image.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @param dir_id        The block of the directory receiving the entry, pinned by the caller.
+ * @param entry         The host entry, with its content for a file.
+ * @param path          The host path of the entry, for messages.
+ * @return int          The block of the new entry, or -1 if it was skipped.
+ */
+int import_entry(struct heartyfs_dev *dev, uint8_t *bitmap, int dir_id,
+                    struct import_entry *entry, char *path)
+{
+    struct heartyfs_directory *dir = dir_at(dev, dir_id);
+    if (strlen(entry->name) > HEARTYFS_NAME_MAX)
+    {
+        printf("Error: Skipping %s, the name is longer than %d characters\n", path, HEARTYFS_NAME_MAX);
+        return -1;
+    }
+    if (entry->error != 0)
+    {
+        printf("Error: Skipping %s, %s\n", path, strerror(entry->error));
+        return -1;
+    }
+    if (search_entry_in_dir(dir, entry->name) >= 0)
+    {
+        printf("Error: Skipping %s, %s already exists\n", path, entry->name);
+        return -1;
+    }
+    if (!dir_has_room(dir, entry->name))
+    {
+        printf("Error: Skipping %s, the directory %s is full\n", path, dir->name);
+        return -1;
+    }
+
+    if (heartyfs_quota_check(dev, dir_id, 1) != 1)
+    {
+        printf("Error: Skipping %s\n", path);
+        return -1;
+    }
+
+    int block_id = take_block(dev, bitmap);
+    if (block_id < 0) return -1;
+    create_entry(dev, dir, entry->name, block_id);
+    heartyfs_charge(dev, dir_id, 1);
+    if (entry->is_dir)
+    {
+        struct heartyfs_directory *created_dir = heartyfs_block(dev, block_id);
+        memset(created_dir, 0, BLOCK_SIZE);
+        created_dir->type = 1;
+        created_dir->used_blocks = 1;
+        snprintf(created_dir->name, sizeof(created_dir->name), "%s", entry->name);
+        create_entry(dev, created_dir, ".", block_id);
+        create_entry(dev, created_dir, "..", dir_id);
+        return block_id;
+    }
+
+    struct heartyfs_inode *inode = heartyfs_block(dev, block_id);
+    heartyfs_inode_init(dev, inode);
+    if (!heartyfs_pin(dev, inode))
+    {
+        printf("Error: Only part of %s was imported\n", path);
+        return block_id;
+    }
+    heartyfs_charge_file(dev, block_id, dir_id);
+    for (long offset = 0; offset < entry->size; offset += COMPRESS_UNIT_SIZE)
+    {
+        int length = entry->size - offset < COMPRESS_UNIT_SIZE ? entry->size - offset : COMPRESS_UNIT_SIZE;
+        if (write_unit(dev, bitmap, inode, entry->data + offset, length) != 1)
+        {
+            printf("Error: Only part of %s was imported\n", path);
+            break;
+        }
+    }
+    heartyfs_charge_clear(dev);
+    inode->mode = entry->mode;
+    inode->mtime = entry->mtime;
+    heartyfs_dirty(dev, inode);
+    heartyfs_unpin(dev, inode);     // Files of a large directory would use up the pins
+    return block_id;
+}
+
+/*
+ * @brief Imports the contents of a host directory, then of each of its subdirectories.
+ *
+ * @param dev           The open disk image.
+ * @param bitmap        The bitmap tracking the status of blocks.
+ * @param host_dir      The host directory.
+ * @param dir_id        The block of the directory receiving its contents.
+ * @param threads       Number of reader threads.
+ * @param totals        Counters updated with what was imported.
+ */
+void import_tree(struct heartyfs_dev *dev, uint8_t *bitmap, char *host_dir, int dir_id,
+                    int threads, struct import_totals *totals)
+{
+    struct import_entry *entries = NULL;
+    int count = load_host_dir(host_dir, threads, &entries);
+    if (count < 0)
+    {
+        printf("Error: Cannot read the host directory %s\n", host_dir);
+        totals->skipped++;
+        return;
+    }
+
+    // Reserve one run for the whole directory: each inode followed by its data blocks
+    int needed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        needed += 1 + (entries[i].is_dir ? 0 : (entries[i].size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+    }
+    int start = needed > 0 ? find_free_run(dev, bitmap, needed) : -1;
+    if (start > 0) heartyfs_reserve_run(dev, start, needed);
+
+    // The receiving directory stays cached while its entries are added
+    int pinned = heartyfs_pin(dev, dir_at(dev, dir_id));
+    int *subdirs = malloc((count > 0 ? count : 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", host_dir, entries[i].name);
+        int block_id = !pinned ? -1 : import_entry(dev, bitmap, dir_id, &entries[i], path);
+        if (block_id >= 0 && heartyfs_dev_commit(dev) < 0)
+        {
+            printf("Error: Cannot write %s out to the image\n", path);
+        }
+        if (block_id < 0) totals->skipped++;
+        else if (entries[i].is_dir) totals->dirs++;
+        else
+        {
+            totals->files++;
+            totals->bytes += entries[i].size;
+        }
+        if (subdirs != NULL) subdirs[i] = entries[i].is_dir ? block_id : -1;
+        free(entries[i].data);
+        entries[i].data = NULL;
+    }
+    heartyfs_reserve_run(dev, 0, 0);
+    heartyfs_unpin_all(dev);
+
+    for (int i = 0; i < count && subdirs != NULL; i++)
+    {
+        if (subdirs[i] < 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", host_dir, entries[i].name);
+        import_tree(dev, bitmap, path, subdirs[i], threads, totals);
+    }
+    free(subdirs);
+    free(entries);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_import\n");
+
+    // Validate the command
+    int threads = argc > 3 ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc <= 2 || threads < 1)
+    {
+        printf("Usage: filename /host/dir /path/to/dir [threads]\n");
+        exit(2);
+    }
+    if (threads > IMPORT_MAX_THREADS) threads = IMPORT_MAX_THREADS;
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // The destination must be an existing directory
+    struct heartyfs_directory *parent_dir = superblock->root_dir;
+    char dir_name[FILENAME_MAX];
+    int diff = dir_string_check(argv[2], dir_name, &dev, &parent_dir, bitmap);
+    if (diff == 0)
+    {
+        struct import_totals totals = {0, 0, 0, 0};
+        import_tree(&dev, bitmap, argv[1], dir_self_id(parent_dir), threads, &totals);
+        printf("Success: Imported %d files and %d directories (%ld bytes) from %s, skipped %d\n",
+                totals.files, totals.dirs, totals.bytes, argv[1], totals.skipped);
+    }
+    else printf("Error: No such a directory: %s\n", argv[2]);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
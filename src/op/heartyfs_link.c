@@ -0,0 +1,73 @@
+/*
+ * heartyfs_link.c
+ *
+ * Brief
+ * - This program adds a hard link: a second name for an existing file, sharing its inode
+ *   and data blocks. A write through either name is seen through the other, and the file
+ *   is only freed when its last name is removed with heartyfs_rm.
+ *
+ *       bin/heartyfs_link /dir1/big.dat /dir6/big.dat
+ *
+ * Data Structures:
+ * - `inode->links` counts the names of the file beyond the first.
+ * - The share count table counts every owner of the inode, names and snapshots alike.
+ *
+ * Design Decisions:
+ * - Only files can be linked, so the directory tree stays a tree.
+ * - Linking writes one directory entry and two counters; the data is never copied.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_link\n");
+
+    // Validate the command
+    if (argc <= 2)
+    {
+        printf("Usage: filename /path/to/existing_file /path/to/new_name\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Find the existing file
+    struct heartyfs_directory *src_parent = superblock->root_dir;
+    char src_name[FILENAME_MAX];
+    int src_diff = dir_string_check(argv[1], src_name, &dev, &src_parent, bitmap);
+    int block_id = src_diff == 1 ? search_entry_in_dir(src_parent, src_name) : -1;
+
+    // Find the directory receiving the new name
+    struct heartyfs_directory *dst_parent = superblock->root_dir;
+    char dst_name[FILENAME_MAX];
+    int dst_diff = block_id > 1 ? dir_string_check(argv[2], dst_name, &dev, &dst_parent, bitmap) : -1;
+
+    if (src_diff == 0) printf("Error: Can not link a directory\n");
+    else if (block_id <= 1) printf("Error: No such a file: %s\n", src_name);
+    else if (dst_diff == 0) printf("Error: The entry %s has already existed\n", dst_name);
+    else if (dst_diff != 1) printf("Error: No such a parent for the new name\n");
+    else heartyfs_link(&dev, block_id, dst_parent, dst_name, bitmap);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * heartyfs_ls.c
+ *
+ * Brief
+ * - This program lists a directory of the filesystem with the type, size and block count of
+ *   every entry, like `ls -l`. With -R it lists every directory below it as well.
+ *
+ *       bin/heartyfs_ls /dir1
+ *       bin/heartyfs_ls -R /
+ *
+ * Data Structures:
+ * - `heartyfs_entry_info`: The attributes of one entry, filled in by heartyfs_readdir_plus
+ *   for a whole directory at once.
+ * - Walk stack: A growing array of (directory block, path) pairs still to be listed.
+ *
+ * Design Decisions:
+ * - Only the starting path goes through dir_string_check. Subdirectories are reached by the
+ *   block ids found in their parent, so a recursive listing reads every block once.
+ * - The recursive walk keeps its own stack on the heap instead of recursing on the C stack,
+ *   and pushes children in reverse so directories are listed in entry order.
+ * - Listing never modifies the image, so it also works inside snapshots (`/@name/...`).
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <limits.h>
+
+struct walk_item
+{
+    int block_id;           // Directory block still to be listed
+    char path[PATH_MAX];    // Its path, for the listing header
+};
+
+/*
+ * @brief Prints one entry as a line of the listing.
+ *
+ * @param info          The attributes of the entry.
+ */
+void print_entry(struct heartyfs_entry_info *info)
+{
+    if (info->type == 1)
+    {
+        printf("d %-28s %8ld entries %4d blocks\n", info->name, info->size, info->blocks);
+    }
+    else
+    {
+        printf("%c %-28s %8ld bytes   %4d blocks %3d links\n", (info->type & INODE_FLAG_COMPRESSED) ? 'c' : '-',
+                info->name, info->size, info->blocks, info->links);
+    }
+}
+
+/*
+ * @brief Lists a directory and, if recursive, every directory below it.
+ *
+ * @param dev           The open disk image.
+ * @param block_id      The block of the starting directory.
+ * @param path          The path of the starting directory.
+ * @param recursive     1 to walk the whole subtree.
+ * @return int          1 on success, -1 if out of memory.
+ */
+int list_tree(struct heartyfs_dev *dev, int block_id, char *path, int recursive)
+{
+    int capacity = DIR_MAX_ENTRIES;
+    int top = 0;
+    struct walk_item *stack = malloc(capacity * sizeof(*stack));
+    if (stack == NULL) return -1;
+    stack[top].block_id = block_id;
+    snprintf(stack[top].path, PATH_MAX, "%s", path);
+    top++;
+
+    int listed = 0;
+    while (top > 0)
+    {
+        struct walk_item item = stack[--top];
+        struct heartyfs_directory *dir = heartyfs_block(dev, item.block_id);
+        if (item.block_id == 0) dir = ((struct heartyfs_superblock *) dir)->root_dir;
+        if (dir == NULL || dir->type != 1 || ++listed > dev->num_blocks) continue;    // Guards corrupt trees
+
+        struct heartyfs_entry_info infos[DIR_MAX_ENTRIES];
+        int count = heartyfs_readdir_plus(dev, dir, infos);
+        if (recursive) printf("%s:\n", item.path);
+        for (int i = 0; i < count; i++) print_entry(&infos[i]);
+        if (!recursive) continue;
+        printf("\n");
+
+        // Push the subdirectories, last first, so they come out in entry order
+        for (int i = count - 1; i >= 0; i--)
+        {
+            if (infos[i].type != 1) continue;
+            if (top == capacity)
+            {
+                struct walk_item *grown = realloc(stack, 2 * capacity * sizeof(*stack));
+                if (grown == NULL)
+                {
+                    free(stack);
+                    return -1;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[top].block_id = infos[i].block_id;
+            int length = snprintf(stack[top].path, PATH_MAX, "%s%s%s", item.path,
+                                    item.path[strlen(item.path) - 1] == '/' ? "" : "/", infos[i].name);
+            if (length >= PATH_MAX)
+            {
+                printf("Error: Skipping %s in %s, the path is longer than %d bytes\n",
+                        infos[i].name, item.path, PATH_MAX - 1);
+                continue;
+            }
+            top++;
+        }
+    }
+    free(stack);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_ls\n");
+
+    // Validate the command
+    int recursive = argc > 1 && strcmp(argv[1], "-R") == 0;
+    if (argc <= 1 + recursive)
+    {
+        printf("Usage: filename [-R] /path/to/dir\n");
+        exit(2);
+    }
+    char *input_path = argv[1 + recursive];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", input_path);
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Check whether the path exists, as a directory or as a file
+    struct heartyfs_directory *parent_dir = superblock->root_dir;
+    char entry_name[FILENAME_MAX];
+    int diff = dir_string_check(input_path, entry_name, &dev, &parent_dir, NULL);
+    if (diff == 0)
+    {
+        if (list_tree(&dev, dir_self_id(parent_dir), path, recursive) != 1)
+        {
+            printf("Error: Not enough memory to list %s\n", path);
+        }
+    }
+    else if (diff == 1 && search_entry_in_dir(parent_dir, entry_name) > 1)
+    {
+        struct heartyfs_entry_info info;
+        if (heartyfs_entry_info(&dev, search_entry_in_dir(parent_dir, entry_name), entry_name, &info) == 1)
+        {
+            print_entry(&info);
+        }
+        else printf("Error: The data of %s is corrupted\n", entry_name);
+    }
+    else printf("Error: No such a file or directory: %s\n", path);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
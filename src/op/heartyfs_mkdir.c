@@ -30,27 +30,28 @@
  *   the directory with entries for the current (".") and parent ("..") directories.
  * 
  * @param superblock       Pointer to the superblock containing metadata and free block info.
- * @param buffer           Memory area containing the filesystem data.
+ * @param dev              The open disk image.
  * @param target_name      The name of the new directory to be created.
  * @param target_block_id  The ID of the block where the new directory will be created.
  * @param parent_block_id  The ID of the parent directory block.
- * @param bitmap           Bitmap indicating block availability.
  * 
  * @return int             1 on success, -1 if the creation fails.
  */
-int create_directory(struct heartyfs_superblock *superblock, void *buffer, 
-                        char *target_name, uint8_t target_block_id, 
-                        uint8_t parent_block_id, uint8_t *bitmap)
+int create_directory(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev, 
+                        char *target_name, int target_block_id, 
+                        int parent_block_id)
 {
-    struct heartyfs_directory *created_dir = (struct heartyfs_directory *)(buffer + BLOCK_SIZE * target_block_id);
+    struct heartyfs_directory *created_dir = heartyfs_block(dev, target_block_id);
     created_dir->type = 1;
     created_dir->size = 0;
+    created_dir->used_blocks = 1;
+    created_dir->quota_blocks = 0;
     snprintf(created_dir->name, sizeof(created_dir->name), "%s", target_name);
-    if (create_entry(superblock, created_dir, ".", target_block_id, bitmap) != 1)
+    if (create_entry(dev, created_dir, ".", target_block_id) != 1)
     {
         return -1;
     }
-    if (create_entry(superblock, created_dir, "..", parent_block_id, bitmap) != 1)
+    if (create_entry(dev, created_dir, "..", parent_block_id) != 1)
     {
         return -1;
     }
@@ -68,29 +69,20 @@ int main(int argc, char *argv[]) {
         exit(2);
     }
 
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot open the disk file\n");
-        exit(1);
-    }
-
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
-    {
-        perror("Cannot map the disk file onto memory\n");
         exit(1);
     }
 
     // Check whether the filesystem was initialized
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
     if (strcmp(superblock->root_dir->name, "") == 0)
     {
         // Clean up
-        cleanup(buffer, fd);
+        heartyfs_dev_close(&dev);
         printf("Error: File system have not been initialized yet\n");
         exit(-1);
     }
@@ -98,24 +90,26 @@ int main(int argc, char *argv[]) {
     // Check whether directory is exists or not
     struct heartyfs_directory *parent_dir = superblock->root_dir;
     char dir_name[FILENAME_MAX];
-    int diff = dir_string_check(argv[1], dir_name, buffer, &parent_dir, bitmap);
+    int diff = dir_string_check(argv[1], dir_name, &dev, &parent_dir, bitmap);
     if (diff == 1) // Check whether the input string directory is more than to current by 1 directory
     {
         // Check whether there is a free block available
-        int free_block_id = find_free_block(bitmap);
+        int free_block_id = find_free_block(&dev, bitmap);
         if (free_block_id > 0)
         {
-            // Check and create an entry on the parent block if possible
-            if (create_entry(superblock, parent_dir, dir_name, free_block_id, bitmap) == 1) 
+            // Check the quotas, then create an entry on the parent block if possible
+            int parent_block_id = dir_self_id(parent_dir);
+            if (heartyfs_quota_check(&dev, parent_block_id, 1) == 1
+                    && create_entry(&dev, parent_dir, dir_name, free_block_id) == 1) 
             {
                 // Check and create a directory if possible
-                int parent_block_id = parent_dir->entries[0].block_id;
-                if (create_directory(superblock, buffer, dir_name, 
-                                        free_block_id, parent_block_id, bitmap) == 1)
+                if (create_directory(superblock, &dev, dir_name, 
+                                        free_block_id, parent_block_id) == 1)
                 {
                     // Mark occupied
                     superblock->free_blocks--;
                     occupy_block(free_block_id, bitmap);
+                    heartyfs_charge(&dev, parent_block_id, 1);
                 }
             }
         }
@@ -125,7 +119,7 @@ int main(int argc, char *argv[]) {
     else printf("Error: No such a parent for directory\n");
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
 
     return 0;
 }
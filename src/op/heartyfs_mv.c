@@ -0,0 +1,85 @@
+/*
+ * heartyfs_mv.c
+ *
+ * Brief
+ * - This program renames or moves a file or directory. The entry moves from its parent
+ *   directory to the new one; the data blocks are never read, copied or written.
+ *
+ *       bin/heartyfs_mv /dir1/out.tmp /dir1/out.txt      # rename, replacing out.txt
+ *       bin/heartyfs_mv /dir1/dir2 /dir6                 # move dir2 into /dir6
+ *
+ * Data Structures:
+ * - Directories hold `heartyfs_dir_entry` records of (block id, name); moving an entry
+ *   rewrites these records and, for a directory, its ".." entry.
+ *
+ * Design Decisions:
+ * - The work is done by heartyfs_rename, which writes the new entry and syncs it before the
+ *   old entry is removed, so a crash never loses the entry.
+ * - Like `mv`, a destination that is an existing directory receives the entry under its
+ *   current name; any other destination is the new path of the entry.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_mv\n");
+
+    // Validate the command
+    if (argc <= 2)
+    {
+        printf("Usage: filename /path/to/source /path/to/destination\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Find the source entry and the directory holding it
+    struct heartyfs_directory *src_parent = superblock->root_dir;
+    char src_name[FILENAME_MAX];
+    int src_diff = dir_string_check(argv[1], src_name, &dev, &src_parent, bitmap);
+    int is_root = 0;
+    if (src_diff == 0)
+    {
+        // The source is a directory, its parent is behind ".."
+        int parent_block_id = dir_parent_id(src_parent);
+        if (dir_self_id(src_parent) == 0) is_root = 1;      // The root can not move
+        else if (parent_block_id == 0) src_parent = superblock->root_dir;
+        else src_parent = heartyfs_block(&dev, parent_block_id);
+        if (!is_root && !heartyfs_pin(&dev, src_parent)) src_diff = -1;
+    }
+
+    // Find the destination directory and name
+    struct heartyfs_directory *dst_parent = superblock->root_dir;
+    char dst_name[FILENAME_MAX];
+    int dst_diff = !is_root && src_diff >= 0 && src_diff <= 1
+                    ? dir_string_check(argv[2], dst_name, &dev, &dst_parent, bitmap) : -1;
+    if (dst_diff == 0) snprintf(dst_name, sizeof(dst_name), "%s", src_name);    // Move into it
+
+    if (is_root) printf("Error: Can not move the root directory\n");
+    else if (src_diff < 0 || src_diff > 1) printf("Error: No such a source: %s\n", src_name);
+    else if (dst_diff < 0 || dst_diff > 1) printf("Error: No such a parent for the destination\n");
+    else heartyfs_rename(&dev, src_parent, src_name, dst_parent, dst_name, bitmap);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
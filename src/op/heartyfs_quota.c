@@ -0,0 +1,87 @@
+/*
+ * heartyfs_quota.c
+ *
+ * Brief
+ * - This program prints the space used by a directory subtree, and sets or removes the quota
+ *   of a directory.
+ *
+ *       bin/heartyfs_quota /dir1               # print usage and quota
+ *       bin/heartyfs_quota /dir1 64            # limit /dir1 and below to 64 blocks
+ *       bin/heartyfs_quota /dir1 0             # remove the quota
+ *
+ * Data Structures:
+ * - `heartyfs_directory`: used_blocks and quota_blocks, kept in the directory block itself.
+ *
+ * Design Decisions:
+ * - Usage is read from the directory block alone, so it costs the path lookup and nothing
+ *   more, however large the subtree is.
+ * - Setting a quota resolves the path as a writer, so the directory is private to the live
+ *   tree first; printing works inside snapshots too.
+ * - A quota below the current usage is accepted: nothing is removed, only growth is refused.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <limits.h>
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_quota\n");
+
+    // Validate the command
+    char *end = NULL;
+    long quota = argc == 3 ? strtol(argv[2], &end, 10) : 0;
+    if (argc < 2 || argc > 3 || (end != NULL && (*end != '\0' || quota < 0 || quota > INT_MAX)))
+    {
+        printf("Usage: filename /path/to/dir [quota_blocks]\n");
+        exit(2);
+    }
+    int setting = argc == 3;
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Find the directory, private to the live tree when its quota is set
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", argv[1]);
+    struct heartyfs_directory *dir = superblock->root_dir;
+    char entry_name[FILENAME_MAX] = "";
+    int diff = dir_string_check(path, entry_name, &dev, &dir, setting ? bitmap : NULL);
+    if (diff != 0)
+    {
+        heartyfs_dev_close(&dev);
+        printf("Error: The target is not a directory: %s\n", argv[1]);
+        return 1;
+    }
+
+    if (setting)
+    {
+        dir->quota_blocks = quota;
+        heartyfs_dirty(&dev, dir);
+    }
+    if (dir->quota_blocks > 0)
+    {
+        printf("Success: %s uses %d blocks, quota %d blocks\n", argv[1], dir->used_blocks, dir->quota_blocks);
+    }
+    else printf("Success: %s uses %d blocks, no quota\n", argv[1], dir->used_blocks);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
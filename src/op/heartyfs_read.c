@@ -16,6 +16,10 @@
  * Design Decisions:
  * - The program uses memory mapping (`mmap`) to access the disk image efficiently, allowing
  *   direct manipulation and reading of filesystem structures.
+ * - With `-o host_file` the file is copied out instead of printed, through the parallel read
+ *   path, which splits the data blocks between a few threads:
+ *
+ *       bin/heartyfs_read /dir1/big.txt -o /tmp/big.txt 4
  * 
  *                                          Created by Nathadon Samairat 18 Oct 2024
  */
@@ -27,35 +31,27 @@ int main(int argc, char *argv[])
     printf("heartyfs_read\n");
 
     // Validate the command
-    if (argc <= 1)
+    char *out_path = argc > 3 && strcmp(argv[2], "-o") == 0 ? argv[3] : NULL;
+    int threads = argc > 4 ? atoi(argv[4]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc <= 1 || threads < 1)
     {
-        printf("Usage: filename /path/to/dir\n");
+        printf("Usage: filename /path/to/dir [-o /host/file [threads]]\n");
         exit(2);
     }
 
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot open the disk file\n");
-        exit(1);
-    }
-
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
-    {
-        perror("Cannot map the disk file onto memory\n");
         exit(1);
     }
 
     // Check whether the filesystem was initialized
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
     if (strcmp(superblock->root_dir->name, "") == 0)
     {
         // Clean up
-        cleanup(buffer, fd);
+        heartyfs_dev_close(&dev);
         printf("Error: File system have not been initialized yet\n");
         exit(-1);
     }
@@ -63,21 +59,52 @@ int main(int argc, char *argv[])
     // Check whether directory is exists or not
     struct heartyfs_directory *parent_dir = superblock->root_dir;
     char file_name[FILENAME_MAX];
-    int diff = dir_string_check(argv[1], file_name, buffer, &parent_dir, bitmap);
+    int diff = dir_string_check(argv[1], file_name, &dev, &parent_dir, NULL);
     if (diff == 1)
     {
         if (parent_dir->type == 1)
         {
             int current_block_id = search_entry_in_dir(parent_dir, file_name);
-            if (current_block_id > 1)
+            if (current_block_id > 1 && out_path != NULL)
             {
-                struct heartyfs_inode *inode = (struct heartyfs_inode *) (buffer + (current_block_id * BLOCK_SIZE));
-                for (int i = 0; i < inode->size; i++)
+                // Copy the whole file out with several threads
+                int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                long size = fd < 0 ? -1 : heartyfs_read_parallel(&dev, current_block_id, fd, threads);
+                if (fd >= 0) close(fd);
+                if (size >= 0) printf("Success: Read %ld bytes of %s into %s\n", size, file_name, out_path);
+                else printf("Error: Cannot read %s into %s\n", file_name, out_path);
+            }
+            else if (current_block_id > 1)
+            {
+                struct heartyfs_inode *inode = heartyfs_block(&dev, current_block_id);
+                if (!heartyfs_pin(&dev, inode))
+                {
+                    heartyfs_dev_close(&dev);
+                    return -1;
+                }
+                heartyfs_prefetch(&dev, inode->data_blocks, inode->size);
+
+                // Decode unit by unit into one reusable buffer, print DATA_BLOCK_SIZE at a time
+                char *unit = malloc(COMPRESS_UNIT_SIZE);
+                char *scratch = malloc(COMPRESS_SCRATCH_SIZE);
+                int block_index = 0;
+                int chunk = 0;
+                while (unit != NULL && scratch != NULL && block_index < inode->size)
                 {
-                    int target_block_id = inode->data_blocks[i];
-                    struct heartyfs_data_block *datablock = (struct heartyfs_data_block *) (buffer + target_block_id * BLOCK_SIZE);
-                    printf("Success block %d: %s\n", i, datablock->name);
+                    int unit_size = read_unit(&dev, inode, &block_index, unit, scratch);
+                    if (unit_size < 0)
+                    {
+                        printf("Error: The data of %s is corrupted\n", file_name);
+                        break;
+                    }
+                    for (int offset = 0; offset < unit_size; offset += DATA_BLOCK_SIZE)
+                    {
+                        int length = unit_size - offset < DATA_BLOCK_SIZE ? unit_size - offset : DATA_BLOCK_SIZE;
+                        printf("Success block %d: %.*s\n", chunk++, length, unit + offset);
+                    }
                 }
+                free(unit);
+                free(scratch);
             }
             else printf("Error: The target is not found on the datablock: %s\n", file_name);
         } 
@@ -86,7 +113,7 @@ int main(int argc, char *argv[])
     else printf("Error: No such a parent for the target file");
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
 
     return 0;
 }
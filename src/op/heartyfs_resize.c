@@ -0,0 +1,121 @@
+/*
+ * heartyfs_resize.c
+ *
+ * Brief
+ * - This program grows the disk image, so a full file system gets more room without being
+ *   formatted and copied again. Sizes are in bytes, with an optional K or M suffix, and a
+ *   leading + grows by that much:
+ *
+ *       bin/heartyfs_resize 4M
+ *       bin/heartyfs_resize +512K
+ *
+ * Data Structures:
+ * - `heartyfs_superblock`: total_blocks and free_blocks grow with the image.
+ *
+ * Design Decisions:
+ * - The tool extends the image file with ftruncate, which keeps every existing byte, and
+ *   lets heartyfs_grow add the new blocks to the file system.
+ * - When the image is free, the tool opens it, which grows it, and prints the new totals.
+ *   When another process holds it, such as a mounted FUSE daemon, the file is only
+ *   extended: that process adds the blocks at its next operation, without unmounting.
+ * - Images only grow; sizes are rounded down to whole blocks, and a size past
+ *   HEARTYFS_MAX_BLOCKS is refused rather than cut, so the image is never left smaller
+ *   than asked without saying so.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <errno.h>
+
+/*
+ * @brief Parses a size in bytes with an optional K or M suffix.
+ *
+ * @param text          The size given on the command line.
+ * @return long         The size in bytes, or -1 if it is not a size.
+ */
+long parse_size(char *text)
+{
+    char *end;
+    long size = strtol(text, &end, 10);
+    if (end == text || size < 0) return -1;
+    if (*end == 'K' || *end == 'k') size *= 1024, end++;
+    else if (*end == 'M' || *end == 'm') size *= 1024 * 1024, end++;
+    return *end == '\0' ? size : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_resize\n");
+
+    // Validate the command
+    int relative = argc == 2 && argv[1][0] == '+';
+    long size = argc == 2 ? parse_size(argv[1] + relative) : -1;
+    if (size < 0)
+    {
+        printf("Usage: filename [+]size[K|M]\n");
+        exit(2);
+    }
+
+    // Work out the new size from the image file
+    int fd = open(DISK_FILE_PATH, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("Cannot open the disk file\n");
+        exit(1);
+    }
+    long old_blocks = st.st_size / BLOCK_SIZE;
+    long new_blocks = ((relative ? st.st_size : 0) + size) / BLOCK_SIZE;
+    if (new_blocks > HEARTYFS_MAX_BLOCKS)
+    {
+        close(fd);
+        printf("Error: The image can hold at most %d blocks (%dK), %ld were asked for\n",
+                HEARTYFS_MAX_BLOCKS, HEARTYFS_MAX_BLOCKS * BLOCK_SIZE / 1024, new_blocks);
+        return 1;
+    }
+    if (new_blocks <= old_blocks)
+    {
+        close(fd);
+        printf("Error: The image can only grow, it has %ld blocks\n", old_blocks);
+        return 1;
+    }
+
+    // Extend the file, then let the holder of the image add the blocks
+    if (ftruncate(fd, (off_t) new_blocks * BLOCK_SIZE) < 0)
+    {
+        close(fd);
+        perror("Cannot extend the disk file\n");
+        exit(1);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        close(fd);
+        if (errno != EWOULDBLOCK) return 1;
+        printf("Success: The image file has %ld blocks, the process using it adds them at its next operation\n",
+                new_blocks);
+        return 0;
+    }
+    close(fd);
+
+    // Opening the image adds the new blocks
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        printf("Success: The image file has %ld blocks, they are used when it is initialized\n", new_blocks);
+    }
+    else
+    {
+        printf("Success: The image grew from %ld to %d blocks, %d free\n",
+                old_blocks, superblock->total_blocks, superblock->free_blocks);
+    }
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
@@ -3,8 +3,8 @@
  * 
  * Brief
  * - This program handles the removal of files within the filesystem.
- *   The `remove_file` function clears the file's metadata and data blocks in the
- *   specified block, effectively deleting the file from the filesystem.
+ *   The file's entry is removed from its parent, then `heartyfs_unlink` drops that name;
+ *   the inode and its data blocks are freed once no other hard link or snapshot shares them.
  * 
  * Data Structures:
  * - The superblock contains filesystem metadata, such as the root directory and a
@@ -22,21 +22,6 @@
  */
 #include "../heartyfs.h"
 
-/*
- * @brief Removes a file from the filesystem by clearing its metadata and data blocks.
- * 
- * @param buffer         Pointer to the memory-mapped disk buffer.
- * @param target_block_id Block ID of the file to be removed.
- */
-void remove_file(void *buffer, uint8_t target_block_id)
-{
-    struct heartyfs_inode *target_file = (struct heartyfs_inode *) (buffer + BLOCK_SIZE * target_block_id);
-    target_file->name[0] = '\0';
-    target_file->size = 0;
-    target_file->type = 0;
-    memset(target_file->data_blocks, 0, sizeof(target_file->data_blocks));
-}
-
 int main(int argc, char *argv[]) 
 {
     printf("heartyfs_rm\n");
@@ -48,29 +33,20 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
-    {
-        perror("Cannot open the disk file\n");
-        exit(1);
-    }
-
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot map the disk file onto memory\n");
         exit(1);
     }
 
     // Check whether the filesystem was initialized
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
     if (strcmp(superblock->root_dir->name, "") == 0)
     {
         // Clean up
-        cleanup(buffer, fd);
+        heartyfs_dev_close(&dev);
         printf("Error: File system have not been initialized yet\n");
         exit(-1);
     }
@@ -79,21 +55,19 @@ int main(int argc, char *argv[])
     struct heartyfs_directory *parent_dir = superblock->root_dir;
     char file_name[FILENAME_MAX];
     char *temp_input = argv[1];
-    int diff = dir_string_check(temp_input, file_name, buffer, &parent_dir, bitmap);
+    int diff = dir_string_check(temp_input, file_name, &dev, &parent_dir, bitmap);
     if (diff == 1)  // Check whether the input string directory equal to current directory string.
     {
         if (parent_dir->type == 1)
         {
-            int parent_block_id = parent_dir->entries[0].block_id;
+            int parent_block_id = dir_self_id(parent_dir);
             int current_block_id = search_entry_in_dir(parent_dir, file_name);
             // remove an entry from the parent directory
-            if (remove_entry(superblock, buffer, parent_block_id, file_name) == 1)
+            if (remove_entry(superblock, &dev, parent_block_id, file_name) == 1)
             {
-                // remove all detail in the file
-                remove_file(buffer, current_block_id);
-                // Mark Free
-                superblock->free_blocks++;
-                free_block(current_block_id, bitmap);
+                // drop the name, the blocks are freed with the last name
+                heartyfs_charge(&dev, parent_block_id, -heartyfs_entry_charge(&dev, current_block_id));
+                heartyfs_unlink(&dev, current_block_id, bitmap);
             }
         } 
         else printf("Error: The parent is not a directory\n");
@@ -101,7 +75,7 @@ int main(int argc, char *argv[])
     else printf("Error: The target is not a file\n");
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
 
     return 0;
 }
@@ -24,29 +24,28 @@
  * @brief Removes a directory and updates the superblock and bitmap.
  * 
  * @param superblock Pointer to the superblock containing filesystem metadata.
- * @param buffer     Memory area containing the filesystem data.
+ * @param dev        The open disk image.
  * @param target_dir Directory structure to be removed.
  * 
  * @return int       1 on success, -1 on failure (e.g., if removal fails).
  */
-int remove_directory(struct heartyfs_superblock *superblock, void *buffer, 
-                        struct heartyfs_directory *target_dir)
+int remove_directory(struct heartyfs_superblock *superblock, struct heartyfs_dev *dev, 
+                        struct heartyfs_directory *target_dir, char *target_name)
 {
     char temp_dir_name[FILENAME_MAX];
-    strcpy(temp_dir_name, target_dir->name);
+    strcpy(temp_dir_name, target_name);
 
     // remove detail from parent of target_dir
-    int parent_block_id = target_dir->entries[1].block_id;
-    if (remove_entry(superblock, buffer, parent_block_id, temp_dir_name) != 1) return -1; 
+    int parent_block_id = dir_parent_id(target_dir);
+    int used_blocks = target_dir->used_blocks;
+    if (remove_entry(superblock, dev, parent_block_id, temp_dir_name) != 1) return -1; 
+    heartyfs_charge(dev, parent_block_id, -used_blocks);
 
     // remove the entry from target dir (just in case)
     target_dir->type = 0;
     target_dir->name[0] = '\0'; 
-    for (int i = 0; i < target_dir->size; i++)
-    { 
-        target_dir->entries[i].block_id = 0;
-        target_dir->entries[i].file_name[0] = '\0';
-    }
+    memset(target_dir->records, 0, sizeof(target_dir->records));
+    heartyfs_dirty(dev, target_dir);
 
     // remove detail in target_dir
     printf("Success: The directory was %s removed\n", temp_dir_name);
@@ -64,29 +63,20 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
-    {
-        perror("Cannot open the disk file\n");
-        exit(1);
-    }
-
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot map the disk file onto memory\n");
         exit(1);
     }
 
     // Check whether the filesystem was initialized
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
     if (strcmp(superblock->root_dir->name, "") == 0)
     {
         // Clean up
-        cleanup(buffer, fd);
+        heartyfs_dev_close(&dev);
         printf("Error: File system have not been initialized yet\n");
         exit(-1);
     }
@@ -95,7 +85,7 @@ int main(int argc, char *argv[])
     struct heartyfs_directory *current_dir = superblock->root_dir;
     char dir_name[FILENAME_MAX];
     char *temp_input = argv[1];
-    int diff = dir_string_check(temp_input, dir_name, buffer, &current_dir, bitmap);
+    int diff = dir_string_check(temp_input, dir_name, &dev, &current_dir, bitmap);
     if (diff == 0)  // Check whether the input string directory equal to current directory string.
     {
         if (strcmp(current_dir->name, "/") != 0)
@@ -104,8 +94,8 @@ int main(int argc, char *argv[])
             {
                 if (current_dir->size <= 2) 
                 {
-                    int target_block_id = current_dir->entries[0].block_id;
-                    if (remove_directory(superblock, buffer, current_dir) == 1)
+                    int target_block_id = dir_self_id(current_dir);
+                    if (remove_directory(superblock, &dev, current_dir, dir_name) == 1)
                     {
                         // Mark Free
                         superblock->free_blocks++;
@@ -121,7 +111,7 @@ int main(int argc, char *argv[])
     else printf("Error: No such a parent for directory: %s\n", dir_name);
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
 
     return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * heartyfs_scrub.c
+ *
+ * Brief
+ * - This program checks every block of the image against the checksum table and lists the
+ *   blocks that do not match. The image is split into ranges that are checked in parallel.
+ *
+ *       bin/heartyfs_scrub                         # one thread per CPU
+ *       bin/heartyfs_scrub 4                       # four threads
+ *       HEARTYFS_CHECKSUM=1 bin/heartyfs_scrub     # add the checksum table first if missing
+ *
+ * Data Structures:
+ * - `scrub_task`: One contiguous range of blocks, the thread checking it, and the bad blocks
+ *   it found.
+ *
+ * Design Decisions:
+ * - The device is flushed first and stays locked, so the image on disk is complete and no
+ *   other tool changes it during the scrub.
+ * - Threads read the image with `pread` in runs of HEARTYFS_IO_BATCH blocks, bypassing the
+ *   block cache, which is not thread safe. They only read the loaded table, so they share
+ *   nothing that is written.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <pthread.h>
+
+#define SCRUB_MAX_THREADS 16
+
+struct scrub_task
+{
+    struct heartyfs_dev *dev;
+    pthread_t thread;
+    int first;              // First block of the range
+    int last;               // One past the last block of the range
+    int checked;            // Blocks compared with their checksum
+    int bad_count;          // Blocks that did not match
+    int *bad;               // Their IDs, room for the whole range
+    int failed;             // 1 if the range could not be read
+};
+
+/*
+ * @brief Checks one range of blocks. Runs on its own thread.
+ *
+ * @param arg           The `scrub_task` of the range.
+ * @return void*        Always NULL; the results are in the task.
+ */
+void *scrub_range(void *arg)
+{
+    struct scrub_task *task = arg;
+    uint8_t batch[HEARTYFS_IO_BATCH * BLOCK_SIZE];
+    for (int first = task->first; first < task->last; first += HEARTYFS_IO_BATCH)
+    {
+        int count = task->last - first < HEARTYFS_IO_BATCH ? task->last - first : HEARTYFS_IO_BATCH;
+        if (pread(task->dev->fd, batch, (size_t) count * BLOCK_SIZE, (off_t) first * BLOCK_SIZE)
+                != (ssize_t) count * BLOCK_SIZE)
+        {
+            task->failed = 1;
+            return NULL;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t expected = task->dev->checksums[first + i];
+            if (expected == 0) continue;    // Not covered
+            task->checked++;
+            if (heartyfs_crc32c(batch + (size_t) i * BLOCK_SIZE, BLOCK_SIZE) != expected)
+            {
+                task->bad[task->bad_count++] = first + i;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_scrub\n");
+
+    // Validate the command
+    int threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+    {
+        printf("Usage: filename [threads]\n");
+        exit(2);
+    }
+    if (threads > SCRUB_MAX_THREADS) threads = SCRUB_MAX_THREADS;
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized and has checksums
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+    if (dev.checksums == NULL)
+    {
+        heartyfs_dev_close(&dev);
+        printf("Error: The image has no checksum table, open it once with HEARTYFS_CHECKSUM=1\n");
+        exit(1);
+    }
+    if (heartyfs_dev_flush(&dev) < 0)
+    {
+        heartyfs_dev_close(&dev);
+        printf("Error: Cannot write the image out before the scrub\n");
+        exit(1);
+    }
+
+    // Split the image into one range per thread
+    struct scrub_task tasks[SCRUB_MAX_THREADS];
+    memset(tasks, 0, sizeof(tasks));
+    int per_thread = (dev.num_blocks + threads - 1) / threads;
+    int started = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        struct scrub_task *task = &tasks[i];
+        task->dev = &dev;
+        task->first = i * per_thread < dev.num_blocks ? i * per_thread : dev.num_blocks;
+        task->last = task->first + per_thread < dev.num_blocks ? task->first + per_thread : dev.num_blocks;
+        task->bad = malloc((task->last - task->first + 1) * sizeof(int));
+        if (task->bad == NULL || pthread_create(&task->thread, NULL, scrub_range, task) != 0)
+        {
+            task->failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    int checked = 0;
+    int bad_count = 0;
+    int failed = started < threads;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(tasks[i].thread, NULL);
+        for (int j = 0; j < tasks[i].bad_count; j++)
+        {
+            printf("Error: Block %d does not match its checksum\n", tasks[i].bad[j]);
+        }
+        checked += tasks[i].checked;
+        bad_count += tasks[i].bad_count;
+        failed |= tasks[i].failed;
+    }
+    for (int i = 0; i < threads; i++) free(tasks[i].bad);
+
+    if (failed) printf("Error: The scrub could not read the whole image\n");
+    else printf("Success: Scrubbed %d blocks with %d threads, %d bad\n", checked, threads, bad_count);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return bad_count > 0 || failed;
+}
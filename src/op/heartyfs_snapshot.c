@@ -0,0 +1,92 @@
+/*
+ * heartyfs_snapshot.c
+ *
+ * Brief
+ * - This program manages point-in-time snapshots of the filesystem. A snapshot can be
+ *   created, listed, and deleted, and its content is read through paths starting with
+ *   `/@name/`, e.g. `bin/heartyfs_read /@backup/dir1/abc.xyz`.
+ *
+ * Data Structures:
+ * - The superblock points at an extension block that holds the snapshot directory and
+ *   the share count table used for copy-on-write.
+ * - Each snapshot is a copy of the root directory sharing every other block with the
+ *   live tree.
+ *
+ * Design Decisions:
+ * - Creating a snapshot only copies the root directory, so it takes O(metadata) time
+ *   and never stops writers for a full image copy.
+ * - Snapshots are read-only; writers get private copies of shared blocks on first use.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+
+/*
+ * @brief Prints every snapshot and the block of its root directory.
+ *
+ * @param dev           The open disk image.
+ */
+void list_snapshots(struct heartyfs_dev *dev)
+{
+    struct heartyfs_ext *ext = heartyfs_get_ext(dev, NULL);
+    if (ext == NULL || ext->snapshot_dir <= 0)
+    {
+        printf("Success: There is no snapshot\n");
+        return;
+    }
+    struct heartyfs_directory *snapshot_dir = heartyfs_block(dev, ext->snapshot_dir);
+    struct heartyfs_dir_cursor cursor;
+    struct heartyfs_dir_entry entry;
+    dir_start(snapshot_dir, &cursor, 0);
+    while (dir_next(snapshot_dir, &cursor, &entry))
+    {
+        printf("Success: Snapshot %s at block %d\n", entry.file_name, entry.block_id);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_snapshot\n");
+
+    // Validate the command
+    if (argc <= 1 || (strcmp(argv[1], "list") != 0 && argc <= 2))
+    {
+        printf("Usage: filename create|delete|list snapshot_name\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    if (strcmp(argv[1], "create") == 0)
+    {
+        if (strlen(argv[2]) > HEARTYFS_NAME_MAX || strchr(argv[2], '/') != NULL)
+        {
+            printf("Error: Invalid snapshot name %s\n", argv[2]);
+        }
+        else heartyfs_snapshot_create(&dev, argv[2], bitmap);
+    }
+    else if (strcmp(argv[1], "delete") == 0) heartyfs_snapshot_delete(&dev, argv[2], bitmap);
+    else if (strcmp(argv[1], "list") == 0) list_snapshots(&dev);
+    else printf("Error: Unknown snapshot command %s\n", argv[1]);
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * heartyfs_stat.c
+ *
+ * Brief
+ * - This program prints the attributes of files and directories: type, size, blocks, links,
+ *   mode, owner, modification and change times, and the extended attributes of files.
+ *
+ *       bin/heartyfs_stat /dir1/a.txt
+ *       bin/heartyfs_stat /dir1/a.txt /dir1/b.txt /@monday/dir1/a.txt
+ *
+ * Data Structures:
+ * - `heartyfs_entry_info`: The attributes of one entry, read by heartyfs_entry_info from the
+ *   inode block alone.
+ *
+ * Design Decisions:
+ * - Many paths can be given to one run, so a tool checking the mtimes of many files opens
+ *   the image once. Each path costs its lookup and one inode read.
+ * - Times are printed as seconds and nanoseconds since the epoch, so they compare exactly
+ *   with those of the host.
+ * - Reading attributes never modifies the image, so it also works inside snapshots.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+#include <limits.h>
+
+/*
+ * @brief Prints the attributes of one entry, then its extended attributes.
+ *
+ * @param dev           The open disk image.
+ * @param path          The path given for the entry.
+ * @param info          The attributes of the entry.
+ */
+void print_stat(struct heartyfs_dev *dev, char *path, struct heartyfs_entry_info *info)
+{
+    if (info->type == 1)
+    {
+        printf("d %s: block %d, %ld entries, %d blocks\n", path, info->block_id, info->size, info->blocks);
+        return;
+    }
+    printf("%c %s: block %d, %ld bytes, %d blocks, %d links, mode %04o, uid %d, gid %d\n",
+            (info->type & INODE_FLAG_COMPRESSED) ? 'c' : '-', path, info->block_id, info->size,
+            info->blocks, info->links, info->mode, info->uid, info->gid);
+    printf("  mtime %lld.%09lld ctime %lld.%09lld\n",
+            (long long) (info->mtime / 1000000000), (long long) (info->mtime % 1000000000),
+            (long long) (info->ctime / 1000000000), (long long) (info->ctime % 1000000000));
+
+    // Copy the inode, the names and values are printed from it
+    struct heartyfs_inode inode;
+    memcpy(&inode, heartyfs_block(dev, info->block_id), sizeof(inode));
+    char names[XATTR_AREA];
+    int length = heartyfs_xattr_list(dev, &inode, names, sizeof(names));
+    for (int offset = 0; offset < length; offset += strlen(names + offset) + 1)
+    {
+        char value[XATTR_AREA];
+        int value_length = heartyfs_xattr_get(dev, &inode, names + offset, value, sizeof(value));
+        printf("  xattr %s = %.*s\n", names + offset, value_length, value);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_stat\n");
+
+    // Validate the command
+    if (argc <= 1)
+    {
+        printf("Usage: filename /path/to/entry [/path/to/entry ...]\n");
+        exit(2);
+    }
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    int missing = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        // Resolve the path, as a directory or as a file
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s", argv[i]);
+        superblock = heartyfs_block(&dev, 0);
+        struct heartyfs_directory *parent_dir = superblock->root_dir;
+        char entry_name[FILENAME_MAX] = "";
+        int diff = dir_string_check(path, entry_name, &dev, &parent_dir, NULL);
+        int block_id = -1;
+        if (diff == 0) block_id = dir_self_id(parent_dir);
+        else if (diff == 1) block_id = search_entry_in_dir(parent_dir, entry_name);
+
+        struct heartyfs_entry_info info;
+        if ((block_id == 0 || block_id > 1) && heartyfs_entry_info(&dev, block_id, entry_name, &info) == 1)
+        {
+            print_stat(&dev, argv[i], &info);
+        }
+        else
+        {
+            printf("Error: No such a file or directory: %s\n", argv[i]);
+            missing++;
+        }
+    }
+
+    // Clean up
+    heartyfs_dev_close(&dev);
+
+    return missing > 0;
+}
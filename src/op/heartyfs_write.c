@@ -19,52 +19,6 @@
  */
 #include "../heartyfs.h"
 
-/*
- * @brief Allocates a data block and updates the inode.
- * 
- * @param superblock Pointer to the superblock with free block info.
- * @param buffer     Memory area containing data blocks.
- * @param bitmap     Bitmap indicating block availability.
- * @param inode      Inode needing a new data block.
- * @param datablock  Pointer to store the address of the allocated block.
- * 
- * @return int       1 on success, -1 if no space or inode full.
- */
-int allocate_datablock(struct heartyfs_superblock *superblock, void *buffer, 
-                        uint8_t *bitmap, struct heartyfs_inode *inode,
-                        struct heartyfs_data_block **datablock)
-{
-    if (superblock->free_blocks > 0)
-    {
-        if (inode->size < MAX_DATA_BLOCKS)
-        {
-            // Get a new datablock
-            int free_block_id = find_free_block(bitmap);
-            *datablock = (struct heartyfs_data_block *)(buffer + free_block_id * BLOCK_SIZE);
-            inode->data_blocks[inode->size] = free_block_id;
-            inode->size++;
-
-            // Mark occupied
-            superblock->free_blocks--;
-            occupy_block(free_block_id, bitmap);
-            return 1;
-        }
-        else 
-        {
-            // The data is still too large
-            printf("Error: The file is larger than %d bytes\n", 
-                    MAX_DATA_BLOCKS * DATA_BLOCK_SIZE);
-            memset(inode->data_blocks, 0, sizeof(inode->data_blocks));
-            return -1;
-        }
-    }
-    else
-    {
-        printf("There is no space left to create a datablock\n");
-        return -1;
-    }
-}
-
 int main(int argc, char *argv[]) 
 {
     printf("heartyfs_write\n");
@@ -76,29 +30,20 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) 
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
     {
-        perror("Cannot open the disk file\n");
-        exit(1);
-    }
-
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) 
-    {
-        perror("Cannot map the disk file onto memory\n");
         exit(1);
     }
 
     // Check whether the filesystem was initialized
-    struct heartyfs_superblock *superblock = (struct heartyfs_superblock *) buffer;
-    uint8_t *bitmap = (uint8_t *)(buffer + BLOCK_SIZE);
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
     if (strcmp(superblock->root_dir->name, "") == 0)
     {
         // Clean up
-        cleanup(buffer, fd);
+        heartyfs_dev_close(&dev);
         printf("Error: File system have not been initialized yet\n");
         exit(-1);
     }
@@ -106,12 +51,13 @@ int main(int argc, char *argv[])
     // Check whether directory is exists or not
     struct heartyfs_directory *parent_dir = superblock->root_dir;
     char file_name[FILENAME_MAX];
-    int diff = dir_string_check(argv[1], file_name, buffer, &parent_dir, bitmap);
+    int diff = dir_string_check(argv[1], file_name, &dev, &parent_dir, bitmap);
     if (diff == 1)
     {
         if (parent_dir->type == 1)
         {
-            int current_block_id = search_entry_in_dir(parent_dir, file_name);
+            // Get a private copy of the inode if a snapshot still shares it
+            int current_block_id = heartyfs_unshare(&dev, parent_dir, file_name, bitmap);
             if (current_block_id > 1) 
             {   
                 // Open the text file for reading
@@ -119,29 +65,33 @@ int main(int argc, char *argv[])
                 if (read_file == NULL) 
                 {
                     // Clean up
-                    cleanup(buffer, fd);
+                    heartyfs_dev_close(&dev);
                     printf("Cannot map the disk file onto memory\n");
                     exit(1);
                 }
 
-                // Read the content DATA_BLOCK_SIZE by DATA_BLOCK_SIZE from the file
-                struct heartyfs_inode *inode = (struct heartyfs_inode *) (buffer + (current_block_id * BLOCK_SIZE));
-                char input_buffer[DATA_BLOCK_SIZE];
+                // Read the content COMPRESS_UNIT_SIZE by COMPRESS_UNIT_SIZE from the file
+                struct heartyfs_inode *inode = heartyfs_block(&dev, current_block_id);
+                if (!heartyfs_pin(&dev, inode))
+                {
+                    fclose(read_file);
+                    heartyfs_dev_close(&dev);
+                    return -1;
+                }
+                heartyfs_charge_file(&dev, current_block_id, dir_self_id(parent_dir));
+                char input_buffer[COMPRESS_UNIT_SIZE];
                 size_t bytesRead;
-                while ((bytesRead = fread(input_buffer, sizeof(char), DATA_BLOCK_SIZE, read_file)) > 0) 
+                while ((bytesRead = fread(input_buffer, sizeof(char), COMPRESS_UNIT_SIZE, read_file)) > 0) 
                 {
-                    // Allocate a data block 
-                    struct heartyfs_data_block *datablock = NULL;
-                    int alloc_status = allocate_datablock(superblock, buffer, bitmap, inode, &datablock);
+                    // Store the unit as plain data blocks, or as one compressed frame
+                    int alloc_status = write_unit(&dev, bitmap, inode, input_buffer, bytesRead);
                     if (alloc_status != 1) 
                     {
-                        cleanup(buffer, fd);
+                        heartyfs_dev_close(&dev);
                         return -1;
                     }
-                    // Copy the content to the data block name
-                    snprintf(datablock->name, sizeof(datablock->name), "%s", input_buffer);
-                    datablock->size = DATA_BLOCK_SIZE;
                 }
+                heartyfs_charge_clear(&dev);
                 printf("Success: Copy the content from: %s to: %s\n", argv[1], argv[2]);
                 fclose(read_file);
             }   
@@ -152,7 +102,7 @@ int main(int argc, char *argv[])
     else printf("Error: The target is not a file: %s\n", file_name);
 
     // Clean up
-    cleanup(buffer, fd);
+    heartyfs_dev_close(&dev);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+/*
+ * heartyfs_xattr.c
+ *
+ * Brief
+ * - This program lists, reads, sets and removes the extended attributes of a file.
+ *
+ *       bin/heartyfs_xattr /dir1/a.txt                      # list the names
+ *       bin/heartyfs_xattr /dir1/a.txt user.etag            # print one value
+ *       bin/heartyfs_xattr /dir1/a.txt user.etag 5f2a9c     # set it
+ *       bin/heartyfs_xattr -d /dir1/a.txt user.etag         # remove it
+ *
+ * Data Structures:
+ * - `heartyfs_xattr_record`: One attribute in the xattr block of the inode.
+ *
+ * Design Decisions:
+ * - Attributes live in one XATTR_AREA-byte block per file, allocated on the first set and
+ *   charged to the quotas of the file; a value that does not fit is refused.
+ * - Setting or removing unshares the inode from the snapshots first, like a write; listing
+ *   and reading work inside snapshots too.
+ *
+ *                                          Created by Nathadon Samairat 18 Oct 2024
+ */
+#include "../heartyfs.h"
+
+int main(int argc, char *argv[])
+{
+    printf("heartyfs_xattr\n");
+
+    // Validate the command
+    int removing = argc > 1 && strcmp(argv[1], "-d") == 0;
+    if (argc <= 1 + removing || (removing && argc != 4) || argc > 4)
+    {
+        printf("Usage: filename [-d] /path/to/file [name [value]]\n");
+        exit(2);
+    }
+    char *path = argv[1 + removing];
+    char *name = argc > 2 + removing ? argv[2 + removing] : NULL;
+    char *value = !removing && argc > 3 ? argv[3] : NULL;
+    int writing = removing || value != NULL;
+
+    // Open the disk file through the block device layer
+    struct heartyfs_dev dev;
+    if (heartyfs_dev_open(&dev, DISK_FILE_PATH) < 0)
+    {
+        exit(1);
+    }
+
+    // Check whether the filesystem was initialized
+    struct heartyfs_superblock *superblock = heartyfs_block(&dev, 0);
+    uint8_t *bitmap = heartyfs_block(&dev, 1);
+    if (strcmp(superblock->root_dir->name, "") == 0)
+    {
+        // Clean up
+        heartyfs_dev_close(&dev);
+        printf("Error: File system have not been initialized yet\n");
+        exit(-1);
+    }
+
+    // Find the file, private to the live tree when it is modified
+    struct heartyfs_directory *parent_dir = superblock->root_dir;
+    char file_name[FILENAME_MAX];
+    int diff = dir_string_check(path, file_name, &dev, &parent_dir, writing ? bitmap : NULL);
+    int block_id = -1;
+    if (diff == 1)
+    {
+        block_id = writing ? heartyfs_unshare(&dev, parent_dir, file_name, bitmap)
+                           : search_entry_in_dir(parent_dir, file_name);
+    }
+    struct heartyfs_inode *inode = block_id > 1 ? heartyfs_block(&dev, block_id) : NULL;
+    if (inode != NULL && inode->type != 1 && writing)
+    {
+        heartyfs_charge_file(&dev, block_id, dir_self_id(parent_dir));
+        inode = heartyfs_block(&dev, block_id);
+    }
+
+    if (inode == NULL || inode->type == 1) printf("Error: The target is not a file: %s\n", file_name);
+    else if (name == NULL)
+    {
+        char names[XATTR_AREA];
+        int length = heartyfs_xattr_list(&dev, inode, names, sizeof(names));
+        for (int offset = 0; offset < length; offset += strlen(names + offset) + 1)
+        {
+            printf("%s\n", names + offset);
+        }
+    }
+    else if (removing)
+    {
+        if (heartyfs_xattr_remove(&dev, block_id, name, bitmap) == 1) printf("Success: Removed %s\n", name);
+        else printf("Error: No such an attribute: %s\n", name);
+    }
+    else if (value != NULL)
+    {
+        if (heartyfs_xattr_set(&dev, block_id, name, value, strlen(value), bitmap) == 1)
+        {
+            printf("Success: Set %s\n", name);
+        }
+        else printf("Error: The attribute %s does not fit in the xattr block\n", name);
+    }
+    else
+    {
+        char found[XATTR_AREA];
+        int length = heartyfs_xattr_get(&dev, inode, name, found, sizeof(found));
+        if (length >= 0) printf("%s = %.*s\n", name, length, found);
+        else printf("Error: No such an attribute: %s\n", name);
+    }
+
+    // Clean up
+    heartyfs_charge_clear(&dev);
+    heartyfs_dev_close(&dev);
+
+    return 0;
+}